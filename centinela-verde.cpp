@@ -5,6 +5,69 @@
 #include <LoRa.h>
 #include <SD.h>
 #include <SPI.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <sd_diskio.h>
+#include <esp_rom_crc.h>
+#include <esp_sleep.h>
+#include <esp32/ulp.h>
+#include <driver/adc.h>
+#include <driver/rtc_io.h>
+#include <driver/pcnt.h>
+#include <soc/rtc.h>
+#include <soc/rtc_cntl_reg.h>
+#include <hal/gpio_ll.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include "nucleo.h"
+
+// --- Almacenamiento ---
+// El backend se elige al compilar; el que no se usa no se compila.
+// SDMMC usa el host nativo (DMA, hasta 40 MHz) y, si el montaje falla, cae a
+// SPI sobre los mismos pines de la ranura con un bus HSPI propio.
+#define LOG_BACKEND_SPI 0
+#define LOG_BACKEND_SDMMC 1
+#define LOG_BACKEND LOG_BACKEND_SPI
+#define SDMMC_1BIT 1            // 0: modo 4 bits (D1-D3 en GPIO4/12/13); choca con FLAME_PIN
+#define SDMMC_FREQ_KHZ 40000
+#define SDMMC_FALLBACK_SPI 1
+
+#if LOG_BACKEND == LOG_BACKEND_SDMMC
+#include <SD_MMC.h>
+#endif
+
+// Registro de respaldo en la flash interna (LittleFS) mientras no hay SD:
+// FallbackLog y FALLBACK_SEGMENT_BYTES/BATCH_BYTES/SYNC_BYTES en nucleo.h
+#define LOG_PATH "/log_incendios.txt"
+#define FALLBACK_ACTIVE_PATH "/fb_0.log"
+#define FALLBACK_OLD_PATH "/fb_1.log"
+#define FALLBACK_POS_PATH "/fb_pos"   // bytes del segmento antiguo ya migrados
+// Los agregados van a segmentos propios para que la migración los lleve a AGG_PATH
+#define AGG_FALLBACK_ACTIVE_PATH "/agg_0.log"
+#define AGG_FALLBACK_OLD_PATH "/agg_1.log"
+#define AGG_FALLBACK_POS_PATH "/agg_pos"
+#define SD_RETRY_INTERVAL_MS 60000
+
+// Modo crudo para tarjetas dedicadas: registros binarios de 32 bytes en un
+// anillo de sectores sin FAT, con un superbloque que guarda cabeza y cola.
+// Cada anexado reescribe solo el sector en curso. Solo con el backend SPI.
+// RawRecord y RawRing en nucleo.h; la exportación entrega los registros y
+// tools/raw2csv los pasa a CSV, igual que una imagen de la tarjeta.
+#define RAW_LOG 0
+#define RAW_FIRST_SECTOR 2048       // superbloque; los datos empiezan en el siguiente
+#define RAW_SUPERBLOCK_EVERY 64     // sectores completados entre actualizaciones
+#define RAW_SD_FREQ_HZ 20000000
+#define RAW_EXPORT_NAME "/anillo_crudo.bin"  // nombre en la cabecera de exportación
+
+#if RAW_LOG && LOG_BACKEND != LOG_BACKEND_SPI
+#error "RAW_LOG requiere LOG_BACKEND_SPI"
+#endif
 
 // --- Pines GPIO ---
 #define DHT_PIN 27
@@ -12,60 +75,1174 @@
 DHT dht(DHT_PIN, DHT_TYPE);
 
 #define ONE_WIRE_BUS 26
+#define DS18B20_RESOLUCION 12  // bits; 12 = 750 ms de conversión, 10 = 188 ms
 OneWire oneWire(ONE_WIRE_BUS);
 DallasTemperature sensors(&oneWire);
 
 #define MQ2_PIN 34
 #define MQ135_PIN 35
+#define MQ_OVERSAMPLE 16       // lecturas promediadas por canal y muestra
+#define MQ_OVERSAMPLE_GAP_MS 2 // separación entre lecturas, cediendo la CPU
+
+// Calefactores de los MQ conmutados por MOSFET (activo a nivel alto). En ciclo
+// un temporizador los enciende antes de la muestra que mide; con alerta MEDIA o
+// superior quedan encendidos. Una vez al día el ciclo se alarga hasta el
+// equilibrio térmico para calibrar la lectura parcial.
+// MQ_CICLO_MS, MQ_PRECALENTAMIENTO_MS y MQ_CALENTADO_COMPLETO_MS en nucleo.h
+#define MQ_HEATER_DUTY 0               // 1: ciclar siempre; 0: solo en perfiles de ahorro
+#define MQ_RECALIBRACION_MS 86400000
+#define MQ_HEATER_MA 300               // los dos calefactores juntos
+
+// Sensor de partículas PMS5003 en UART2, en modo pasivo: solo envía una trama
+// cuando se le pide, así el búfer no se llena entre muestras con tramas viejas
+// (en modo activo manda hasta 5 por segundo).
+#define PMS_RX_PIN 16  // TX del sensor
+#define PMS_TX_PIN 17
+#define PMS_SET_PIN 21 // LOW: sensor y ventilador dormidos
+#define PMS_BAUD 9600
+#define PMS_RX_BUFFER 256  // una respuesta son 32 bytes
+
+// Sensor de llama IR con salida digital. Su interrupción dispara una muestra
+// inmediata sin esperar al periodo; el antirrebote se hace en la ISR de un
+// temporizador hardware que se rearma en cada flanco.
+#define FLAME_PIN 4              // RTC_GPIO10: también despierta del sueño profundo
+#define FLAME_ACTIVE_LEVEL LOW
+#define FLAME_DEBOUNCE_US 20000
+#define FLAME_POLL_US 5000       // periodo del temporizador que vigila el antirrebote
+#define FLAME_TIMER_NUM 1
+#define FLAME_MIN_INTERVAL_MS 1000  // entre muestras rápidas consecutivas
+
+// Anemómetro de cazoletas en el contador de pulsos (PCNT) y veleta resistiva
+// en el ADC. Cada segundo se acumulan racha (media de 3 s) y vector de dirección.
+// WIND_KMH_PER_HZ, WIND_GUST_SECONDS y la veleta en nucleo.h
+#define ANEMOMETER_PIN 32
+#define ANEMOMETER_PCNT_UNIT PCNT_UNIT_0
+#define WIND_VANE_PIN 36
 
 #define LORA_SCK 18
 #define LORA_MISO 19
 #define LORA_MOSI 23
 #define LORA_CS 5
-#define LORA_RST 14
-#define LORA_DIO0 2
 #define LORA_FREQUENCY 433E6
+#define LORA_SF 7
+#define LORA_BW 125E3
+#define LORA_CR 5  // 4/5
 
+#if LOG_BACKEND == LOG_BACKEND_SDMMC
+// La ranura SDMMC ocupa CLK=14, CMD=15, D0=2 y D3=13 (CS en el fallback SPI).
+// GPIO12 (D2) es pin de arranque: en modo 4 bits hay que fijar VDD_SDIO por eFuse.
+// En modo 4 bits el LED pasaría a GPIO21, que ya es PMS_SET_PIN: no compila.
+#define LORA_RST -1  // reset del SX127x atado a 3V3
+#define LORA_DIO0 22
+#define SDMMC_CLK 14
+#define SDMMC_CMD 15
+#define SDMMC_D0 2
+#define SDMMC_D3 13
+#if SDMMC_1BIT
+#define LED_PIN 12
+#else
+#define LED_PIN 21
+#endif
+#define BUZZER_PIN 25
+#define MQ_HEATER_PIN -1  // sin pin libre: calefactores siempre alimentados
+#else
+#define LORA_RST 14
+#define LORA_DIO0 2
 #define LED_PIN 12
 #define BUZZER_PIN 13
+#define MQ_HEATER_PIN 25  // RTC_GPIO6: puede mantenerse durante el sueño profundo
+#endif
 
 #define SD_CS_PIN 15
 
+#if LED_PIN == PMS_SET_PIN
+#error "LED_PIN y PMS_SET_PIN comparten GPIO: reasignar uno de los dos"
+#endif
+
+// D1 del modo 4 bits es GPIO4, la entrada de llama. No queda otro GPIO de RTC
+// libre que pueda despertar del sueño profundo (0 es de arranque).
+#if LOG_BACKEND == LOG_BACKEND_SDMMC && !SDMMC_1BIT && FLAME_PIN == 4
+#error "SDMMC en modo 4 bits usa GPIO4 (D1), que es FLAME_PIN: usar SDMMC_1BIT"
+#endif
+
 // --- Umbrales críticos ---
 #define TEMP_CRITICA 40.0
 #define HUM_CRITICA 20.0
 #define GAS_UMBRAL_MQ2 1500
 #define GAS_UMBRAL_MQ135 1200
+#define PM25_UMBRAL 100  // µg/m³, humo cercano
+#define RACHA_UMBRAL_KMH 40.0  // con alerta activa, el viento sube un nivel
+
+// --- Índice meteorológico de incendios (FWI canadiense) ---
+// Se calcula una vez al día con la observación de mediodía. Con FWI alto los
+// umbrales de temperatura, humedad y gas se vuelven más sensibles.
+#define FWI_FFMC_INICIAL 85.0  // valores estándar de arranque de temporada
+#define FWI_DMC_INICIAL 6.0
+#define FWI_DC_INICIAL 15.0
+#define FWI_MES_DEFECTO 7       // mes (1-12) de los factores de día si el reloj no está en hora
+#define FWI_UMBRAL_MUY_ALTO 20.0  // clase "muy alto" del sistema canadiense
+#define FWI_AJUSTE_TEMP 5.0       // °C que baja TEMP_CRITICA en días de peligro
+#define FWI_AJUSTE_HUM 10.0       // puntos que sube HUM_CRITICA
+#define FWI_GAS_PCT 80            // % de los umbrales de gas que se aplica
+
+// --- Umbrales adaptativos ---
+// Línea base por hora del día; márgenes, límites y ventana (ADAPT_*) en nucleo.h
+#define ADAPTIVE_THRESHOLDS 1
+#define ADAPT_GUARDADO_MS 3600000    // cada cuánto se guarda la línea base en NVS
+
+// --- Reloj ---
+// Hora del sistema (time()); sobrevive al sueño profundo pero no a un corte de
+// alimentación. Antes de ponerla en hora los días se cuentan desde el arranque.
+// ZONA_HORARIA y RELOJ_VALIDO_DESDE en nucleo.h
+
+// Ciclo del ventilador del PMS5003: el sensor se despierta PMS_ESTABILIZACION_MS
+// antes de cada medida y se duerme tras ella. Con alerta MEDIA o superior queda
+// encendido.
+#define PMS_CICLO_MS 60000
+#define PMS_ESTABILIZACION_MS 30000
+
+// --- Bajo consumo ---
+#define USE_DEEP_SLEEP 0          // 1: dormir entre muestras con vigilancia ULP de gases
+#define SAMPLE_PERIOD_MS 5000
+#define SAMPLE_TIMER_NUM 0        // temporizador hardware que marca el periodo
+#define RADIO_DRAIN_TIMEOUT_MS 3000  // espera máxima a la radio antes de dormir
+#define ULP_PERIODO_US 250000     // la ULP muestrea MQ2/MQ135 cada 250 ms
+#define ULP_SUBIDA_MQ2 300        // subida entre dos lecturas ULP que despierta la CPU
+#define ULP_SUBIDA_MQ135 250
+#define ULP_REARME_MQ2 150        // bajada bajo el umbral que lo vuelve a armar
+#define ULP_REARME_MQ135 120
+#define ULP_ADC_MQ2 ADC1_CHANNEL_6    // GPIO34
+#define ULP_ADC_MQ135 ADC1_CHANNEL_7  // GPIO35
+
+// --- Alimentación ---
+// Vigilancia de la batería por ADC. El detector de brown-out del chip reinicia
+// sin avisar, así que el corte se anticipa midiendo la tensión: al caer bajo
+// POWER_FAIL_MV se vacía el log, se guardan contadores y se emite un último
+// mensaje LoRa antes de que el regulador deje de sostener la placa.
+#define BATTERY_PIN 39             // ADC1_CH3, divisor resistivo 1:2 desde la batería
+#define BATTERY_DIVIDER 2.0
+#define POWER_CHECK_MS 50
+#define POWER_FAIL_MV 3300
+#define POWER_RESTORE_MV 3500      // histéresis para rearmar la detección
+#define POWER_FAIL_SAMPLES 2       // lecturas seguidas bajo el umbral
+#define POWER_FAIL_BUDGET_MS 150   // desde la detección hasta terminar el vaciado
+#define POWER_FAIL_RESERVE_MS 40   // del presupuesto, para sincronizar y guardar contadores
+
+// --- Energía ---
+// Perfiles de recorte de carga según el estado de la batería. Con alerta MEDIA
+// o superior se vuelve siempre al perfil normal: la detección manda.
+#define SOLAR_PIN 33               // ADC1_CH5, divisor 1:3 desde el panel
+#define SOLAR_DIVIDER 3.0
+#define SOLAR_CHARGING_MV 4500     // por encima, el panel está cargando
+#define BATTERY_CAPACITY_MAH 3000
+#define ENERGY_CHECK_MS 60000
+// ENERGY_SOC_*, ENERGY_HISTERESIS y ENERGY_AUTONOMIA_MARGEN_H en nucleo.h
+#define LORA_TX_POWER_DBM 17       // potencia del perfil normal (la de la librería)
+
+// --- Telemetría ---
+// En nivel BAJA el nodo y el colector ejecutan el mismo predictor por canal
+// (último valor más tendencia lineal). Solo se transmiten los canales cuya
+// lectura se aparta de la predicción más de su épsilon, así que el colector
+// reconstruye la serie con ese error máximo. Los épsilon van en las unidades
+// escaladas de cada canal (décimas o cuentas).
+#define TELEMETRY 1
+#define TEL_HEARTBEAT_MS 900000   // trama completa aunque nada cambie
+#define TEL_EPS_TEMP10 5          // 0,5 °C
+#define TEL_EPS_HUM10 20          // 2 %
+#define TEL_EPS_MQ 50             // cuentas de ADC
+#define TEL_EPS_PM25 5            // µg/m³
+#define TEL_EPS_VIENTO10 30       // 3 km/h
+#define TEL_QUEUE_DEPTH 4
+
+// --- Agregación ---
+// Por canal de telemetría: n, mínimo, máximo, media y desviación en cubetas de
+// 1 min, 15 min y 1 h alineadas con la hora del sistema. Las cubetas van al
+// fichero de agregados y, desde AGG_RADIO_DESDE, también por radio. Las
+// muestras crudas solo se guardan alrededor de las alertas.
+#define AGG_PATH "/agregados.csv"
+#define AGG_QUEUE_DEPTH 4
+#define AGG_RADIO_DESDE 1          // índice de la primera cubeta que se emite por radio (15 min)
+#define LOG_RAW_SIEMPRE 0          // 1: log crudo de todas las muestras
+#define AGG_RAW_PRE_SAMPLES 12     // muestras previas a una alerta que se conservan
+#define AGG_RAW_POST_MS 300000     // log crudo tras la última muestra en alerta
+
+// Resumen diario binario: un registro de tamaño fijo por día, añadido al
+// cambiar de día. Permite consultar una temporada sin recorrer el log.
+// DailySummary y DAILY_MAGIC en nucleo.h. Sin SD va a la flash interna con el
+// mismo nombre y se migra como el resto del respaldo.
+#define DAILY_PATH "/resumen_diario.bin"
+#define DAILY_FALLBACK_OLD_PATH "/resumen_diario_1.bin"
+#define DAILY_FALLBACK_POS_PATH "/resumen_pos"
+
+// --- Exportación por Serial ---
+// El log se extrae por el puerto serie en tramas con CRC, sin sacar la SD
+#define SERIAL_BAUD 115200
+#define EXPORT_BAUD 921600
+#define EXPORT_TX_BUFFER 4096     // búfer de envío del UART, caben varias tramas
+#define EXPORT_CHUNK 1024         // bytes de log por trama; más largas comprimen mejor
+#define EXPORT_FRAME_OVERHEAD 13  // cabecera de 9 bytes y CRC
+#define EXPORT_COMPRESS 1         // compresión LZ por trama cuando reduce el tamaño
+#define EXPORT_FRAMES_PER_POLL 4  // tramas por despertar, el resto del log no espera
+#define EXPORT_POLL_MS 2
+// EXPORT_LZ_HASH en nucleo.h
+#define EXPORT_ABORT 0x18         // CAN del receptor cancela la exportación
+
+// --- Consola serie ---
+// Órdenes de diagnóstico por Serial, atendidas por la tarea de log (núcleo de E/S)
+#define SERIAL_POLL_MS 100        // sondeo de órdenes en la tarea de log
+#define CLI_LINE_MAX 64           // las líneas más largas se descartan enteras
+
+// --- Transferencia masiva LoRa ---
+// Cargas de varios KB (un rango del log) en fragmentos con paridad Reed-Solomon:
+// la pasarela reconstruye con cualquier k de los k + m fragmentos.
+// BULK_FRAG_BYTES y BULK_MAX_DATA/PARITY/FRAGS en nucleo.h
+#define BULK_REDUNDANCIA_PCT 25     // fragmentos de paridad sobre los de datos
+#define BULK_HEADER_BYTES 12
+#define BULK_RETRY_MS 1000
+#define BULK_RECEPTOR 0             // decodificador y banco de pruebas (+14 KB de RAM)
+// Banda de 433 MHz (ERC 70-03): 10% de ciclo de trabajo por hora
+#define LORA_DUTY_CYCLE_PCT 10
+#define LORA_DUTY_WINDOW_MS 3600000
+
+// --- Tareas ---
+// Sensado y evaluación en un núcleo; radio, SD y Serial en el otro
+#define SENSING_CORE 1
+#define IO_CORE 0
+#define SENSING_TASK_PRIO 3
+#define RADIO_TASK_PRIO 2
+#define LOG_TASK_PRIO 1
+#define TASK_STACK_SIZE 4096
+#define QUEUE_DEPTH 8
+#define STATS_INTERVAL_SAMPLES 12  // cada cuántas muestras se imprimen estadísticas
+#define LATENCY_BUCKETS 24         // histograma en potencias de dos de us, hasta ~8 s
+
+// Bits de notificación de la tarea de sensado
+#define SENSING_NOTIFY_FLAME (1 << 0)
+#define SENSING_NOTIFY_SAMPLE (1 << 1)
+
+// Bits de notificación de la tarea de radio
+// El fin de TX va por txDoneSem: esperarlo aquí consumiría el resto de bits
+#define RADIO_NOTIFY_QUEUE (1 << 0)
+#define RADIO_NOTIFY_POWER_FAIL (1 << 2)
+#define RADIO_NOTIFY_TELEMETRY (1 << 3)
+#define RADIO_NOTIFY_ROLLUP (1 << 4)
+#define RADIO_NOTIFY_BULK (1 << 5)
+#define LORA_TX_TIMEOUT_MS 2000
+#define LORA_MSG_MAX 192  // los agregados llevan min/media/max de todos los canales
+#define LOG_LINE_MAX 128  // peor caso comprobado con static_assert en logDataToSD
+#define LEVEL_STR_MAX 11  // "DESCONOCIDO"; FMT_*_MAX en nucleo.h
+
+// --- Bus SPI ---
+#define SD_BLOCK_SIZE 512  // las escrituras largas ceden el bus en cada bloque
+// Los ficheros de la SD quedan abiertos entre registros y se sincronizan (datos,
+// FAT y directorio) cada SD_SYNC_MS con su propia toma del bus, no en cada
+// registro. Un corte avisado o el sueño profundo sincronizan antes.
+#define SD_SYNC_MS 10000
 
 // --- Variables ---
-float currentTemperature = 0.0;
-float currentHumidity = 0.0;
-int mq2Value = 0;
-int mq135Value = 0;
-float internalTemperature = 0.0;
-
-enum AlertLevel {
-  AL_BAJA,
-  AL_MEDIA,
-  AL_ALTA,
-  AL_CRITICA
-};
+// AlertLevel, TelChannel y SampleRecord en nucleo.h
 AlertLevel currentAlertLevel = AL_BAJA;
 
+
+// Cola SPSC acotada sin bloqueos: un solo productor y un solo consumidor.
+// Guarda N - 1 elementos; push() falla en vez de bloquear si está llena.
+template <typename T, size_t N>
+class SpscQueue {
+ public:
+  SpscQueue() : head_(0), tail_(0) {}
+
+  bool push(const T& item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) % N;
+    if (next == tail_.load(std::memory_order_acquire)) return false;
+    items_[head] = item;
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    item = items_[tail];
+    tail_.store((tail + 1) % N, std::memory_order_release);
+    return true;
+  }
+
+  // Exacto solo desde el consumidor; el productor puede añadir mientras tanto
+  size_t size() const {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    return (head + N - tail) % N;
+  }
+
+ private:
+  T items_[N];
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+};
+
+struct LatencyStats {
+  uint32_t count;
+  int64_t minUs;
+  int64_t maxUs;
+  int64_t sumUs;
+  uint32_t buckets[LATENCY_BUCKETS];  // [2^k, 2^(k+1)) us; la última acumula el resto
+
+  void record(int64_t us) {
+    if (count == 0 || us < minUs) minUs = us;
+    if (count == 0 || us > maxUs) maxUs = us;
+    sumUs += us;
+    count++;
+    int k = 0;
+    while (k < LATENCY_BUCKETS - 1 && (us >> (k + 1)) > 0) k++;
+    buckets[k]++;
+  }
+};
+
+enum SpiClient {
+  SPI_CLIENT_RADIO,
+  SPI_CLIENT_SD,
+  SPI_CLIENT_COUNT
+};
+
+// Árbitro del bus SPI compartido por LoRa y SD. El mutex de FreeRTOS despierta
+// primero a la tarea de mayor prioridad (radio sobre log); las escrituras largas
+// de SD ceden el bus en cada frontera de bloque si la radio está esperando.
+class SpiBusManager {
+ public:
+  void begin() { mutex_ = xSemaphoreCreateMutex(); }
+
+  void acquire(SpiClient client) {
+    int64_t start = esp_timer_get_time();
+    waiting_[client]++;
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    waiting_[client]--;
+    waitStats[client].record(esp_timer_get_time() - start);
+  }
+
+  void release() { xSemaphoreGive(mutex_); }
+
+  // Punto de preempción para la SD entre bloques
+  void yieldToRadio() {
+    if (waiting_[SPI_CLIENT_RADIO].load() == 0) return;
+    preemptions++;
+    release();
+    acquire(SPI_CLIENT_SD);
+  }
+
+  LatencyStats waitStats[SPI_CLIENT_COUNT];
+  uint32_t preemptions;
+
+ private:
+  SemaphoreHandle_t mutex_;
+  std::atomic<int> waiting_[SPI_CLIENT_COUNT];
+};
+
+SpiBusManager spiBus;
+SpscQueue<SampleRecord, QUEUE_DEPTH> radioQueue;
+
+// TrendPredictor, el predictor compartido con el colector, está en nucleo.h
+
+// Trama de telemetría: la forma la tarea de sensado, la envía la de radio
+struct TelemetryFrame {
+  uint32_t seq;
+  uint32_t timeMs;  // telemetryTimeMs(), la base de tiempo del predictor
+  uint8_t mask;     // bit por TelChannel incluido
+  bool full;        // latido o resincronización: todos los canales válidos
+  int32_t values[TEL_COUNT];
+};
+SpscQueue<TelemetryFrame, TEL_QUEUE_DEPTH> telemetryQueue;
+
+struct TelemetryStats {
+  uint32_t samples;    // muestras en BAJA evaluadas
+  uint32_t frames;
+  uint32_t heartbeats;
+  uint32_t updates;    // canales transmitidos
+  uint32_t suppressed; // canales que el colector predice
+  uint32_t drops;
+  int32_t maxError[TEL_COUNT];  // mayor error de reconstrucción suprimido
+};
+// Acumulador de Welford: media y varianza en una pasada, memoria constante
+struct ChannelAggregate {
+  uint32_t count;
+  float min;
+  float max;
+  float mean;
+  float m2;
+
+  void add(float x) {
+    if (count == 0 || x < min) min = x;
+    if (count == 0 || x > max) max = x;
+    count++;
+    float delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+
+  float stddev() const { return count > 1 ? sqrtf(m2 / (count - 1)) : 0.0f; }
+};
+
+#define AGG_PERIODS 3
+const uint32_t kAggPeriodS[AGG_PERIODS] = {60, 900, 3600};
+
+struct Rollup {
+  uint8_t period;   // índice en kAggPeriodS
+  uint32_t startS;  // inicio de la cubeta, time()
+  ChannelAggregate channels[TEL_COUNT];
+};
+SpscQueue<Rollup, AGG_QUEUE_DEPTH> rollupLogQueue;
+SpscQueue<Rollup, AGG_QUEUE_DEPTH> rollupRadioQueue;
+
+// En RTC para no perder las cubetas en curso al dormir
+RTC_DATA_ATTR ChannelAggregate aggregates[AGG_PERIODS][TEL_COUNT];
+RTC_DATA_ATTR uint32_t aggBucket[AGG_PERIODS];
+
+// Día en curso, en RTC como las cubetas de agregación
+struct DailyAccumulator {
+  int32_t day;
+  uint32_t startS;
+  ChannelAggregate channels[TEL_COUNT];
+  uint32_t msAtLevel[AL_CRITICA + 1];
+  uint16_t dhtErrors;
+  uint16_t ds18b20Errors;
+  uint16_t pmInvalid;
+  uint16_t flameEvents;
+};
+RTC_DATA_ATTR DailyAccumulator dailyAcc;
+SpscQueue<DailySummary, 2> dailyQueue;
+
+// Trama: A5 5A | tipo | longitud (2) | offset (4) | carga | crc32 (4), en
+// little endian. El CRC cubre desde el tipo hasta el final de la carga.
+enum ExportFrameType : uint8_t {
+  EXP_CABECERA = 'H',  // tamaño del fichero, fin del rango, baudios, trozo, ruta
+  EXP_DATOS = 'D',
+  EXP_LZ = 'Z',        // carga comprimida, se descomprime sola
+  EXP_FIN = 'E'        // bytes leídos, bytes enviados, ms, completa
+};
+
+// El log como bytes desde un offset, para exportar o enviar por LoRa: el
+// fichero LOG_PATH o, en modo crudo, los registros del anillo
+struct LogReader {
+  File file;
+  uint32_t size;
+};
+
+struct LogExport {
+  bool active;
+  bool compress;
+  LogReader reader;
+  uint32_t offset;
+  uint32_t end;
+  uint32_t bytesRead;
+  uint32_t bytesSent;
+  uint32_t startMs;
+};
+
+struct ExportStats {
+  uint32_t exports;
+  uint32_t lastBytes;     // bytes de log de la última exportación
+  uint32_t lastSent;      // bytes en la línea, con tramas y compresión
+  uint32_t lastMs;
+};
+
+// Fragmento: 'B' 'K' | id | índice | k | m | longitud (2) | crc32 de la carga (4)
+// | BULK_FRAG_BYTES. Índices < k son datos, el resto paridad.
+struct BulkTransfer {
+  std::atomic<bool> active;  // lo activa la tarea de log, lo apaga la de radio
+  uint8_t id;
+  uint8_t k;
+  uint8_t m;
+  uint8_t next;
+  uint16_t length;
+  uint32_t crc;
+  uint32_t startMs;
+  uint32_t airtimeMs;
+  uint8_t frags[BULK_MAX_FRAGS][BULK_FRAG_BYTES];
+};
+
+// Lado receptor: el mismo código que corre en la pasarela
+struct BulkReassembly {
+  uint8_t id;
+  uint8_t k;
+  uint8_t m;
+  uint8_t count;
+  uint16_t length;
+  uint32_t crc;
+  uint64_t received;  // bit por fragmento
+  bool complete;
+  uint8_t frags[BULK_MAX_FRAGS][BULK_FRAG_BYTES];
+};
+
+// Crédito de tiempo en el aire: cubo de fichas que se rellena al ritmo del
+// ciclo de trabajo. Las alertas nunca esperan, pero también lo gastan.
+struct DutyCycle {
+  int64_t creditMs;
+  uint32_t lastMs;
+  uint32_t usedMs;
+
+  void refill(uint32_t now) {
+    creditMs += (int64_t)(now - lastMs) * LORA_DUTY_CYCLE_PCT / 100;
+    const int64_t maxCredit = (int64_t)LORA_DUTY_WINDOW_MS * LORA_DUTY_CYCLE_PCT / 100;
+    if (creditMs > maxCredit) creditMs = maxCredit;
+    lastMs = now;
+  }
+  void charge(uint32_t airtimeMs) {
+    refill(millis());
+    creditMs -= airtimeMs;
+    usedMs += airtimeMs;
+  }
+  // 0 si puede transmitir ya
+  uint32_t waitMs(uint32_t airtimeMs) {
+    refill(millis());
+    if (creditMs >= airtimeMs) return 0;
+    return (airtimeMs - creditMs) * 100 / LORA_DUTY_CYCLE_PCT;
+  }
+};
+
+struct AggregationStats {
+  uint32_t rollups;
+  uint32_t drops;
+  uint32_t rawKept;     // muestras escritas en el log crudo
+  uint32_t rawSkipped;  // muestras resumidas solo en los agregados
+};
+AggregationStats aggregationStats = {0, 0, 0, 0};
+
+// Ventana de log crudo, solo la tarea de log
+SampleRecord rawPreEvent[AGG_RAW_PRE_SAMPLES];
+uint8_t rawPreCount = 0;
+uint8_t rawPrePos = 0;
+bool rawAlertSeen = false;
+int64_t rawLastAlertUs = 0;
+
+// Solo la tarea de sensado; en RTC para que el sueño profundo no obligue a
+// mandar una trama completa en cada despertar
+RTC_DATA_ATTR TrendPredictor telemetryPredictors[TEL_COUNT];
+TelemetryStats telemetryStats = {0, 0, 0, 0, 0, 0, {0}};
+RTC_DATA_ATTR uint32_t lastTelemetryMs = 0;
+RTC_DATA_ATTR bool telemetryResync = true;
+std::atomic<bool> radioBusy(false);  // la tarea de radio tiene tramas entre manos
+SpscQueue<SampleRecord, QUEUE_DEPTH> logQueue;
+TaskHandle_t sensingTaskHandle = NULL;
+TaskHandle_t radioTaskHandle = NULL;
+TaskHandle_t logTaskHandle = NULL;
+SemaphoreHandle_t txDoneSem = NULL;  // DIO0 -> tarea de radio
+std::atomic<uint32_t> radioDrops(0);
+std::atomic<uint32_t> radioOverflows(0);  // tramas que no cabían en LORA_MSG_MAX
+std::atomic<uint32_t> logDrops(0);
+std::atomic<uint32_t> logDoneSeq(0);
+LatencyStats txLatency = {0, 0, 0, 0};  // lectura de sensores -> fin de TX LoRa
+LatencyStats flameTxLatency = {0, 0, 0, 0};  // flanco de llama -> fin de TX LoRa
+
+// Muestreo periódico: la ISR del temporizador fecha cada periodo y la tarea de
+// sensado usa esa marca como readUs, así las muestras quedan equiespaciadas
+// aunque la tarea tarde más o menos en atenderlas.
+hw_timer_t* sampleTimer = NULL;
+portMUX_TYPE sampleMux = portMUX_INITIALIZER_UNLOCKED;
+int64_t sampleTickUs = 0;
+uint32_t sampleTicks = 0;
+int64_t lastSampleTickUs = 0;
+uint32_t lastSampleTicks = 0;
+LatencyStats samplingJitter = {0, 0, 0, 0};  // |intervalo entre ISR - periodo|
+LatencyStats samplingDelay = {0, 0, 0, 0};   // ISR -> inicio de la lectura
+uint32_t missedSamples = 0;
+
+// Corte de alimentación: el temporizador de vigilancia detecta y avisa a las
+// tareas de radio y log, que hacen el resto en su contexto habitual
+esp_timer_handle_t powerTimer = NULL;
+std::atomic<bool> powerFailPending(false);
+std::atomic<bool> lastGaspPending(false);  // la tarea de radio lo mira entre trama y trama
+bool powerFailing = false;      // solo lo toca el temporizador
+uint8_t powerLowCount = 0;
+int64_t powerFailUs = 0;
+uint16_t powerFailMv = 0;
+std::atomic<uint32_t> lastSampleSeq(0);
+
+// Registro del último corte, en NVS para leerlo tras el siguiente arranque
+struct PowerFailRecord {
+  uint32_t count;       // cortes acumulados
+  uint32_t lastSeq;     // última muestra tomada
+  uint32_t flushed;     // registros vaciados en la emergencia
+  uint32_t pending;     // registros que no cupieron en el presupuesto
+  uint32_t flushUs;     // detección -> fin del vaciado
+  uint32_t radioDrops;
+  uint32_t logDrops;
+  uint32_t levelTransitions[AL_CRITICA + 1];
+  uint16_t batteryMv;
+};
+PowerFailRecord powerFailRecord;
+
+// Estado del sensor de llama, compartido con sus ISR bajo flameMux
+hw_timer_t* flameTimer = NULL;
+portMUX_TYPE flameMux = portMUX_INITIALIZER_UNLOCKED;
+int64_t flameEdgeUs = 0;      // primer flanco de la racha
+int64_t flameLastEdgeUs = 0;  // último flanco: el antirrebote cuenta desde aquí
+bool flamePending = false;
+
+// Acumuladores de viento: los escribe el temporizador de 1 s y los consume la
+// tarea de sensado en cada muestra
+WindSampler windSampler;
+int16_t windLastCount = 0;  // solo el temporizador
+portMUX_TYPE windMux = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t windTimer = NULL;
+
+// --- Registro de sensores ---
+// Cada driver rellena sus campos de SampleRecord y sabe escribir sus columnas
+// de log y sus campos de radio. SensorRegistry compone la lista en compilación:
+// el bucle de lectura, la cabecera y las líneas se generan por expansión de
+// parámetros, con llamadas estáticas que el compilador alinea.
+// Para añadir un sensor: campos en SampleRecord, un driver y añadirlo a NodeSensors.
+//
+// La lectura va en tres fases para solapar sensores: start() lanza lo que el
+// sensor hace solo (conversión del DS18B20), read() hace las adquisiciones
+// síncronas (DHT22, sobremuestreo de los MQ) y collect() recoge lo lanzado.
+// La fase completa dura lo que el sensor más lento, no la suma.
+enum AcqPhase {
+  FASE_INICIO,
+  FASE_LECTURA,
+  FASE_RECOGIDA,
+  FASE_COUNT
+};
+
+// Traza de la última adquisición, en µs desde readUs
+#define TRACE_MAX_DRIVERS 8
+struct AcquisitionTrace {
+  uint32_t seq;
+  uint32_t beginUs[TRACE_MAX_DRIVERS][FASE_COUNT];
+  uint32_t endUs[TRACE_MAX_DRIVERS][FASE_COUNT];
+};
+AcquisitionTrace acquisitionTrace;
+LatencyStats acquisitionStats = {0, 0, 0, 0};
+void printTraceRow(const char* name, int idx);
+
+// Cabecera, columnas de log y campos de radio en SensorColumns (nucleo.h)
+template <typename... Drivers>
+struct SensorRegistry : SensorColumns<Drivers...> {
+  static void beginAll() {
+    int expand[] = {0, (Drivers::begin(), 0)...};
+    (void)expand;
+  }
+
+  static void readAll(SampleRecord& sample) {
+    static_assert(sizeof...(Drivers) <= TRACE_MAX_DRIVERS, "ampliar TRACE_MAX_DRIVERS");
+    acquisitionTrace.seq = sample.seq;
+    runPhase(FASE_INICIO, sample);
+    runPhase(FASE_LECTURA, sample);
+    runPhase(FASE_RECOGIDA, sample);
+    acquisitionStats.record(esp_timer_get_time() - sample.readUs);
+  }
+
+  // Una fila CSV por driver: traza,<sensor>,<fase>,<inicio_us>,<fin_us>
+  static void printTrace() {
+    int idx = 0;
+    int expand[] = {0, (printTraceRow(Drivers::name(), idx++), 0)...};
+    (void)expand;
+  }
+
+  static void printAll(const SampleRecord& sample) {
+    int expand[] = {0, (Drivers::print(sample), 0)...};
+    (void)expand;
+  }
+
+ private:
+  template <typename D>
+  static int tracedPhase(int idx, AcqPhase phase, SampleRecord& sample) {
+    int64_t begin = esp_timer_get_time();
+    switch (phase) {
+      case FASE_INICIO: D::start(sample); break;
+      case FASE_LECTURA: D::read(sample); break;
+      default: D::collect(sample); break;
+    }
+    acquisitionTrace.beginUs[idx][phase] = begin - sample.readUs;
+    acquisitionTrace.endUs[idx][phase] = esp_timer_get_time() - sample.readUs;
+    return 0;
+  }
+
+  static void runPhase(AcqPhase phase, SampleRecord& sample) {
+    int idx = 0;
+    int expand[] = {0, tracedPhase<Drivers>(idx++, phase, sample)...};
+    (void)expand;
+  }
+};
+
+struct Dht22Driver {
+  static const char* name() { return "DHT22"; }
+  static void begin();
+  static void start(SampleRecord& sample) {}
+  static void read(SampleRecord& sample);
+  static void collect(SampleRecord& sample) {}
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",temp,hum"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample);
+  static constexpr size_t kLogMax = 2 * (1 + FMT_FIXED_MAX(1));
+  static constexpr size_t kRadioMax =
+      sizeof(",Temp:") + sizeof(",Hum:") - 2 + 2 * FMT_FIXED_MAX(1);
+};
+
+struct Ds18b20Driver {
+  static const char* name() { return "DS18B20"; }
+  static void begin();
+  static void start(SampleRecord& sample);
+  static void read(SampleRecord& sample) {}
+  static void collect(SampleRecord& sample);
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",temp_interna"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample) { return out; }
+  static constexpr size_t kLogMax = 1 + FMT_FIXED_MAX(1);
+  static constexpr size_t kRadioMax = 0;
+};
+
+struct MqDriver {
+  static const char* name() { return "MQ"; }
+  static void begin();
+  static void start(SampleRecord& sample) {}
+  static void read(SampleRecord& sample);
+  static void collect(SampleRecord& sample) {}
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",mq2,mq135"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample);
+  static constexpr size_t kLogMax = 2 * (1 + FMT_INT_MAX);
+  static constexpr size_t kRadioMax = sizeof(",MQ2:") + sizeof(",MQ135:") - 2 + 2 * FMT_INT_MAX;
+};
+
+struct Pms5003Driver {
+  static const char* name() { return "PMS5003"; }
+  static void begin();
+  static void start(SampleRecord& sample);
+  static void read(SampleRecord& sample) {}
+  static void collect(SampleRecord& sample);
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",pm1,pm25,pm10"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample);
+  static constexpr size_t kLogMax = 3 * (1 + FMT_U16_MAX);
+  static constexpr size_t kRadioMax = sizeof(",PM25:") - 1 + FMT_U16_MAX;
+};
+
+struct FlameDriver {
+  static const char* name() { return "Llama"; }
+  static void begin();
+  static void start(SampleRecord& sample) {}
+  static void read(SampleRecord& sample);
+  static void collect(SampleRecord& sample) {}
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",llama"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample);
+  static constexpr size_t kLogMax = 2;
+  static constexpr size_t kRadioMax = sizeof(",Llama:1") - 1;
+};
+
+struct WindDriver {
+  static const char* name() { return "Viento"; }
+  static void begin();
+  static void start(SampleRecord& sample) {}
+  static void read(SampleRecord& sample);
+  static void collect(SampleRecord& sample) {}
+  static void print(const SampleRecord& sample);
+  static const char* logColumns() { return ",viento,racha,dir_viento"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& sample);
+  static char* appendRadio(char* out, char* end, const SampleRecord& sample);
+  static constexpr size_t kLogMax = 2 * (1 + FMT_FIXED_MAX(1)) + 1 + FMT_U16_MAX;
+  static constexpr size_t kRadioMax = sizeof(",Viento:") + sizeof(",Racha:") + sizeof(",Dir:") -
+                                      3 + 2 * FMT_FIXED_MAX(1) + FMT_U16_MAX;
+};
+
+typedef SensorRegistry<Dht22Driver, Ds18b20Driver, MqDriver, Pms5003Driver, FlameDriver,
+                       WindDriver> NodeSensors;
+
+// --- Bus de eventos ---
+// Topic en nucleo.h. Para añadir un consumidor se declara su struct y se añade
+// a la lista del tema.
+
+struct LevelChangeEvent {
+  uint32_t seq;
+  int64_t readUs;
+  AlertLevel previous;
+  AlertLevel current;
+};
+
+struct LocalAlertSubscriber {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct RadioForwarder {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct LogForwarder {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct AlertLevelTracker {
+  static void onEvent(const LevelChangeEvent& event);
+};
+
+struct FireWeatherSubscriber {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct BaselineLearner {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct EnergyManager {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct TelemetrySubscriber {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct Aggregator {
+  static void onEvent(const SampleRecord& sample);
+};
+
+struct DailySummarizer {
+  static void onEvent(const SampleRecord& sample);
+};
+
+typedef Topic<SampleRecord, LocalAlertSubscriber, RadioForwarder, LogForwarder,
+              FireWeatherSubscriber, BaselineLearner, EnergyManager,
+              TelemetrySubscriber, Aggregator, DailySummarizer> SampleTopic;
+typedef Topic<LevelChangeEvent, AlertLevelTracker> LevelChangeTopic;
+
+LatencyStats dispatchStats = {0, 0, 0, 0};  // coste de SampleTopic::publish()
+std::atomic<uint32_t> levelTransitions[AL_CRITICA + 1];
+
 // Estado SD
 bool sdAvailable = false;
+fs::FS* logFs = NULL;         // SD o SD_MMC, según el backend montado
+bool storageSharesLoRaBus = false;
+
+struct StorageStats {
+  uint64_t bytes;
+  int64_t busyUs;  // escrituras y sincronizaciones, con la espera del bus
+  uint32_t writes;
+  uint32_t syncs;
+  int64_t maxWriteUs;  // un anexado, con cesiones del bus a la radio incluidas
+  int64_t maxSyncUs;   // una sincronización: bus retenido sin punto de cesión
+};
+StorageStats storageStats = {0, 0, 0, 0, 0, 0};
+
+// Fichero de la SD abierto en anexado. Solo lo toca la tarea de log.
+struct SdAppendFile {
+  const char* path;
+  File file;
+  bool dirty;  // hay datos sin sincronizar
+};
+SdAppendFile sdFiles[] = {{LOG_PATH, File(), false}, {AGG_PATH, File(), false},
+                          {DAILY_PATH, File(), false}};
+uint32_t lastSdSyncMs = 0;
+
+#if LOG_BACKEND == LOG_BACKEND_SDMMC && SDMMC_FALLBACK_SPI
+SPIClass sdSpi(HSPI);
+#endif
+
+// Tarjeta sin sistema de ficheros para RawRing, por sd_diskio
+struct RawSdCard {
+  uint8_t pdrv;
+
+  uint32_t sectors() { return sdcard_num_sectors(pdrv); }
+  bool readSector(uint32_t lba, uint8_t* buf) { return sd_read_raw(pdrv, buf, lba); }
+  bool writeSector(uint32_t lba, const uint8_t* buf) {
+    return sd_write_raw(pdrv, (uint8_t*)buf, lba);
+  }
+};
+
+// Estado del anillo crudo, solo lo toca la tarea de log
+RawSdCard rawCard = {0xFF};
+RawRing<RawSdCard> rawRing(rawCard, RAW_FIRST_SECTOR, RAW_SUPERBLOCK_EVERY);
+
+// Acceso de FallbackLog a LittleFS. Cada operación abre y cierra el fichero:
+// lo que devuelve append() ya está en flash.
+struct LittleFsAdapter {
+  bool exists(const char* path) { return LittleFS.exists(path); }
+
+  uint32_t size(const char* path) {
+    File file = LittleFS.open(path, FILE_READ);
+    uint32_t size = file ? file.size() : 0;
+    if (file) file.close();
+    return size;
+  }
+
+  size_t append(const char* path, const uint8_t* data, size_t len, uint32_t& size) {
+    File file = LittleFS.open(path, FILE_APPEND);
+    if (!file) return 0;
+    size_t written = file.write(data, len);
+    size = file.size();
+    file.close();
+    return written;
+  }
+
+  size_t read(const char* path, uint32_t offset, uint8_t* buf, size_t len) {
+    if (!LittleFS.exists(path)) return 0;
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) return 0;
+    size_t n = file.seek(offset) ? file.read(buf, len) : 0;
+    file.close();
+    return n;
+  }
+
+  bool remove(const char* path) { return !LittleFS.exists(path) || LittleFS.remove(path); }
+  bool rename(const char* from, const char* to) { return LittleFS.rename(from, to); }
+
+  bool writeAll(const char* path, const uint8_t* data, size_t len) {
+    File file = LittleFS.open(path, FILE_WRITE);
+    if (!file) return false;
+    size_t written = file.write(data, len);
+    file.close();
+    return written == len;
+  }
+
+  int64_t nowUs() { return esp_timer_get_time(); }
+};
+
+// Estado del respaldo en flash, solo lo toca la tarea de log
+bool fallbackAvailable = false;
+LittleFsAdapter littleFs;
+// En modo crudo guarda RawRecord en vez de líneas. Cada registro que migra al
+// anillo ya queda en la tarjeta, así que la posición se guarda por lote: un
+// fallo repite como mucho un lote en el anillo.
+FallbackLog<LittleFsAdapter> fallbackLog(littleFs, FALLBACK_ACTIVE_PATH, FALLBACK_OLD_PATH,
+                                         FALLBACK_POS_PATH, RAW_LOG ? sizeof(RawRecord) : 0,
+                                         RAW_LOG ? FALLBACK_BATCH_BYTES : FALLBACK_SYNC_BYTES);
+FallbackLog<LittleFsAdapter> aggFallbackLog(littleFs, AGG_FALLBACK_ACTIVE_PATH,
+                                            AGG_FALLBACK_OLD_PATH, AGG_FALLBACK_POS_PATH);
+FallbackLog<LittleFsAdapter> dailyFallbackLog(littleFs, DAILY_PATH, DAILY_FALLBACK_OLD_PATH,
+                                              DAILY_FALLBACK_POS_PATH, sizeof(DailySummary));
+uint32_t lastSdRetryMs = 0;
+
+// Vigilancia ULP: la CPU principal y la ULP comparten estas palabras de RTC_SLOW_MEM
+enum UlpVar {
+  ULP_VAR_MQ2_UMBRAL,
+  ULP_VAR_MQ135_UMBRAL,
+  ULP_VAR_MQ2_SUBIDA,
+  ULP_VAR_MQ135_SUBIDA,
+  ULP_VAR_MQ2_PREVIO,
+  ULP_VAR_MQ135_PREVIO,
+  ULP_VAR_MQ2_ACTUAL,
+  ULP_VAR_MQ135_ACTUAL,
+  ULP_VAR_MQ2_REARME,
+  ULP_VAR_MQ135_REARME,
+  ULP_VAR_MQ2_ARMADO,
+  ULP_VAR_MQ135_ARMADO,
+  ULP_VAR_COUNT
+};
+#define ULP_PROG_OFFSET 16  // en palabras, detrás de las variables
+
+struct EnergyProfile {
+  const char* name;
+  uint32_t samplePeriodMs;
+  int8_t txPowerDbm;
+  bool heaterDuty;     // calentadores MQ apagados entre muestras
+  bool serialDump;     // volcado de muestras y estadísticas por Serial
+  uint16_t loadMa;     // consumo medio modelado; EnergyForecast lo corrige con lo medido
+};
+
+const EnergyProfile kEnergyProfiles[EN_COUNT] = {
+  {"NORMAL", SAMPLE_PERIOD_MS, LORA_TX_POWER_DBM, false, true, 380},
+  {"AHORRO", 10000, 14, false, true, 340},
+  {"RESERVA", 30000, 10, true, false, 90},
+  {"CRITICO", 60000, 10, true, false, 60},
+};
+
+struct EnergyState {
+  uint16_t batteryMv;
+  uint16_t solarMv;
+  uint8_t soc;          // %
+  bool charging;
+  float runtimeH;       // autonomía prevista con el perfil actual
+  uint32_t lastCheckMs;
+  uint32_t profileChanges;
+};
+
+// Umbrales efectivos de evaluateAlertLevel() y de la vigilancia ULP
+struct AlertThresholds {
+  float tempCritica;
+  float humCritica;
+  int gasMq2;
+  int gasMq135;
+};
+
+struct AdaptiveStats {
+  uint32_t suppressed;  // muestras que los umbrales fijos daban por críticas y los adaptativos no
+  uint32_t raised;      // al revés: anomalías que los umbrales fijos no veían
+  uint32_t saves;       // guardados en NVS, desde la tarea de log
+  uint32_t saveFailures;
+};
+
+// Copia persistente en NVS; day evita aplicar dos veces el mismo día
+struct FwiState {
+  FwiCodes codes;
+  int32_t day;
+};
+
+// Observación de mediodía del día en curso; en RTC para no perderla al dormir
+struct FwiNoon {
+  int32_t day;
+  bool valid;
+  uint8_t month;  // 0-11
+  float temperature;
+  float humidity;
+  float windKmh;
+};
+
+Preferences prefs;  // NVS, espacio "centinela"
+RTC_DATA_ATTR uint8_t energyLevel = EN_NORMAL;  // sobrevive al sueño profundo
+EnergyState energy = {0, 0, 0, false, 0, 0, 0};
+EnergyForecast energyForecast;
+uint32_t samplePeriodMs = SAMPLE_PERIOD_MS;     // periodo del perfil aplicado
+bool samplePeriodChanged = false;
+std::atomic<int8_t> loraTxPowerDbm(LORA_TX_POWER_DBM);
+std::atomic<bool> serialDump(true);
+std::atomic<bool> exportActive(false);  // el puerto lleva tramas binarias
+LogExport logExport;
+ExportStats exportStats = {0, 0, 0, 0};
+bool loraReady = false;
+BulkTransfer bulkTx;
+#if BULK_RECEPTOR
+BulkReassembly bulkRx;
+BulkTransfer benchTx;  // fec_bench no toca bulkTx, que puede estar en el aire
+#endif
+DutyCycle dutyCycle = {(int64_t)LORA_DUTY_WINDOW_MS * LORA_DUTY_CYCLE_PCT / 100, 0, 0};
+LatencyStats fecEncodeStats = {0, 0, 0, 0};
+LatencyStats fecDecodeStats = {0, 0, 0, 0};
+SampleRecord lastLogged;        // última muestra vista por la tarea de log
+bool haveLogged = false;
+LatencyStats cliPollStats = {0, 0, 0, 0};     // coste de un sondeo sin contar las órdenes
+LatencyStats cliCommandStats = {0, 0, 0, 0};  // ejecución de órdenes
+HourBaseline diurnalBaseline[24];
+AdaptiveStats adaptiveStats = {0, 0, 0, 0};
+// Copia que guarda la tarea de log: putBytes de ~6,5 KB tarda decenas de ms y
+// la tarea de sensado no puede esperarlo. La de sensado solo copia si está libre.
+HourBaseline baselineSnapshot[24];
+std::atomic<bool> baselineSavePending(false);
+uint32_t lastBaselineSaveMs = 0;
+FwiState fireWeather = {{FWI_FFMC_INICIAL, FWI_DMC_INICIAL, FWI_DC_INICIAL, 0, 0, 0}, -1};
+RTC_DATA_ATTR FwiNoon fwiNoon = {-1, false, 0, 0, 0, 0};
 
 // --- Prototipos ---
-void readAllSensors();
-void evaluateAlertLevel();
+void sensingTask(void* param);
+void radioTask(void* param);
+void logTask(void* param);
+void readAllSensors(SampleRecord& sample);
+AlertLevel evaluateAlertLevel(const SampleRecord& sample);
+AlertThresholds currentAlertThresholds();
 void activateLocalAlerts(AlertLevel level);
-void sendLoRaAlert(AlertLevel level);
-void logDataToSD();
-String getAlertLevelString(AlertLevel level);
+void sendLoRaAlert(const SampleRecord& sample);
+void logDataToSD(const SampleRecord& sample);
+void printSample(const SampleRecord& sample);
+void printStats();
+bool serialVerbose();
+void pollSerialCommands();
+void runCliCommand(char* line);
+void cliHelp(char* args);
+void cliReadings(char* args);
+void cliStats(char* args);
+void cliHistograms(char* args);
+void cliConfig(char* args);
+void cliClock(char* args);
+void cliDailySummary(char* args);
+void cliExport(char* args);
+void cliSelfTest(char* args);
+void printHistogram(const char* name, const LatencyStats& stats);
+void cliBulkSend(char* args);
+void cliFecBench(char* args);
+uint32_t loraAirtimeMs(size_t len);
+uint32_t telemetryTimeMs(const SampleRecord& sample);
+bool radioPending();
+bool startBulkTransfer(uint32_t offset, uint32_t length);
+uint32_t sendBulkFragment();
+size_t buildBulkFrame(const BulkTransfer& tx, uint8_t index, uint8_t* frame);
+bool bulkReceive(BulkReassembly& rx, const uint8_t* frame, size_t len);
+bool selfTestLine(const char* name, bool ok, const char* detail);
+bool logReaderOpen(LogReader& reader);
+size_t logReaderRead(LogReader& reader, uint32_t offset, uint8_t* buf, size_t len);
+void logReaderClose(LogReader& reader);
+bool startExport(uint32_t offset, uint32_t length, bool compress);
+void exportPoll();
+void finishExport(bool complete);
+void sendExportFrame(uint8_t type, uint32_t offset, const uint8_t* payload, size_t len);
+void ensureLogHeader();
+size_t writeSdChunked(File& file, const uint8_t* data, size_t len);
+SdAppendFile* openSdAppend(const char* path);
+void syncSdFiles(bool force);
+void flushSdFile(const char* path);
+void closeSdFiles();
+bool mountStorage();
+bool beginStorage();
+void endStorage();
+void storageLock();
+void storageUnlock();
+bool appendToSd(const char* path, const uint8_t* data, size_t len);
+bool appendFallback(const char* data, size_t len);
+bool flushFallback();
+void retryStorage();
+bool migrateFallbackToSd();
+bool rawLogBegin();
+bool rawLogAppend(const RawRecord& rec);
+bool rawWriteSuperblock();
+void onLoRaDio0();
+void onLoRaTxDone();
+void onFlameEdge();
+void onFlameDebounce();
+void onSampleTimer();
+void onPowerCheck(void* arg);
+void powerMonitorBegin();
+bool mqDutyCycling();
+void setMqHeater(bool on, uint32_t now);
+void mqOversample(int out[2]);
+void onMqPreheat(void* arg);
+void startMqPreheat(int64_t atUs);
+bool mqHeaterState(uint32_t& onMs);
+void finishMqCalibration(const int full[2], uint32_t now);
+uint16_t readBatteryMv();
+void emergencyFlush();
+void energyBegin();
+void updateTelemetry(const SampleRecord& sample);
+bool telemetryValue(const SampleRecord& sample, TelChannel channel, int32_t& value);
+void sendTelemetry(const TelemetryFrame& frame);
+void aggregateSample(const SampleRecord& sample);
+void emitRollup(uint8_t period);
+void logRollup(const Rollup& rollup);
+void sendRollup(const Rollup& rollup);
+bool keepRawSample(const SampleRecord& sample);
+void accumulateDay(const SampleRecord& sample);
+void closeDay();
+bool writeDailySummary(const DailySummary& summary);
+void printDailyRow(const DailySummary& summary, uint32_t& shown, uint32_t& corrupt);
+void printDailySummaries();
+void holdPreEvent(const SampleRecord& sample);
+void flushPreEvent();
+void energyUpdate(EnergyLevel applied);
+void applyEnergyProfile(const EnergyProfile& profile);
+void setSamplePeriod(uint32_t periodMs);
+void sendLastGasp();
+bool transmitLoRa(const char* data, size_t len);
+void startSampleTimer();
+void recordSampleTick(int64_t tickUs, uint32_t ticks);
+void onWindTick(void* arg);
+UlpWatchConfig currentUlpWatchConfig();
+void startUlpWatch(const SampleRecord& last);
+UlpTrigger ulpWakeTrigger();
+void reportUlpWakeup();
+void enterDeepSleep(const SampleRecord& last);
+bool clockValid();
+int32_t localDay(struct tm& now);
+void fireWeatherBegin();
+void adaptiveBegin();
+void adaptiveLearn(const SampleRecord& sample);
+void saveBaseline();
+const HourBaseline* currentBaseline();
+void fireWeatherUpdate(const SampleRecord& sample);
 
 // --- Setup ---
 void setup() {
-  Serial.begin(115200);
+  Serial.setTxBufferSize(EXPORT_TX_BUFFER);
+  Serial.begin(SERIAL_BAUD);
   while (!Serial);
 
   pinMode(LED_PIN, OUTPUT);
@@ -73,161 +1250,2848 @@ void setup() {
   digitalWrite(LED_PIN, LOW);
   digitalWrite(BUZZER_PIN, LOW);
 
-  dht.begin();
-  sensors.begin();
+  gfBegin();
+  setenv("TZ", ZONA_HORARIA, 1);
+  tzset();
+  prefs.begin("centinela", false);
+
+  NodeSensors::beginAll();
+  fireWeatherBegin();
+  adaptiveBegin();
+  powerMonitorBegin();
+  energyBegin();
+
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_ULP) {
+    reportUlpWakeup();
+  } else if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT0) {
+    Serial.println("Despertado por el sensor de llama.");
+  }
+  // Tras despertar por temporizador la ULP sigue activa: la CPU recupera el ADC1
+  CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
 
   // LoRa
+  spiBus.begin();
   SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_CS);
   LoRa.setPins(LORA_CS, LORA_RST, LORA_DIO0);
+  txDoneSem = xSemaphoreCreateBinary();
   if (!LoRa.begin(LORA_FREQUENCY)) {
     Serial.println("LoRa no iniciado.");
   } else {
-    LoRa.setSpreadingFactor(7);
-    LoRa.setSignalBandwidth(125E3);
-    LoRa.setCodingRate4(5);
+    LoRa.setSpreadingFactor(LORA_SF);
+    LoRa.setSignalBandwidth(LORA_BW);
+    LoRa.setCodingRate4(LORA_CR);
+    // Registrar onTxDone hace que la librería mapee DIO0 a TxDone, pero su ISR
+    // lee registros por SPI en contexto de interrupción. Se sustituye por una ISR
+    // que solo avisa a la tarea de radio; todo acceso al bus pasa por spiBus.
+    LoRa.onTxDone(onLoRaTxDone);
+    detachInterrupt(digitalPinToInterrupt(LORA_DIO0));
+    attachInterrupt(digitalPinToInterrupt(LORA_DIO0), onLoRaDio0, RISING);
+    loraReady = true;
     Serial.println("LoRa iniciado.");
   }
 
   // SD
-  if (SD.begin(SD_CS_PIN)) {
-    sdAvailable = true;
-    Serial.println("Tarjeta SD inicializada.");
-  } else {
-    sdAvailable = false;
+  sdAvailable = mountStorage();
+  if (!sdAvailable) {
     Serial.println("No se pudo inicializar la tarjeta SD.");
   }
+  if (sdAvailable) ensureLogHeader();
+  fallbackAvailable = LittleFS.begin(true);
+  if (!fallbackAvailable) {
+    Serial.println("No se pudo montar LittleFS.");
+  } else if (sdAvailable) {
+    migrateFallbackToSd();
+  }
 
   Serial.println("Sistema listo.");
+
+  xTaskCreatePinnedToCore(radioTask, "radio", TASK_STACK_SIZE, NULL, RADIO_TASK_PRIO,
+                          &radioTaskHandle, IO_CORE);
+  xTaskCreatePinnedToCore(logTask, "log", TASK_STACK_SIZE, NULL, LOG_TASK_PRIO,
+                          &logTaskHandle, IO_CORE);
+  xTaskCreatePinnedToCore(sensingTask, "sensado", TASK_STACK_SIZE, NULL, SENSING_TASK_PRIO,
+                          &sensingTaskHandle, SENSING_CORE);
 }
 
 // --- Loop ---
+// Todo el trabajo lo hacen las tareas creadas en setup()
 void loop() {
-  readAllSensors();
-  evaluateAlertLevel();
-  activateLocalAlerts(currentAlertLevel);
-  sendLoRaAlert(currentAlertLevel);
-  logDataToSD();
-
-  Serial.println("--------------------------------");
-  delay(5000);
+  vTaskDelete(NULL);
 }
 
-// --- Funciones ---
-void readAllSensors() {
-  // DHT22
-  currentHumidity = dht.readHumidity();
-  currentTemperature = dht.readTemperature();
+// --- Tareas ---
+void sensingTask(void* param) {
+  uint32_t seq = 0;
+  TickType_t lastFastPath = 0;
+  SampleRecord sample;
+  memset(&sample, 0, sizeof(sample));
 
-  if (isnan(currentHumidity) || isnan(currentTemperature)) {
-    Serial.println("Error DHT22.");
-    currentHumidity = 0.0;
-    currentTemperature = 0.0;
-  } else {
-    Serial.printf("DHT22: %.1f°C, %.1f%%\n", currentTemperature, currentHumidity);
-  }
+  // La ISR queda en el núcleo que la registra, el de sensado
+  startSampleTimer();
+  // Primera muestra al arrancar, sin esperar un periodo completo. La ISR ya
+  // puede estar escribiendo: sampleTickUs siempre bajo sampleMux
+  int64_t startUs = esp_timer_get_time();
+  portENTER_CRITICAL(&sampleMux);
+  sampleTickUs = startUs;
+  portEXIT_CRITICAL(&sampleMux);
+  xTaskNotify(xTaskGetCurrentTaskHandle(), SENSING_NOTIFY_SAMPLE, eSetBits);
 
-  // DS18B20
-  sensors.requestTemperatures();
-  internalTemperature = sensors.getTempCByIndex(0);
-  if (internalTemperature == DEVICE_DISCONNECTED_C) {
-    Serial.println("Error DS18B20.");
-    internalTemperature = 0.0;
-  } else {
-    Serial.printf("DS18B20: %.1f°C\n", internalTemperature);
-  }
+  for (;;) {
+    uint32_t bits = 0;
+    xTaskNotifyWait(0, SENSING_NOTIFY_SAMPLE | SENSING_NOTIFY_FLAME, &bits, portMAX_DELAY);
+    TickType_t now = xTaskGetTickCount();
 
-  // MQ
-  mq2Value = analogRead(MQ2_PIN);
-  mq135Value = analogRead(MQ135_PIN);
-  Serial.printf("MQ2: %d, MQ135: %d\n", mq2Value, mq135Value);
-}
+    if (bits & SENSING_NOTIFY_SAMPLE) {
+      portENTER_CRITICAL(&sampleMux);
+      int64_t tickUs = sampleTickUs;
+      uint32_t ticks = sampleTicks;
+      portEXIT_CRITICAL(&sampleMux);
+      recordSampleTick(tickUs, ticks);
+      sample.seq = ++seq;
+      sample.fastPath = false;
+      sample.readUs = tickUs;
+      readAllSensors(sample);
+    } else if ((bits & SENSING_NOTIFY_FLAME) &&
+               now - lastFastPath >= pdMS_TO_TICKS(FLAME_MIN_INTERVAL_MS)) {
+      // Camino rápido: no se espera a DHT22 ni DS18B20, se reevalúa la última
+      // muestra con la llama y se fecha en el flanco para medir la latencia real
+      lastFastPath = now;
+      sample.seq = ++seq;
+      sample.fastPath = true;
+      sample.flame = true;
+      portENTER_CRITICAL(&flameMux);
+      sample.readUs = flameEdgeUs;
+      portEXIT_CRITICAL(&flameMux);
+    } else {
+      continue;
+    }
+    sample.level = evaluateAlertLevel(sample);
 
-void evaluateAlertLevel() {
-  bool tempHigh = (currentTemperature > TEMP_CRITICA);
-  bool humLow = (currentHumidity < HUM_CRITICA);
-  bool gasDetected = (mq2Value > GAS_UMBRAL_MQ2 || mq135Value > GAS_UMBRAL_MQ135);
+    if (sample.level != currentAlertLevel) {
+      LevelChangeEvent event = {sample.seq, sample.readUs, currentAlertLevel, sample.level};
+      LevelChangeTopic::publish(event);
+    }
+    lastSampleSeq.store(sample.seq);
+    int64_t start = esp_timer_get_time();
+    SampleTopic::publish(sample);
+    dispatchStats.record(esp_timer_get_time() - start);
 
-  if (tempHigh && humLow && gasDetected) {
-    currentAlertLevel = AL_CRITICA;
-  } else if (tempHigh && gasDetected) {
-    currentAlertLevel = AL_ALTA;
-  } else if ((tempHigh && humLow) || (humLow && gasDetected)) {
-    currentAlertLevel = AL_MEDIA;
-  } else {
-    currentAlertLevel = AL_BAJA;
+#if USE_DEEP_SLEEP
+    // Con una alerta activa se mantienen LED y zumbador; si no, se duerme vigilando gases
+    if (sample.level == AL_BAJA) {
+      while (logDoneSeq.load() != sample.seq) vTaskDelay(pdMS_TO_TICKS(10));
+      // Sin cortar una trama en el aire ni dejar telemetría en cola
+      uint32_t drainStart = millis();
+      while (radioPending() && millis() - drainStart < RADIO_DRAIN_TIMEOUT_MS) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+      }
+      enterDeepSleep(sample);
+    }
+#endif
   }
-
-  Serial.print("Nivel de Alerta: ");
-  Serial.println(getAlertLevelString(currentAlertLevel));
 }
 
-void activateLocalAlerts(AlertLevel level) {
-  switch (level) {
-    case AL_BAJA:
-      digitalWrite(LED_PIN, LOW);
-      digitalWrite(BUZZER_PIN, LOW);
-      break;
-    case AL_MEDIA:
-      digitalWrite(LED_PIN, HIGH);
-      digitalWrite(BUZZER_PIN, LOW);
+void radioTask(void* param) {
+  uint32_t bulkWaitMs = 0;
+  for (;;) {
+    // Con una transferencia en curso despierta cuando haya crédito de aire
+    xTaskNotifyWait(0,
+                    RADIO_NOTIFY_QUEUE | RADIO_NOTIFY_POWER_FAIL | RADIO_NOTIFY_TELEMETRY |
+                        RADIO_NOTIFY_ROLLUP | RADIO_NOTIFY_BULK,
+                    NULL, bulkTx.active.load() ? pdMS_TO_TICKS(bulkWaitMs) : portMAX_DELAY);
+    // Tras cada trama se vuelve a mirar el último aliento y las alertas: lo
+    // que llegue durante una transmisión se atiende antes que lo demás
+    radioBusy.store(true);
+    for (;;) {
+      if (lastGaspPending.exchange(false)) sendLastGasp();
+      SampleRecord sample;
+      if (radioQueue.pop(sample)) {
+        sendLoRaAlert(sample);
+        continue;
+      }
+      TelemetryFrame frame;
+      if (telemetryQueue.pop(frame)) {
+        sendTelemetry(frame);
+        continue;
+      }
+      Rollup rollup;
+      if (rollupRadioQueue.pop(rollup)) {
+        sendRollup(rollup);
+        continue;
+      }
       break;
-    case AL_ALTA:
-      digitalWrite(LED_PIN, (millis() / 200) % 2);
-      if ((millis() / 500) % 2) {
-        tone(BUZZER_PIN, 1500);
+    }
+    // Un fragmento por vuelta: una alerta nueva no espera a toda la transferencia
+    if (bulkTx.active.load()) bulkWaitMs = sendBulkFragment();
+    radioBusy.store(false);
+  }
+}
+
+void logTask(void* param) {
+  for (;;) {
+    // Sin notificaciones despierta igualmente para atender el puerto serie
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(logExport.active ? EXPORT_POLL_MS : SERIAL_POLL_MS));
+    if (powerFailPending.exchange(false)) {
+      if (logExport.active) finishExport(false);
+      emergencyFlush();
+    }
+    pollSerialCommands();
+    if (logExport.active) exportPoll();
+    SampleRecord sample;
+    while (logQueue.pop(sample)) {
+      bool dump = serialVerbose();
+      if (dump) printSample(sample);
+      if (!sample.fastPath) {
+        lastLogged = sample;
+        haveLogged = true;
+      }
+      if (keepRawSample(sample)) {
+        flushPreEvent();
+        logDataToSD(sample);
+        aggregationStats.rawKept++;
       } else {
-        noTone(BUZZER_PIN);
+        holdPreEvent(sample);
       }
-      break;
-    case AL_CRITICA:
-      digitalWrite(LED_PIN, (millis() / 100) % 2);
-      tone(BUZZER_PIN, 2000);
-      break;
+#if USE_DEEP_SLEEP
+      flushFallback();  // la RAM no sobrevive al sueño profundo
+      syncSdFiles(true);
+#endif
+      if (dump) {
+        if (sample.seq % STATS_INTERVAL_SAMPLES == 0) printStats();
+        Serial.println("--------------------------------");
+      }
+      logDoneSeq.store(sample.seq);
+    }
+    Rollup rollup;
+    while (rollupLogQueue.pop(rollup)) logRollup(rollup);
+    DailySummary summary;
+    while (dailyQueue.pop(summary)) {
+      if (!writeDailySummary(summary) && serialVerbose()) {
+        Serial.println("Error al guardar el resumen diario.");
+      }
+    }
+#if ADAPTIVE_THRESHOLDS
+    if (baselineSavePending.load()) saveBaseline();
+#endif
+    if (sdAvailable) {
+      syncSdFiles(false);
+    } else {
+      retryStorage();
+    }
   }
 }
 
-void sendLoRaAlert(AlertLevel level) {
-  if (level == AL_BAJA || !LoRa.beginPacket()) return;
+// Estado del PMS5003, solo lo toca la tarea de sensado
+PmsFrameParser pmsParser;
+bool pmsAwake = true;
+bool pmsHaveReading = false;
+uint16_t pmsStable[3] = {0, 0, 0};  // PM1, PM2.5, PM10 de la última medida estabilizada
+uint32_t pmsWakeMs = 0;
+uint32_t pmsNextMeasureMs = 0;
 
-  String message = "ALERTA_INCENDIO,Nivel:" + getAlertLevelString(level)
-                 + ",Temp:" + String(currentTemperature, 1)
-                 + ",Hum:" + String(currentHumidity, 1)
-                 + ",MQ2:" + String(mq2Value)
-                 + ",MQ135:" + String(mq135Value)
-                 + ",ID:Sentinela001";
+// Estado de los calefactores MQ: la tarea de sensado y el temporizador de
+// precalentamiento, que solo enciende; mqHeaterOn, mqHeaterOnMs y onMs bajo mqMux
+struct MqHeaterStats {
+  uint64_t onMs;           // tiempo encendido acumulado, sin el tramo en curso
+  uint32_t cycles;
+  uint32_t calibrations;
+  LatencyStats readingAge;  // antigüedad de la lectura de gas entregada
+};
+portMUX_TYPE mqMux = portMUX_INITIALIZER_UNLOCKED;
+esp_timer_handle_t mqPreheatTimer = NULL;
+bool mqHeaterOn = true;
+uint32_t mqHeaterOnMs = 0;
+uint32_t mqNextMeasureMs = 0;
+bool mqHaveReading = false;
+int mqStable[2] = {0, 0};
+uint32_t mqStableMs = 0;
+bool mqCalibrating = false;
+int mqPartial[2] = {0, 0};
+uint32_t mqPartialWarmMs = 0;
+uint32_t mqLastCalMs = 0;
+bool mqCalibrated = false;
 
-  LoRa.print(message);
-  LoRa.endPacket();
+MqWarmCalibration mqCal = {{1.0f, 1.0f}, MQ_PRECALENTAMIENTO_MS};
+MqHeaterStats mqHeaterStats = {0, 0, 0, {0, 0, 0, 0}};
 
-  Serial.println("LoRa enviado: " + message);
+// --- Suscriptores ---
+void LocalAlertSubscriber::onEvent(const SampleRecord& sample) {
+  activateLocalAlerts(sample.level);
 }
 
-void logDataToSD() {
-  if (!sdAvailable) return;
+void RadioForwarder::onEvent(const SampleRecord& sample) {
+  if (sample.level == AL_BAJA) return;
+  if (radioQueue.push(sample)) {
+    xTaskNotify(radioTaskHandle, RADIO_NOTIFY_QUEUE, eSetBits);
+  } else {
+    radioDrops++;
+  }
+}
 
-  File dataFile = SD.open("/log_incendios.txt", FILE_APPEND);
-  if (dataFile) {
-    String log = String(millis() / 1000) + "s," +
-                 String(currentTemperature, 1) + "," +
-                 String(currentHumidity, 1) + "," +
-                 String(internalTemperature, 1) + "," +
-                 String(mq2Value) + "," +
-                 String(mq135Value) + "," +
-                 getAlertLevelString(currentAlertLevel);
-    dataFile.println(log);
-    dataFile.close();
-    Serial.println("Log guardado en SD.");
+void LogForwarder::onEvent(const SampleRecord& sample) {
+  if (logQueue.push(sample)) {
+    xTaskNotifyGive(logTaskHandle);
   } else {
-    Serial.println("Error al escribir en la SD.");
+    logDrops++;
   }
 }
 
-String getAlertLevelString(AlertLevel level) {
+void AlertLevelTracker::onEvent(const LevelChangeEvent& event) {
+  currentAlertLevel = event.current;
+  levelTransitions[event.current]++;
+}
+
+void FireWeatherSubscriber::onEvent(const SampleRecord& sample) {
+  if (!sample.fastPath) fireWeatherUpdate(sample);
+}
+
+void EnergyManager::onEvent(const SampleRecord& sample) {
+  // Con alerta se aplica el perfil normal en la misma muestra, sin esperar al chequeo
+  bool alert = sample.level >= AL_MEDIA;
+  if (millis() - energy.lastCheckMs >= ENERGY_CHECK_MS) {
+    energyUpdate(alert ? EN_NORMAL : (EnergyLevel)energyLevel);
+  }
+  applyEnergyProfile(kEnergyProfiles[alert ? EN_NORMAL : energyLevel]);
+}
+
+void TelemetrySubscriber::onEvent(const SampleRecord& sample) {
+#if TELEMETRY
+  if (sample.fastPath) return;
+  // Las alertas llevan todos los valores en su propia trama; al volver a BAJA
+  // se resincroniza el predictor con una trama completa
+  if (sample.level != AL_BAJA) {
+    telemetryResync = true;
+    return;
+  }
+  updateTelemetry(sample);
+#endif
+}
+
+void Aggregator::onEvent(const SampleRecord& sample) {
+  if (!sample.fastPath) aggregateSample(sample);
+}
+
+void DailySummarizer::onEvent(const SampleRecord& sample) {
+  accumulateDay(sample);
+}
+
+void BaselineLearner::onEvent(const SampleRecord& sample) {
+#if ADAPTIVE_THRESHOLDS
+  if (!sample.fastPath && !sample.dhtError) adaptiveLearn(sample);
+#endif
+}
+
+// --- Funciones ---
+// readUs ya viene fijado por el llamante con la marca del temporizador
+void readAllSensors(SampleRecord& sample) {
+  NodeSensors::readAll(sample);
+}
+
+void startSampleTimer() {
+  sampleTimer = timerBegin(SAMPLE_TIMER_NUM, 80, true);  // 1 tick = 1 us
+  timerAttachInterrupt(sampleTimer, onSampleTimer, true);
+  samplePeriodMs = kEnergyProfiles[energyLevel].samplePeriodMs;
+  timerAlarmWrite(sampleTimer, (uint64_t)samplePeriodMs * 1000ULL, true);
+  timerAlarmEnable(sampleTimer);
+}
+
+void IRAM_ATTR onSampleTimer() {
+  portENTER_CRITICAL_ISR(&sampleMux);
+  sampleTickUs = esp_timer_get_time();
+  sampleTicks++;
+  portEXIT_CRITICAL_ISR(&sampleMux);
+  BaseType_t woken = pdFALSE;
+  xTaskNotifyFromISR(sensingTaskHandle, SENSING_NOTIFY_SAMPLE, eSetBits, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+// El jitter se mide entre ISR consecutivas con esp_timer, un reloj distinto del
+// temporizador: incluye la latencia de interrupción. Si la tarea no atendió
+// algún periodo, el hueco cuenta como muestras perdidas y no como jitter.
+void recordSampleTick(int64_t tickUs, uint32_t ticks) {
+  if (samplePeriodChanged) {
+    samplePeriodChanged = false;  // el primer intervalo tras el cambio no es jitter
+  } else if (ticks == lastSampleTicks + 1 && lastSampleTicks != 0) {
+    int64_t deviation = tickUs - lastSampleTickUs - (int64_t)samplePeriodMs * 1000;
+    samplingJitter.record(deviation < 0 ? -deviation : deviation);
+  } else if (ticks > lastSampleTicks + 1) {
+    missedSamples += ticks - lastSampleTicks - 1;
+  }
+  samplingDelay.record(esp_timer_get_time() - tickUs);
+  lastSampleTickUs = tickUs;
+  lastSampleTicks = ticks;
+}
+
+// --- Drivers de sensores ---
+void Dht22Driver::begin() {
+  dht.begin();
+}
+
+void Dht22Driver::read(SampleRecord& sample) {
+  sample.humidity = dht.readHumidity();
+  sample.temperature = dht.readTemperature();
+  sample.dhtError = isnan(sample.humidity) || isnan(sample.temperature);
+  if (sample.dhtError) {
+    sample.humidity = 0.0;
+    sample.temperature = 0.0;
+  }
+}
+
+void Dht22Driver::print(const SampleRecord& sample) {
+  if (sample.dhtError) {
+    Serial.println("Error DHT22.");
+  } else {
+    Serial.printf("DHT22: %.1f°C, %.1f%%\n", sample.temperature, sample.humidity);
+  }
+}
+
+char* Dht22Driver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, sample.temperature, 1);
+  out = appendChar(out, end, ',');
+  return formatFixed(out, end, sample.humidity, 1);
+}
+
+char* Dht22Driver::appendRadio(char* out, char* end, const SampleRecord& sample) {
+  out = appendStr(out, end, ",Temp:");
+  out = formatFixed(out, end, sample.temperature, 1);
+  out = appendStr(out, end, ",Hum:");
+  return formatFixed(out, end, sample.humidity, 1);
+}
+
+// Instante en que se pidió la conversión en curso
+uint32_t ds18b20RequestMs = 0;
+
+void Ds18b20Driver::begin() {
+  sensors.begin();
+  sensors.setResolution(DS18B20_RESOLUCION);
+  sensors.setWaitForConversion(false);
+}
+
+void Ds18b20Driver::start(SampleRecord& sample) {
+  sensors.requestTemperatures();
+  ds18b20RequestMs = millis();
+}
+
+// La espera que queda de la conversión cede la CPU en lugar de sondear el bus
+void Ds18b20Driver::collect(SampleRecord& sample) {
+  uint32_t elapsed = millis() - ds18b20RequestMs;
+  uint32_t needed = sensors.millisToWaitForConversion(DS18B20_RESOLUCION);
+  if (elapsed < needed) vTaskDelay(pdMS_TO_TICKS(needed - elapsed) + 1);
+  sample.internalTemperature = sensors.getTempCByIndex(0);
+  sample.ds18b20Error = (sample.internalTemperature == DEVICE_DISCONNECTED_C);
+  if (sample.ds18b20Error) {
+    sample.internalTemperature = 0.0;
+  }
+}
+
+void Ds18b20Driver::print(const SampleRecord& sample) {
+  if (sample.ds18b20Error) {
+    Serial.println("Error DS18B20.");
+  } else {
+    Serial.printf("DS18B20: %.1f°C\n", sample.internalTemperature);
+  }
+}
+
+char* Ds18b20Driver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  return formatFixed(out, end, sample.internalTemperature, 1);
+}
+
+void MqDriver::begin() {
+#if MQ_HEATER_PIN >= 0
+  rtc_gpio_hold_dis((gpio_num_t)MQ_HEATER_PIN);  // retenido si venimos de dormir
+  pinMode(MQ_HEATER_PIN, OUTPUT);
+  digitalWrite(MQ_HEATER_PIN, HIGH);
+#endif
+  mqHeaterOn = true;
+  mqHeaterOnMs = millis();
+  // Sin pin de control o al despertar (retenido encendido) el sensor ya está caliente
+  if (MQ_HEATER_PIN < 0 || esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED) {
+    mqHeaterOnMs -= MQ_CALENTADO_COMPLETO_MS;
+  }
+  mqCalibrated = prefs.getBytes("mq_cal", &mqCal, sizeof(mqCal)) == sizeof(mqCal);
+#if MQ_HEATER_PIN >= 0
+  esp_timer_create_args_t args;
+  memset(&args, 0, sizeof(args));
+  args.callback = onMqPreheat;
+  args.name = "precalentamiento";
+  esp_timer_create(&args, &mqPreheatTimer);
+#endif
+}
+
+// El precalentamiento y su corrección son del modo en ciclo; con el calefactor
+// siempre alimentado se lee desde el arranque, sin factor, como antes del ciclo
+void MqDriver::read(SampleRecord& sample) {
+  uint32_t now = millis();
+  bool duty = mqDutyCycling();
+  bool continuous = !duty || currentAlertLevel >= AL_MEDIA;
+  if (continuous) mqCalibrating = false;
+  uint32_t onMs;
+  bool heaterOn = mqHeaterState(onMs);
+  // Respaldo del temporizador, p. ej. si un cambio de periodo movió las muestras
+  if (!heaterOn &&
+      (continuous || (int32_t)(now - (mqNextMeasureMs - MQ_PRECALENTAMIENTO_MS)) >= 0)) {
+    setMqHeater(true, now);
+    heaterOn = mqHeaterState(onMs);
+  }
+
+  uint32_t warm = now - onMs;
+  if (heaterOn && (!duty || warm >= MQ_PRECALENTAMIENTO_MS)) {
+    int raw[2];
+    mqOversample(raw);
+    for (int i = 0; i < 2; i++) {
+      mqStable[i] = duty ? (int)lroundf(raw[i] * mqWarmFactor(mqCal, i, warm)) : raw[i];
+    }
+    mqStableMs = now;
+    mqHaveReading = true;
+
+    if (!continuous) {
+      bool calibrate = (!mqCalibrated || now - mqLastCalMs >= MQ_RECALIBRACION_MS) &&
+                       currentAlertLevel == AL_BAJA;
+      if (calibrate && !mqCalibrating) {
+        // Primera lectura del ciclo de calibración: se sigue calentando
+        mqCalibrating = true;
+        mqPartial[0] = raw[0];
+        mqPartial[1] = raw[1];
+        mqPartialWarmMs = warm;
+      } else if (!mqCalibrating || warm >= MQ_CALENTADO_COMPLETO_MS) {
+        if (mqCalibrating) finishMqCalibration(raw, now);
+        setMqHeater(false, now);
+        // Contado desde la marca del temporizador de muestreo, no desde ahora
+        mqNextMeasureMs = (uint32_t)(sample.readUs / 1000) +
+                          mqMeasureDelayMs(samplePeriodMs, MQ_CICLO_MS);
+        startMqPreheat(sample.readUs +
+                       (int64_t)mqPreheatDelayMs(samplePeriodMs, MQ_CICLO_MS) * 1000);
+        mqHeaterStats.cycles++;
+      }
+    }
+  }
+  sample.mq2 = mqStable[0];
+  sample.mq135 = mqStable[1];
+  if (mqHaveReading) mqHeaterStats.readingAge.record((int64_t)(now - mqStableMs) * 1000);
+}
+
+bool mqDutyCycling() {
+  if (MQ_HEATER_PIN < 0 || USE_DEEP_SLEEP) return false;  // la ULP vigila con el calefactor puesto
+  return MQ_HEATER_DUTY || kEnergyProfiles[energyLevel].heaterDuty;
+}
+
+// Sin efecto si ya está así: el temporizador y la lectura pueden encender a la vez
+void setMqHeater(bool on, uint32_t now) {
+  portENTER_CRITICAL(&mqMux);
+  bool change = on != mqHeaterOn;
+  if (change) {
+    if (!on) mqHeaterStats.onMs += now - mqHeaterOnMs;
+    mqHeaterOn = on;
+    mqHeaterOnMs = now;
+  }
+  portEXIT_CRITICAL(&mqMux);
+#if MQ_HEATER_PIN >= 0
+  if (change) digitalWrite(MQ_HEATER_PIN, on ? HIGH : LOW);
+#endif
+}
+
+bool mqHeaterState(uint32_t& onMs) {
+  portENTER_CRITICAL(&mqMux);
+  bool on = mqHeaterOn;
+  onMs = mqHeaterOnMs;
+  portEXIT_CRITICAL(&mqMux);
+  return on;
+}
+
+// Temporizador de un disparo en la tarea de esp_timer
+void onMqPreheat(void* arg) {
+  setMqHeater(true, millis());
+}
+
+// atUs en el reloj de esp_timer_get_time()
+void startMqPreheat(int64_t atUs) {
+  if (mqPreheatTimer == NULL) return;
+  esp_timer_stop(mqPreheatTimer);  // falla sin efecto si no estaba en marcha
+  int64_t delayUs = atUs - esp_timer_get_time();
+  esp_timer_start_once(mqPreheatTimer, delayUs > 0 ? delayUs : 1);
+}
+
+// Sobremuestreo repartido en el tiempo: promedia el ruido del calefactor y
+// se solapa con la conversión del DS18B20
+void mqOversample(int out[2]) {
+  uint32_t sumMq2 = 0;
+  uint32_t sumMq135 = 0;
+  for (int i = 0; i < MQ_OVERSAMPLE; i++) {
+    if (i > 0) vTaskDelay(pdMS_TO_TICKS(MQ_OVERSAMPLE_GAP_MS));
+    sumMq2 += analogRead(MQ2_PIN);
+    sumMq135 += analogRead(MQ135_PIN);
+  }
+  out[0] = sumMq2 / MQ_OVERSAMPLE;
+  out[1] = sumMq135 / MQ_OVERSAMPLE;
+}
+
+// Solo en aire limpio (nivel BAJA); un cambio de nivel a mitad de ciclo la anula
+void finishMqCalibration(const int full[2], uint32_t now) {
+  mqCalibrating = false;
+  if (currentAlertLevel != AL_BAJA) return;
+  for (int i = 0; i < 2; i++) {
+    if (mqPartial[i] <= 0) return;
+  }
+  for (int i = 0; i < 2; i++) {
+    float ratio = (float)full[i] / mqPartial[i];
+    mqCal.ratio[i] = mqCalibrated ? mqCal.ratio[i] + 0.5f * (ratio - mqCal.ratio[i]) : ratio;
+  }
+  mqCal.warmMs = mqPartialWarmMs;
+  mqCalibrated = true;
+  mqLastCalMs = now;
+  mqHeaterStats.calibrations++;
+  prefs.putBytes("mq_cal", &mqCal, sizeof(mqCal));
+}
+
+void MqDriver::print(const SampleRecord& sample) {
+  Serial.printf("MQ2: %d, MQ135: %d\n", sample.mq2, sample.mq135);
+}
+
+char* MqDriver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  out = formatInt(out, end, sample.mq2);
+  out = appendChar(out, end, ',');
+  return formatInt(out, end, sample.mq135);
+}
+
+char* MqDriver::appendRadio(char* out, char* end, const SampleRecord& sample) {
+  out = appendStr(out, end, ",MQ2:");
+  out = formatInt(out, end, sample.mq2);
+  out = appendStr(out, end, ",MQ135:");
+  return formatInt(out, end, sample.mq135);
+}
+
+void pmsWake(uint32_t now) {
+  digitalWrite(PMS_SET_PIN, HIGH);
+  pmsAwake = true;
+  pmsWakeMs = now;
+}
+
+void Pms5003Driver::begin() {
+  pinMode(PMS_SET_PIN, OUTPUT);
+  // El driver de la UART vacía la FIFO por interrupción en este anillo
+  Serial2.setRxBufferSize(PMS_RX_BUFFER);
+  Serial2.begin(PMS_BAUD, SERIAL_8N1, PMS_RX_PIN, PMS_TX_PIN);
+  pmsWake(millis());
+}
+
+// Descarta lo que quede (respuestas tardías, acuses) y pide una trama, que
+// llega mientras leen los demás sensores y la conversión del DS18B20. La orden
+// de modo pasivo va delante de cada petición: si el sensor la ignoró al
+// arrancar o al despertar, queda aplicada en la siguiente muestra.
+void Pms5003Driver::start(SampleRecord& sample) {
+  while (Serial2.available() > 0) Serial2.read();
+  if (!pmsAwake) return;
+  Serial2.write(kPmsPassiveCmd, sizeof(kPmsPassiveCmd));
+  Serial2.write(kPmsReadCmd, sizeof(kPmsReadCmd));
+}
+
+// Analiza la respuesta sin esperar a la UART y gestiona el ciclo del
+// ventilador. Si la trama aún no ha llegado, la muestra lleva la medida anterior.
+void Pms5003Driver::collect(SampleRecord& sample) {
+  uint32_t now = millis();
+  bool fresh = false;
+  while (Serial2.available() > 0) {
+    if (pmsParser.feed(Serial2.read())) fresh = true;
+  }
+
+  bool keepAwake = currentAlertLevel >= AL_MEDIA;
+  if (!pmsAwake && (keepAwake || (int32_t)(now - (pmsNextMeasureMs - PMS_ESTABILIZACION_MS)) >= 0)) {
+    pmsWake(now);
+  }
+  if (pmsAwake && fresh && now - pmsWakeMs >= PMS_ESTABILIZACION_MS) {
+    pmsHaveReading = true;
+    pmsStable[0] = pmsParser.pm1;
+    pmsStable[1] = pmsParser.pm25;
+    pmsStable[2] = pmsParser.pm10;
+    if (!keepAwake) {
+      digitalWrite(PMS_SET_PIN, LOW);
+      pmsAwake = false;
+      pmsNextMeasureMs = now + PMS_CICLO_MS;
+    }
+  }
+  sample.pm1 = pmsStable[0];
+  sample.pm25 = pmsStable[1];
+  sample.pm10 = pmsStable[2];
+  sample.pmValid = pmsHaveReading;
+}
+
+void Pms5003Driver::print(const SampleRecord& sample) {
+  if (!sample.pmValid) {
+    Serial.println("PMS5003: sin medida estable.");
+  } else {
+    Serial.printf("PMS5003: PM1 %u, PM2.5 %u, PM10 %u ug/m3 (%u errores de checksum)\n",
+                  sample.pm1, sample.pm25, sample.pm10, (unsigned)pmsParser.checksumErrors);
+  }
+}
+
+char* Pms5003Driver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, sample.pm1);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, sample.pm25);
+  out = appendChar(out, end, ',');
+  return formatUint(out, end, sample.pm10);
+}
+
+char* Pms5003Driver::appendRadio(char* out, char* end, const SampleRecord& sample) {
+  if (!sample.pmValid) return out;
+  out = appendStr(out, end, ",PM25:");
+  return formatUint(out, end, sample.pm25);
+}
+
+void FlameDriver::begin() {
+  pinMode(FLAME_PIN, INPUT_PULLUP);
+  // Periódico y armado una sola vez: las ISR no tocan el temporizador
+  flameTimer = timerBegin(FLAME_TIMER_NUM, 80, true);  // 1 tick = 1 us
+  timerAttachInterrupt(flameTimer, onFlameDebounce, true);
+  timerAlarmWrite(flameTimer, FLAME_POLL_US, true);
+  timerAlarmEnable(flameTimer);
+  attachInterrupt(digitalPinToInterrupt(FLAME_PIN), onFlameEdge, CHANGE);
+}
+
+void FlameDriver::read(SampleRecord& sample) {
+  sample.flame = (digitalRead(FLAME_PIN) == FLAME_ACTIVE_LEVEL);
+}
+
+void FlameDriver::print(const SampleRecord& sample) {
+  if (sample.flame) Serial.println(sample.fastPath ? "Llama IR detectada (interrupcion)."
+                                                   : "Llama IR detectada.");
+}
+
+char* FlameDriver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  out = appendChar(out, end, sample.flame ? '1' : '0');
+  return out;
+}
+
+char* FlameDriver::appendRadio(char* out, char* end, const SampleRecord& sample) {
+  return sample.flame ? appendStr(out, end, ",Llama:1") : out;
+}
+
+void WindDriver::begin() {
+  pcnt_config_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.pulse_gpio_num = ANEMOMETER_PIN;
+  cfg.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+  cfg.channel = PCNT_CHANNEL_0;
+  cfg.unit = ANEMOMETER_PCNT_UNIT;
+  cfg.pos_mode = PCNT_COUNT_INC;
+  cfg.neg_mode = PCNT_COUNT_DIS;
+  cfg.lctrl_mode = PCNT_MODE_KEEP;
+  cfg.hctrl_mode = PCNT_MODE_KEEP;
+  cfg.counter_h_lim = WIND_PCNT_LIMITE;
+  cfg.counter_l_lim = 0;
+  pcnt_unit_config(&cfg);
+  pcnt_set_filter_value(ANEMOMETER_PCNT_UNIT, 1023);  // ~12,8 us: rebotes del reed
+  pcnt_filter_enable(ANEMOMETER_PCNT_UNIT);
+  pcnt_counter_clear(ANEMOMETER_PCNT_UNIT);
+  pcnt_counter_resume(ANEMOMETER_PCNT_UNIT);
+
+  esp_timer_create_args_t args;
+  memset(&args, 0, sizeof(args));
+  args.callback = onWindTick;
+  args.name = "viento";
+  esp_timer_create(&args, &windTimer);
+  esp_timer_start_periodic(windTimer, 1000000);
+}
+
+// Cada segundo: pulsos del último segundo, racha móvil y vector de dirección.
+// El contador no se borra: entre leerlo y borrarlo se perderían pulsos.
+void onWindTick(void* arg) {
+  int16_t count = 0;
+  pcnt_get_counter_value(ANEMOMETER_PCNT_UNIT, &count);
+  uint16_t pulses = windPulseDelta(windLastCount, count);
+  windLastCount = count;
+  uint8_t sector = windVaneSector(analogRead(WIND_VANE_PIN));
+
+  portENTER_CRITICAL(&windMux);
+  windSampler.tick(pulses, sector);
+  portEXIT_CRITICAL(&windMux);
+}
+
+void WindDriver::read(SampleRecord& sample) {
+  portENTER_CRITICAL(&windMux);
+  WindAccumulator acc = windSampler.drain();
+  portEXIT_CRITICAL(&windMux);
+  // Sin un segundo completo se mantiene lo de la muestra anterior
+  windSummary(acc, sample.windKmh, sample.gustKmh, sample.windDirDeg);
+}
+
+void WindDriver::print(const SampleRecord& sample) {
+  Serial.printf("Viento: %.1f km/h, racha %.1f km/h, %u grados\n", sample.windKmh,
+                sample.gustKmh, sample.windDirDeg);
+}
+
+char* WindDriver::appendLog(char* out, char* end, const SampleRecord& sample) {
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, sample.windKmh, 1);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, sample.gustKmh, 1);
+  out = appendChar(out, end, ',');
+  return formatUint(out, end, sample.windDirDeg);
+}
+
+char* WindDriver::appendRadio(char* out, char* end, const SampleRecord& sample) {
+  out = appendStr(out, end, ",Viento:");
+  out = formatFixed(out, end, sample.windKmh, 1);
+  out = appendStr(out, end, ",Racha:");
+  out = formatFixed(out, end, sample.gustKmh, 1);
+  out = appendStr(out, end, ",Dir:");
+  return formatUint(out, end, sample.windDirDeg);
+}
+
+// Cada flanco reinicia la cuenta: el antirrebote vence cuando la línea lleva
+// FLAME_DEBOUNCE_US estable, y el temporizador lo comprueba cada FLAME_POLL_US.
+// Se guarda el primer flanco para medir latencias. Solo llamadas en IRAM:
+// esp_timer_get_time, el portMUX, gpio_ll (en línea) y xTaskNotifyFromISR.
+void IRAM_ATTR onFlameEdge() {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL_ISR(&flameMux);
+  if (!flamePending) flameEdgeUs = now;
+  flameLastEdgeUs = now;
+  flamePending = true;
+  portEXIT_CRITICAL_ISR(&flameMux);
+}
+
+void IRAM_ATTR onFlameDebounce() {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL_ISR(&flameMux);
+  bool stable = flamePending && now - flameLastEdgeUs >= FLAME_DEBOUNCE_US;
+  if (stable) flamePending = false;
+  portEXIT_CRITICAL_ISR(&flameMux);
+  if (!stable || sensingTaskHandle == NULL) return;
+  if (gpio_ll_get_level(&GPIO, (gpio_num_t)FLAME_PIN) != FLAME_ACTIVE_LEVEL) return;
+  BaseType_t woken = pdFALSE;
+  xTaskNotifyFromISR(sensingTaskHandle, SENSING_NOTIFY_FLAME, eSetBits, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+AlertLevel evaluateAlertLevel(const SampleRecord& sample) {
+  AlertThresholds th = currentAlertThresholds();
+  bool tempHigh = (sample.temperature > th.tempCritica);
+  bool humLow = (sample.humidity < th.humCritica);
+  bool smokeDetected = sample.pmValid && sample.pm25 > PM25_UMBRAL;
+  bool gasDetected = (sample.mq2 > th.gasMq2 || sample.mq135 > th.gasMq135 || smokeDetected);
+
+  AlertLevel level = AL_BAJA;
+  // Una llama vista por el sensor IR es al menos ALTA por sí sola
+  if (sample.flame) {
+    level = (tempHigh || gasDetected) ? AL_CRITICA : AL_ALTA;
+  } else if (tempHigh && humLow && gasDetected) {
+    level = AL_CRITICA;
+  } else if (tempHigh && gasDetected) {
+    level = AL_ALTA;
+  } else if ((tempHigh && humLow) || (humLow && gasDetected)) {
+    level = AL_MEDIA;
+  }
+
+  // El viento no crea alertas, pero acelera la propagación de las que hay
+  if (level != AL_BAJA && level != AL_CRITICA && sample.gustKmh > RACHA_UMBRAL_KMH) {
+    level = (AlertLevel)(level + 1);
+  }
+  return level;
+}
+
+AlertThresholds currentAlertThresholds() {
+  AlertThresholds th = {TEMP_CRITICA, HUM_CRITICA, GAS_UMBRAL_MQ2, GAS_UMBRAL_MQ135};
+#if ADAPTIVE_THRESHOLDS
+  const HourBaseline* base = currentBaseline();
+  if (base) {
+    th.tempCritica = adaptiveTempLimit(*base);
+    th.humCritica = adaptiveHumLimit(*base);
+  }
+#endif
+  if (fireWeather.codes.fwi >= FWI_UMBRAL_MUY_ALTO) {
+    th.tempCritica -= FWI_AJUSTE_TEMP;
+    th.humCritica += FWI_AJUSTE_HUM;
+    th.gasMq2 = th.gasMq2 * FWI_GAS_PCT / 100;
+    th.gasMq135 = th.gasMq135 * FWI_GAS_PCT / 100;
+  }
+  return th;
+}
+
+void printSample(const SampleRecord& sample) {
+  NodeSensors::printAll(sample);
+  Serial.print("Nivel de Alerta: ");
+  Serial.println(getAlertLevelString(sample.level));
+
+  uint32_t drops = radioDrops.load() + logDrops.load();
+  if (drops > 0) {
+    Serial.printf("Muestras descartadas por colas llenas: %u\n", (unsigned)drops);
+  }
+}
+
+void activateLocalAlerts(AlertLevel level) {
   switch (level) {
-    case AL_BAJA: return "BAJA";
-    case AL_MEDIA: return "MEDIA";
-    case AL_ALTA: return "ALTA";
-    case AL_CRITICA: return "CRITICA";
-    default: return "DESCONOCIDO";
+    case AL_BAJA:
+      digitalWrite(LED_PIN, LOW);
+      digitalWrite(BUZZER_PIN, LOW);
+      break;
+    case AL_MEDIA:
+      digitalWrite(LED_PIN, HIGH);
+      digitalWrite(BUZZER_PIN, LOW);
+      break;
+    case AL_ALTA:
+      digitalWrite(LED_PIN, (millis() / 200) % 2);
+      if ((millis() / 500) % 2) {
+        tone(BUZZER_PIN, 1500);
+      } else {
+        noTone(BUZZER_PIN);
+      }
+      break;
+    case AL_CRITICA:
+      digitalWrite(LED_PIN, (millis() / 100) % 2);
+      tone(BUZZER_PIN, 2000);
+      break;
+  }
+}
+
+void IRAM_ATTR onLoRaDio0() {
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(txDoneSem, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+void onLoRaTxDone() {
+  // Nunca se llama: ver setup()
+}
+
+// Envía una trama y espera a TX done; false si no se pudo enviar o no terminó
+bool transmitLoRa(const char* data, size_t len) {
+  static int8_t appliedTxPower = LORA_TX_POWER_DBM;
+  xSemaphoreTake(txDoneSem, 0);  // descarta un TX-done atrasado
+  spiBus.acquire(SPI_CLIENT_RADIO);
+  int8_t txPower = loraTxPowerDbm.load();
+  if (txPower != appliedTxPower) {
+    LoRa.setTxPower(txPower);
+    appliedTxPower = txPower;
+  }
+  if (!LoRa.beginPacket()) {
+    spiBus.release();
+    return false;
+  }
+
+  LoRa.write((const uint8_t*)data, len);
+  LoRa.endPacket(true);
+  spiBus.release();
+  dutyCycle.charge(loraAirtimeMs(len));
+
+  // Durante el tiempo en el aire el bus queda libre para la SD. Las
+  // notificaciones que lleguen mientras tanto quedan pendientes para radioTask.
+  if (xSemaphoreTake(txDoneSem, pdMS_TO_TICKS(LORA_TX_TIMEOUT_MS)) != pdTRUE) {
+    if (serialVerbose()) Serial.println("Timeout esperando fin de TX LoRa.");
+    return false;
+  }
+  return true;
+}
+
+void sendLoRaAlert(const SampleRecord& sample) {
+  if (sample.level == AL_BAJA) return;
+
+  static_assert(sizeof("ALERTA_INCENDIO,Nivel:") + LEVEL_STR_MAX + NodeSensors::kRadioMax +
+                        sizeof(",ID:Sentinela001") - 1 <= LORA_MSG_MAX,
+                "la alerta de peor caso no cabe en LORA_MSG_MAX");
+  char message[LORA_MSG_MAX];
+  char* end = message + sizeof(message);
+  char* p = appendStr(message, end, "ALERTA_INCENDIO,Nivel:");
+  p = appendStr(p, end, getAlertLevelString(sample.level));
+  char* fields = p;
+  p = NodeSensors::appendRadioFields(p, end, sample);
+  p = appendStr(p, end, ",ID:Sentinela001");
+  // No debería pasar (static_assert); si un driver nuevo se sale, la alerta
+  // sale sin lecturas antes que cortada
+  if (p == end) p = appendStr(fields, end, ",ID:Sentinela001");
+  *p = '\0';
+  if (!transmitLoRa(message, p - message)) return;
+
+  int64_t latencyUs = esp_timer_get_time() - sample.readUs;
+  LatencyStats& stats = sample.fastPath ? flameTxLatency : txLatency;
+  stats.record(latencyUs);
+  if (!serialVerbose()) return;
+  Serial.print("LoRa enviado: ");
+  Serial.println(message);
+  Serial.printf("Latencia %s->TX: %.1f ms (min %.1f, media %.1f, max %.1f)\n",
+                sample.fastPath ? "llama" : "lectura", latencyUs / 1000.0, stats.minUs / 1000.0,
+                stats.sumUs / 1000.0 / stats.count, stats.maxUs / 1000.0);
+}
+
+void logDataToSD(const SampleRecord& sample) {
+  bool verbose = serialVerbose();
+#if RAW_LOG
+  RawRecord rec = rawEncode(sample);
+  if (sdAvailable) {
+    if (rawLogAppend(rec)) {
+      if (verbose) Serial.println("Log guardado en SD (crudo).");
+      return;
+    }
+    sdAvailable = false;
+    lastSdRetryMs = millis();
+    if (verbose) Serial.println("Error al escribir en la SD; se usa la flash interna.");
+  }
+  // A la flash va el mismo registro: la migración lo devuelve al anillo
+  const char* data = (const char*)&rec;
+  size_t len = sizeof(rec);
+#else
+  static_assert(FMT_UINT_MAX + 1 + NodeSensors::kLogMax + 1 + LEVEL_STR_MAX + 1 < LOG_LINE_MAX,
+                "la línea de log de peor caso no cabe en LOG_LINE_MAX");
+  char line[LOG_LINE_MAX];
+  char* end = line + sizeof(line);
+  char* p = formatUint(line, end, (uint32_t)(sample.readUs / 1000000));
+  p = appendChar(p, end, 's');
+  p = NodeSensors::appendLogColumns(p, end, sample);
+  p = appendChar(p, end, ',');
+  p = appendStr(p, end, getAlertLevelString(sample.level));
+  p = appendChar(p, end, '\n');
+  if (p == end) {
+    if (verbose) Serial.println("Linea de log demasiado larga; descartada.");
+    return;
+  }
+  size_t len = p - line;
+
+  if (sdAvailable) {
+    if (appendToSd(LOG_PATH, (const uint8_t*)line, len)) {
+      if (verbose) Serial.println("Log guardado en SD.");
+      return;
+    }
+    sdAvailable = false;
+    lastSdRetryMs = millis();
+    if (verbose) Serial.println("Error al escribir en la SD; se usa la flash interna.");
+  }
+  const char* data = line;
+#endif
+  bool ok = appendFallback(data, len);
+  if (verbose) {
+    Serial.println(ok ? "Log guardado en flash interna." : "Error al escribir en la flash interna.");
+  }
+}
+
+// Cabecera generada por NodeSensors al crear el fichero de log
+void ensureLogHeader() {
+  if (RAW_LOG || logFs == NULL) return;
+
+  storageLock();
+  bool exists = logFs->exists(LOG_PATH);
+  storageUnlock();
+  if (exists) return;
+
+  char header[LOG_LINE_MAX];
+  char* end = header + sizeof(header);
+  char* p = appendStr(header, end, "tiempo");
+  p = NodeSensors::appendLogHeader(p, end);
+  p = appendStr(p, end, ",nivel\n");
+  if (p == end) return;
+  appendToSd(LOG_PATH, (const uint8_t*)header, p - header);
+}
+
+// Sin close(): el registro queda en el búfer del fichero y solo se escribe a
+// la tarjeta lo que llena un sector, con cesión del bus entre bloques
+bool appendToSd(const char* path, const uint8_t* data, size_t len) {
+  int64_t start = esp_timer_get_time();
+  storageLock();
+  SdAppendFile* f = openSdAppend(path);
+  if (f == NULL) {
+    storageUnlock();
+    return false;
+  }
+  size_t written = writeSdChunked(f->file, data, len);
+  f->dirty = true;
+  if (written < len) {
+    // La tarjeta falló: se reabre en el siguiente montaje
+    f->file.close();
+    f->dirty = false;
+  }
+  storageUnlock();
+  int64_t elapsed = esp_timer_get_time() - start;
+  storageStats.bytes += written;
+  storageStats.busyUs += elapsed;
+  storageStats.writes++;
+  if (elapsed > storageStats.maxWriteUs) storageStats.maxWriteUs = elapsed;
+  return written == len;
+}
+
+// Llamar con storageLock()
+SdAppendFile* openSdAppend(const char* path) {
+  for (SdAppendFile& f : sdFiles) {
+    if (strcmp(f.path, path) != 0) continue;
+    if (!f.file) f.file = logFs->open(path, FILE_APPEND);
+    return f.file ? &f : NULL;
+  }
+  return NULL;
+}
+
+// Una toma del bus por fichero: la radio puede entrar entre uno y otro
+void syncSdFiles(bool force) {
+  if (!force && millis() - lastSdSyncMs < SD_SYNC_MS) return;
+  lastSdSyncMs = millis();
+  for (SdAppendFile& f : sdFiles) {
+    if (!f.dirty) continue;
+    int64_t start = esp_timer_get_time();
+    storageLock();
+    f.file.flush();
+    f.dirty = false;
+    storageUnlock();
+    int64_t elapsed = esp_timer_get_time() - start;
+    storageStats.busyUs += elapsed;
+    storageStats.syncs++;
+    if (elapsed > storageStats.maxSyncUs) storageStats.maxSyncUs = elapsed;
+  }
+}
+
+// Antes de leer un fichero que puede tener datos sin sincronizar; llamar con
+// storageLock()
+void flushSdFile(const char* path) {
+  for (SdAppendFile& f : sdFiles) {
+    if (!f.dirty || strcmp(f.path, path) != 0) continue;
+    f.file.flush();
+    f.dirty = false;
+  }
+}
+
+// Desde endStorage(), con el bus ya tomado
+void closeSdFiles() {
+  for (SdAppendFile& f : sdFiles) {
+    if (f.file) f.file.close();
+    f.dirty = false;
+  }
+}
+
+bool appendFallback(const char* data, size_t len) {
+  return fallbackAvailable && fallbackLog.append(data, len);
+}
+
+bool flushFallback() {
+  if (!fallbackAvailable) return true;
+  bool ok = fallbackLog.flush();
+  ok = aggFallbackLog.flush() && ok;
+  return dailyFallbackLog.flush() && ok;
+}
+
+void retryStorage() {
+  if (millis() - lastSdRetryMs < SD_RETRY_INTERVAL_MS) return;
+  lastSdRetryMs = millis();
+
+  sdAvailable = mountStorage();
+  if (sdAvailable) {
+    ensureLogHeader();
+    migrateFallbackToSd();
+  }
+}
+
+// Destino de una migración: un fichero de la SD. sync() vuelca el búfer del
+// fichero a la tarjeta antes de que FallbackLog dé los bytes por copiados.
+struct SdFileSink {
+  const char* path;
+
+  bool write(const uint8_t* data, size_t len) { return appendToSd(path, data, len); }
+
+  bool sync() {
+    storageLock();
+    flushSdFile(path);
+    storageUnlock();
+    return true;
+  }
+};
+
+// Destino de la migración en modo crudo: los registros vuelven al anillo con
+// secuencia nueva. Cada anexado ya está en la tarjeta; sync() guarda además el
+// superbloque.
+struct RawRingSink {
+  bool write(const uint8_t* data, size_t len) {
+    for (size_t at = 0; at + sizeof(RawRecord) <= len; at += sizeof(RawRecord)) {
+      RawRecord rec;
+      memcpy(&rec, data + at, sizeof(rec));
+      if (!rawLogAppend(rec)) return false;
+    }
+    return true;
+  }
+
+  bool sync() { return rawWriteSuperblock(); }
+};
+
+// Vuelca a la SD los segmentos de flash, del más antiguo al más reciente: las
+// muestras a LOG_PATH, los agregados a AGG_PATH y los resúmenes a DAILY_PATH.
+// Interrumpida, se reanuda desde la última posición sincronizada.
+// En modo crudo las muestras van al anillo; agregados y resúmenes no tienen
+// fichero en la SD y se quedan en flash ("resumen" los lee de allí).
+bool migrateFallbackToSd() {
+  if (!fallbackAvailable || !flushFallback()) return false;
+  uint32_t pending = fallbackLog.size();
+  if (!RAW_LOG) pending += aggFallbackLog.size() + dailyFallbackLog.size();
+  if (pending == 0) return true;
+
+  bool verbose = serialVerbose();
+  if (verbose) Serial.println("Migrando registro de flash interna a la SD...");
+#if RAW_LOG
+  RawRingSink ringSink;
+  bool ok = fallbackLog.migrate(ringSink);
+#else
+  SdFileSink logSink = {LOG_PATH};
+  SdFileSink aggSink = {AGG_PATH};
+  SdFileSink dailySink = {DAILY_PATH};
+  bool ok = fallbackLog.migrate(logSink) && aggFallbackLog.migrate(aggSink) &&
+            dailyFallbackLog.migrate(dailySink);
+#endif
+  if (!ok) {
+    if (verbose) Serial.println("Migración interrumpida; se reanudará donde quedó.");
+    return false;
+  }
+  if (verbose) Serial.println("Migración completada.");
+  return true;
+}
+
+// Desmontar, montar y sondear la tarjeta también usan el bus: en el backend
+// SPI se toma antes de que storageSharesLoRaBus refleje el nuevo montaje
+bool mountStorage() {
+#if LOG_BACKEND != LOG_BACKEND_SDMMC
+  spiBus.acquire(SPI_CLIENT_SD);
+#endif
+  endStorage();
+  bool ok = beginStorage();
+#if LOG_BACKEND != LOG_BACKEND_SDMMC
+  spiBus.release();
+#endif
+  return ok;
+}
+
+// Llamar desde mountStorage()
+bool beginStorage() {
+#if LOG_BACKEND == LOG_BACKEND_SDMMC
+#if SDMMC_1BIT
+  pinMode(SDMMC_D3, OUTPUT);
+  digitalWrite(SDMMC_D3, HIGH);  // D3 alto selecciona modo SD en la tarjeta
+#endif
+  if (SD_MMC.begin("/sdcard", SDMMC_1BIT, false, SDMMC_FREQ_KHZ)) {
+    logFs = &SD_MMC;
+    storageSharesLoRaBus = false;
+    if (serialVerbose()) {
+      Serial.printf("Tarjeta SD inicializada (SDMMC %d bits, %d kHz).\n", SDMMC_1BIT ? 1 : 4,
+                    SDMMC_FREQ_KHZ);
+    }
+    return true;
+  }
+#if SDMMC_FALLBACK_SPI
+  if (serialVerbose()) Serial.println("SDMMC no disponible, probando SPI.");
+  sdSpi.begin(SDMMC_CLK, SDMMC_D0, SDMMC_CMD, SDMMC_D3);
+  if (SD.begin(SDMMC_D3, sdSpi)) {
+    logFs = &SD;
+    storageSharesLoRaBus = false;
+    if (serialVerbose()) Serial.println("Tarjeta SD inicializada (SPI, bus propio).");
+    return true;
+  }
+#endif
+  return false;
+#elif RAW_LOG
+  storageSharesLoRaBus = true;
+  return rawLogBegin();
+#else
+  if (SD.begin(SD_CS_PIN)) {
+    logFs = &SD;
+    storageSharesLoRaBus = true;
+    if (serialVerbose()) Serial.println("Tarjeta SD inicializada.");
+    return true;
+  }
+  return false;
+#endif
+}
+
+void endStorage() {
+  closeSdFiles();
+#if LOG_BACKEND == LOG_BACKEND_SDMMC
+  SD_MMC.end();
+#endif
+#if RAW_LOG
+  if (rawCard.pdrv != 0xFF) sdcard_uninit(rawCard.pdrv);
+  rawCard.pdrv = 0xFF;
+#else
+  SD.end();
+#endif
+  logFs = NULL;
+}
+
+// Solo el backend SPI por defecto comparte bus con la radio
+void storageLock() {
+  if (storageSharesLoRaBus) spiBus.acquire(SPI_CLIENT_SD);
+}
+
+void storageUnlock() {
+  if (storageSharesLoRaBus) spiBus.release();
+}
+
+// Llamar entre storageLock() y storageUnlock()
+size_t writeSdChunked(File& file, const uint8_t* data, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    size_t chunk = len - written;
+    if (chunk > SD_BLOCK_SIZE) chunk = SD_BLOCK_SIZE;
+    size_t n = file.write(data + written, chunk);
+    written += n;
+    if (n < chunk) break;
+    if (storageSharesLoRaBus) spiBus.yieldToRadio();
+  }
+  return written;
+}
+
+// --- Corte de alimentación ---
+void powerMonitorBegin() {
+  analogSetPinAttenuation(BATTERY_PIN, ADC_11db);
+  if (prefs.getBytes("corte", &powerFailRecord, sizeof(powerFailRecord)) !=
+      sizeof(powerFailRecord)) {
+    memset(&powerFailRecord, 0, sizeof(powerFailRecord));
+  } else if (powerFailRecord.count > 0) {
+    Serial.printf("Ultimo corte (%u en total): %.2f V, muestra %u, %u registros vaciados en "
+                  "%.1f ms (presupuesto %d ms), %u sin guardar\n",
+                  (unsigned)powerFailRecord.count, powerFailRecord.batteryMv / 1000.0,
+                  (unsigned)powerFailRecord.lastSeq, (unsigned)powerFailRecord.flushed,
+                  powerFailRecord.flushUs / 1000.0, POWER_FAIL_BUDGET_MS,
+                  (unsigned)powerFailRecord.pending);
+  }
+
+  esp_timer_create_args_t args;
+  memset(&args, 0, sizeof(args));
+  args.callback = onPowerCheck;
+  args.name = "bateria";
+  esp_timer_create(&args, &powerTimer);
+  esp_timer_start_periodic(powerTimer, POWER_CHECK_MS * 1000);
+}
+
+uint16_t readBatteryMv() {
+  return (uint16_t)(analogReadMilliVolts(BATTERY_PIN) * BATTERY_DIVIDER);
+}
+
+void onPowerCheck(void* arg) {
+  uint16_t mv = readBatteryMv();
+  if (powerFailing) {
+    if (mv >= POWER_RESTORE_MV) powerFailing = false;
+    return;
+  }
+  powerLowCount = (mv < POWER_FAIL_MV) ? powerLowCount + 1 : 0;
+  if (powerLowCount < POWER_FAIL_SAMPLES) return;
+  // Batería ya baja al arrancar: sin tareas no hay nada que vaciar todavía. Se
+  // vuelve a detectar en cuanto existan.
+  if (radioTaskHandle == NULL || logTaskHandle == NULL) return;
+
+  powerFailing = true;
+  powerLowCount = 0;
+  powerFailUs = esp_timer_get_time();
+  powerFailMv = mv;
+  powerFailPending.store(true);
+  lastGaspPending.store(true);
+  xTaskNotify(radioTaskHandle, RADIO_NOTIFY_POWER_FAIL, eSetBits);
+  xTaskNotifyGive(logTaskHandle);
+}
+
+// Sin volcar muestras por Serial ni estadísticas: solo lo que hay que salvar, por orden
+// de valor, mientras quede presupuesto. Lo que no quepa se cuenta como perdido.
+// FlushBudget (nucleo.h) parte del coste medio de escritura y aprende el peor.
+void emergencyFlush() {
+  FlushBudget budget(powerFailUs + POWER_FAIL_BUDGET_MS * 1000LL, POWER_FAIL_RESERVE_MS * 1000LL,
+                     storageStats.writes ? storageStats.busyUs / storageStats.writes : 0);
+  uint32_t flushed = 0;
+  SampleRecord sample;
+  while (budget.canStart(esp_timer_get_time()) && logQueue.pop(sample)) {
+    int64_t startUs = esp_timer_get_time();
+    logDataToSD(sample);
+    budget.record(esp_timer_get_time() - startUs);
+    logDoneSeq.store(sample.seq);
+    flushed++;
+  }
+  flushFallback();
+#if RAW_LOG
+  if (sdAvailable) rawWriteSuperblock();
+#else
+  if (sdAvailable) syncSdFiles(true);
+#endif
+
+  powerFailRecord.count++;
+  powerFailRecord.lastSeq = lastSampleSeq.load();
+  powerFailRecord.flushed = flushed;
+  powerFailRecord.pending = logQueue.size();
+  powerFailRecord.radioDrops = radioDrops.load();
+  powerFailRecord.logDrops = logDrops.load();
+  for (int i = 0; i <= AL_CRITICA; i++) {
+    powerFailRecord.levelTransitions[i] = levelTransitions[i].load();
+  }
+  powerFailRecord.batteryMv = powerFailMv;
+  powerFailRecord.flushUs = esp_timer_get_time() - powerFailUs;
+  prefs.putBytes("corte", &powerFailRecord, sizeof(powerFailRecord));
+  if (serialVerbose()) {
+    Serial.printf("Corte de alimentacion: %u registros vaciados en %.1f ms\n", (unsigned)flushed,
+                  powerFailRecord.flushUs / 1000.0);
+  }
+}
+
+// Último mensaje: la radio tiene más prioridad que el log y sale primero; el
+// vaciado avanza mientras la trama está en el aire
+void sendLastGasp() {
+  char message[LORA_MSG_MAX];
+  char* end = message + sizeof(message);
+  char* p = appendStr(message, end, "CORTE_ENERGIA,Bat:");
+  p = formatFixed(p, end, powerFailMv / 1000.0f, 2);
+  p = appendStr(p, end, ",Seq:");
+  p = formatUint(p, end, lastSampleSeq.load());
+  p = appendStr(p, end, ",Nivel:");
+  p = appendStr(p, end, getAlertLevelString(currentAlertLevel));
+  p = appendStr(p, end, ",ID:Sentinela001");
+  if (p == end) return;
+  *p = '\0';
+  if (transmitLoRa(message, p - message) && serialVerbose()) Serial.println(message);
+}
+
+// --- Telemetría por predicción ---
+struct TelChannelInfo {
+  const char* name;
+  int32_t epsilon;
+  uint8_t decimals;  // el valor escalado lleva un decimal implícito si es 1
+};
+const TelChannelInfo kTelChannels[TEL_COUNT] = {
+    {"T", TEL_EPS_TEMP10, 1},  {"H", TEL_EPS_HUM10, 1},  {"MQ2", TEL_EPS_MQ, 0},
+    {"MQ135", TEL_EPS_MQ, 0},  {"PM25", TEL_EPS_PM25, 0}, {"V", TEL_EPS_VIENTO10, 1},
+};
+
+// Valor escalado de un canal; false si el sensor no dio lectura válida
+bool telemetryValue(const SampleRecord& sample, TelChannel channel, int32_t& value) {
+  switch (channel) {
+    case TEL_TEMP: value = lroundf(sample.temperature * 10); return !sample.dhtError;
+    case TEL_HUM: value = lroundf(sample.humidity * 10); return !sample.dhtError;
+    case TEL_MQ2: value = sample.mq2; return true;
+    case TEL_MQ135: value = sample.mq135; return true;
+    case TEL_PM25: value = sample.pm25; return sample.pmValid;
+    case TEL_VIENTO: value = lroundf(sample.windKmh * 10); return true;
+    default: return false;
+  }
+}
+
+// Hora del sistema en ms al leer la muestra: sigue contando durante el sueño
+// profundo, esp_timer no. Un cambio de hora desde la consola fuerza resincronizar.
+uint32_t telemetryTimeMs(const SampleRecord& sample) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t nowMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  return (uint32_t)(nowMs - (esp_timer_get_time() - sample.readUs) / 1000);
+}
+
+// El predictor solo avanza con lo que se transmite, igual que en el colector.
+// Una trama perdida desincroniza hasta el siguiente latido.
+void updateTelemetry(const SampleRecord& sample) {
+  uint32_t timeMs = telemetryTimeMs(sample);
+  TelemetryFrame frame;
+  frame.seq = sample.seq;
+  frame.timeMs = timeMs;
+  frame.mask = 0;
+  frame.full = telemetryResync || timeMs - lastTelemetryMs >= TEL_HEARTBEAT_MS;
+  telemetryStats.samples++;
+
+  for (int c = 0; c < TEL_COUNT; c++) {
+    int32_t value;
+    if (!telemetryValue(sample, (TelChannel)c, value)) continue;
+    frame.values[c] = value;
+    TrendPredictor& predictor = telemetryPredictors[c];
+    int32_t error = predictor.primed() ? abs(value - predictor.predict(timeMs)) : INT32_MAX;
+    if (frame.full || error > kTelChannels[c].epsilon) {
+      frame.mask |= 1 << c;
+    } else {
+      telemetryStats.suppressed++;
+      if (error > telemetryStats.maxError[c]) telemetryStats.maxError[c] = error;
+    }
+  }
+  if (frame.mask == 0) return;
+
+  if (!telemetryQueue.push(frame)) {
+    // Sin encolar, el colector no verá estos valores: no se avanza el predictor
+    telemetryStats.drops++;
+    return;
+  }
+  for (int c = 0; c < TEL_COUNT; c++) {
+    if (frame.mask & (1 << c)) telemetryPredictors[c].update(timeMs, frame.values[c]);
+  }
+  telemetryStats.frames++;
+  if (frame.full) telemetryStats.heartbeats++;
+  telemetryStats.updates += __builtin_popcount(frame.mask);
+  telemetryResync = false;
+  lastTelemetryMs = timeMs;
+  xTaskNotify(radioTaskHandle, RADIO_NOTIFY_TELEMETRY, eSetBits);
+}
+
+// radioBusy se activa antes de sacar nada de las colas: si todo está vacío y la
+// radio no está ocupada, no hay trama pendiente ni en el aire
+bool radioPending() {
+  return radioBusy.load() || radioQueue.size() > 0 || telemetryQueue.size() > 0 ||
+         rollupRadioQueue.size() > 0;
+}
+
+void sendTelemetry(const TelemetryFrame& frame) {
+  char message[LORA_MSG_MAX];
+  char* end = message + sizeof(message);
+  char* p = appendStr(message, end, frame.full ? "TEL_COMPLETA,ID:Sentinela001,Seq:"
+                                          : "TEL,ID:Sentinela001,Seq:");
+  p = formatUint(p, end, frame.seq);
+  p = appendStr(p, end, ",t:");
+  p = formatUint(p, end, frame.timeMs);
+  for (int c = 0; c < TEL_COUNT; c++) {
+    if (!(frame.mask & (1 << c))) continue;
+    p = appendChar(p, end, ',');
+    p = appendStr(p, end, kTelChannels[c].name);
+    p = appendChar(p, end, ':');
+    if (kTelChannels[c].decimals) {
+      p = formatFixed(p, end, frame.values[c] / 10.0f, 1);
+    } else {
+      p = formatInt(p, end, frame.values[c]);
+    }
+  }
+  if (p == end) {
+    radioOverflows++;
+    return;
+  }
+  *p = '\0';
+  if (transmitLoRa(message, p - message) && serialVerbose()) {
+    Serial.print("Telemetria enviada: ");
+    Serial.println(message);
+  }
+}
+
+// --- Agregación ---
+void aggregateSample(const SampleRecord& sample) {
+  uint32_t nowS = (uint32_t)time(NULL);
+  for (uint8_t p = 0; p < AGG_PERIODS; p++) {
+    uint32_t bucket = nowS / kAggPeriodS[p];
+    if (bucket != aggBucket[p]) {
+      emitRollup(p);
+      aggBucket[p] = bucket;
+    }
+  }
+  for (int c = 0; c < TEL_COUNT; c++) {
+    int32_t value;
+    if (!telemetryValue(sample, (TelChannel)c, value)) continue;
+    float x = kTelChannels[c].decimals ? value / 10.0f : (float)value;
+    for (uint8_t p = 0; p < AGG_PERIODS; p++) aggregates[p][c].add(x);
+  }
+}
+
+// Cierra la cubeta en curso del periodo; las vacías (arranque) no se emiten
+void emitRollup(uint8_t period) {
+  Rollup rollup;
+  rollup.period = period;
+  rollup.startS = aggBucket[period] * kAggPeriodS[period];
+  bool empty = true;
+  for (int c = 0; c < TEL_COUNT; c++) {
+    rollup.channels[c] = aggregates[period][c];
+    if (aggregates[period][c].count > 0) empty = false;
+  }
+  memset(aggregates[period], 0, sizeof(aggregates[period]));
+  if (empty) return;
+
+  aggregationStats.rollups++;
+  if (rollupLogQueue.push(rollup)) {
+    xTaskNotifyGive(logTaskHandle);
+  } else {
+    aggregationStats.drops++;
+  }
+  if (period >= AGG_RADIO_DESDE) {
+    if (rollupRadioQueue.push(rollup)) {
+      xTaskNotify(radioTaskHandle, RADIO_NOTIFY_ROLLUP, eSetBits);
+    } else {
+      aggregationStats.drops++;
+    }
+  }
+}
+
+// Una línea por canal: agg,periodo_s,inicio_s,canal,n,min,max,media,desv
+void logRollup(const Rollup& rollup) {
+  for (int c = 0; c < TEL_COUNT; c++) {
+    const ChannelAggregate& agg = rollup.channels[c];
+    if (agg.count == 0) continue;
+    uint8_t decimals = kTelChannels[c].decimals + 1;
+    char line[LOG_LINE_MAX];
+    char* end = line + sizeof(line);
+    char* p = appendStr(line, end, "agg,");
+    p = formatUint(p, end, kAggPeriodS[rollup.period]);
+    p = appendChar(p, end, ',');
+    p = formatUint(p, end, rollup.startS);
+    p = appendChar(p, end, ',');
+    p = appendStr(p, end, kTelChannels[c].name);
+    p = appendChar(p, end, ',');
+    p = formatUint(p, end, agg.count);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, agg.min, decimals);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, agg.max, decimals);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, agg.mean, decimals);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, agg.stddev(), decimals);
+    p = appendChar(p, end, '\n');
+    if (p == end) continue;
+    size_t len = p - line;
+    // Sin sistema de ficheros en la SD (modo crudo) van a su propio respaldo en flash
+    if (!(sdAvailable && logFs != NULL && appendToSd(AGG_PATH, (const uint8_t*)line, len))) {
+      if (fallbackAvailable) aggFallbackLog.append(line, len);
+    }
+  }
+}
+
+// AGG,ID,P:<periodo>,t:<inicio>,<canal>:min/media/max
+void sendRollup(const Rollup& rollup) {
+  char message[LORA_MSG_MAX];
+  char* end = message + sizeof(message);
+  char* p = appendStr(message, end, "AGG,ID:Sentinela001,P:");
+  p = formatUint(p, end, kAggPeriodS[rollup.period]);
+  p = appendStr(p, end, ",t:");
+  p = formatUint(p, end, rollup.startS);
+  for (int c = 0; c < TEL_COUNT; c++) {
+    const ChannelAggregate& agg = rollup.channels[c];
+    if (agg.count == 0) continue;
+    uint8_t decimals = kTelChannels[c].decimals;
+    p = appendChar(p, end, ',');
+    p = appendStr(p, end, kTelChannels[c].name);
+    p = appendChar(p, end, ':');
+    p = formatFixed(p, end, agg.min, decimals);
+    p = appendChar(p, end, '/');
+    p = formatFixed(p, end, agg.mean, decimals);
+    p = appendChar(p, end, '/');
+    p = formatFixed(p, end, agg.max, decimals);
+  }
+  if (p == end) {
+    radioOverflows++;
+    return;
+  }
+  *p = '\0';
+  if (transmitLoRa(message, p - message) && serialVerbose()) {
+    Serial.print("Agregado enviado: ");
+    Serial.println(message);
+  }
+}
+
+// Log crudo durante una alerta y AGG_RAW_POST_MS después. Con sueño profundo
+// la ventana no sobrevive entre ciclos y se guarda todo.
+bool keepRawSample(const SampleRecord& sample) {
+  if (LOG_RAW_SIEMPRE || USE_DEEP_SLEEP) return true;
+  if (sample.level != AL_BAJA) {
+    rawAlertSeen = true;
+    rawLastAlertUs = sample.readUs;
+    return true;
+  }
+  return rawAlertSeen && sample.readUs - rawLastAlertUs < (int64_t)AGG_RAW_POST_MS * 1000;
+}
+
+void holdPreEvent(const SampleRecord& sample) {
+  rawPreEvent[rawPrePos] = sample;
+  rawPrePos = (rawPrePos + 1) % AGG_RAW_PRE_SAMPLES;
+  if (rawPreCount < AGG_RAW_PRE_SAMPLES) {
+    rawPreCount++;
+  } else {
+    aggregationStats.rawSkipped++;  // la más antigua sale sin escribirse
+  }
+}
+
+// Las muestras previas a la alerta, de la más antigua a la más reciente
+void flushPreEvent() {
+  uint8_t start = (rawPrePos + AGG_RAW_PRE_SAMPLES - rawPreCount) % AGG_RAW_PRE_SAMPLES;
+  for (uint8_t i = 0; i < rawPreCount; i++) {
+    logDataToSD(rawPreEvent[(start + i) % AGG_RAW_PRE_SAMPLES]);
+    aggregationStats.rawKept++;
+  }
+  rawPreCount = 0;
+}
+
+// --- Exportación por Serial ---
+// Los avisos que no pasan por serialVerbose() pueden colarse entre tramas;
+// el receptor se resincroniza con la cabecera A5 5A y el CRC.
+bool serialVerbose() {
+  return serialDump.load() && !exportActive.load();
+}
+
+// --- Lectura del log ---
+// En modo crudo se leen los registros del anillo del más antiguo al más
+// reciente, tal cual; tools/raw2csv los convierte en el host.
+// Llamar con el bus tomado, igual que logReaderRead() y logReaderClose()
+bool logReaderOpen(LogReader& reader) {
+#if RAW_LOG
+  reader.size = rawRing.size();
+  return sdAvailable;
+#else
+  if (logFs == NULL) return false;
+  flushSdFile(LOG_PATH);
+  reader.file = logFs->open(LOG_PATH, FILE_READ);
+  reader.size = reader.file ? reader.file.size() : 0;
+  return (bool)reader.file;
+#endif
+}
+
+size_t logReaderRead(LogReader& reader, uint32_t offset, uint8_t* buf, size_t len) {
+#if RAW_LOG
+  return rawRing.read(offset, buf, len);
+#else
+  if (reader.file.position() != offset && !reader.file.seek(offset)) return 0;
+  return reader.file.read(buf, len);
+#endif
+}
+
+void logReaderClose(LogReader& reader) {
+  if (reader.file) reader.file.close();
+}
+
+bool startExport(uint32_t offset, uint32_t length, bool compress) {
+  if (!sdAvailable) {
+    Serial.println("Exportacion: SD no disponible.");
+    return false;
+  }
+  storageLock();
+  bool ok = logReaderOpen(logExport.reader);
+  uint32_t size = ok ? logExport.reader.size : 0;
+  ok = ok && offset <= size;
+  if (!ok) logReaderClose(logExport.reader);
+  storageUnlock();
+  if (!ok) {
+    Serial.printf("Exportacion: offset %u fuera del log (%u B).\n", (unsigned)offset,
+                  (unsigned)size);
+    return false;
+  }
+
+  logExport.offset = offset;
+  logExport.end = (length > 0 && length < size - offset) ? offset + length : size;
+  logExport.compress = compress;
+  logExport.bytesRead = 0;
+  logExport.bytesSent = 0;
+
+  // La cabecera sale a la velocidad normal para que el receptor sepa a qué
+  // cambiar. El nombre le dice si recibe texto o registros del anillo crudo.
+#if RAW_LOG
+  static const char name[] = RAW_EXPORT_NAME;
+#else
+  static const char name[] = LOG_PATH;
+#endif
+  uint8_t header[14 + sizeof(name) - 1];
+  uint32_t baud = EXPORT_BAUD;
+  uint16_t chunk = EXPORT_CHUNK;
+  memcpy(header, &size, 4);
+  memcpy(header + 4, &logExport.end, 4);
+  memcpy(header + 8, &baud, 4);
+  memcpy(header + 12, &chunk, 2);
+  memcpy(header + 14, name, sizeof(name) - 1);
+  exportActive.store(true);
+  sendExportFrame(EXP_CABECERA, offset, header, sizeof(header));
+  Serial.flush();
+  Serial.updateBaudRate(EXPORT_BAUD);
+  logExport.active = true;
+  logExport.startMs = millis();
+  return true;
+}
+
+// Solo escribe lo que cabe en el búfer del UART: nunca bloquea la tarea
+void exportPoll() {
+  static uint8_t chunk[EXPORT_CHUNK];
+  static uint8_t packed[EXPORT_CHUNK];
+  for (int i = 0; i < EXPORT_FRAMES_PER_POLL; i++) {
+    if (logExport.offset >= logExport.end) {
+      finishExport(true);
+      return;
+    }
+    if (Serial.availableForWrite() < EXPORT_CHUNK + EXPORT_FRAME_OVERHEAD) return;
+
+    size_t want = logExport.end - logExport.offset;
+    if (want > EXPORT_CHUNK) want = EXPORT_CHUNK;
+    storageLock();
+    size_t n = logReaderRead(logExport.reader, logExport.offset, chunk, want);
+    storageUnlock();
+    if (n == 0) {
+      finishExport(false);
+      return;
+    }
+
+    size_t packedLen = logExport.compress ? lzCompress(chunk, n, packed, n - 1) : 0;
+    if (packedLen > 0) {
+      sendExportFrame(EXP_LZ, logExport.offset, packed, packedLen);
+    } else {
+      sendExportFrame(EXP_DATOS, logExport.offset, chunk, n);
+    }
+    logExport.offset += n;
+    logExport.bytesRead += n;
+  }
+}
+
+void finishExport(bool complete) {
+  uint32_t elapsed = millis() - logExport.startMs;
+  uint8_t tail[13];
+  memcpy(tail, &logExport.bytesRead, 4);
+  memcpy(tail + 4, &logExport.bytesSent, 4);
+  memcpy(tail + 8, &elapsed, 4);
+  tail[12] = complete ? 1 : 0;
+  sendExportFrame(EXP_FIN, logExport.offset, tail, sizeof(tail));
+  Serial.flush();
+  Serial.updateBaudRate(SERIAL_BAUD);
+  storageLock();
+  logReaderClose(logExport.reader);
+  storageUnlock();
+  logExport.active = false;
+  exportActive.store(false);
+
+  exportStats.exports++;
+  exportStats.lastBytes = logExport.bytesRead;
+  exportStats.lastSent = logExport.bytesSent;
+  exportStats.lastMs = elapsed;
+  // Rendimiento útil frente a la velocidad bruta de la línea (10 bits por byte)
+  float useful = elapsed ? logExport.bytesRead / (float)elapsed : 0;
+  float line = EXPORT_BAUD / 10000.0f;
+  Serial.printf("Exportacion %s: %u B de log en %u B, %u ms, %.1f kB/s (linea %.1f kB/s, %.0f%%)\n",
+                complete ? "completa" : "interrumpida", (unsigned)logExport.bytesRead,
+                (unsigned)logExport.bytesSent, (unsigned)elapsed, useful, line,
+                100.0f * useful / line);
+}
+
+void sendExportFrame(uint8_t type, uint32_t offset, const uint8_t* payload, size_t len) {
+  // Una sola escritura: el driver del UART la hace bajo su mutex y ningún
+  // texto de otra tarea puede quedar dentro de la trama
+  static uint8_t frame[EXPORT_FRAME_OVERHEAD + EXPORT_CHUNK];
+  frame[0] = 0xA5;
+  frame[1] = 0x5A;
+  frame[2] = type;
+  frame[3] = len & 0xFF;
+  frame[4] = len >> 8;
+  memcpy(frame + 5, &offset, 4);
+  memcpy(frame + 9, payload, len);
+  uint32_t crc = esp_rom_crc32_le(0, frame + 2, 7 + len);
+  memcpy(frame + 9 + len, &crc, 4);
+  Serial.write(frame, len + EXPORT_FRAME_OVERHEAD);
+  logExport.bytesSent += len + EXPORT_FRAME_OVERHEAD;
+}
+
+// --- Consola serie ---
+struct CliCommand {
+  const char* name;
+  const char* usage;
+  void (*handler)(char* args);
+};
+
+const CliCommand kCliCommands[] = {
+  {"ayuda", "", cliHelp},
+  {"lecturas", "", cliReadings},
+  {"stats", "", cliStats},
+  {"histogramas", "", cliHistograms},
+  {"config", "[clave [valor]]", cliConfig},
+  {"hora", "[epoch UTC]", cliClock},
+  {"resumen", "", cliDailySummary},
+  {"exportar", "[offset] [longitud] [crudo]", cliExport},
+  {"enviar_lora", "[offset] [longitud]", cliBulkSend},
+#if BULK_RECEPTOR
+  {"fec_bench", "[perdida %] [intentos]", cliFecBench},
+#endif
+  {"selftest", "", cliSelfTest},
+};
+
+// Ajustes accesibles con config; set NULL si son de solo lectura
+struct CliSetting {
+  const char* name;
+  int32_t (*get)();
+  bool (*set)(int32_t value);
+};
+
+// volcado y potencia_tx valen hasta el siguiente cambio de perfil de energía
+const CliSetting kCliSettings[] = {
+  {"volcado", []() -> int32_t { return serialDump.load(); },
+   [](int32_t v) {
+     if (v != 0 && v != 1) return false;
+     serialDump.store(v == 1);
+     return true;
+   }},
+  {"potencia_tx", []() -> int32_t { return loraTxPowerDbm.load(); },
+   [](int32_t v) {
+     if (v < 2 || v > 20) return false;
+     loraTxPowerDbm.store(v);
+     return true;
+   }},
+  {"periodo_ms", []() -> int32_t { return samplePeriodMs; }, NULL},
+  {"energia", []() -> int32_t { return energyLevel; }, NULL},
+  {"soc", []() -> int32_t { return energy.soc; }, NULL},
+  {"bateria_mv", []() -> int32_t { return energy.batteryMv; }, NULL},
+};
+
+// Nunca bloquea: consume lo que haya en el búfer de recepción y vuelve
+void pollSerialCommands() {
+  static char line[CLI_LINE_MAX];
+  static size_t len = 0;
+  static bool overflow = false;
+  int64_t startUs = esp_timer_get_time();
+  int64_t commandUs = 0;
+  while (Serial.available() > 0) {
+    int c = Serial.read();
+    if (logExport.active) {
+      if (c == EXPORT_ABORT) finishExport(false);
+      continue;
+    }
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (len < sizeof(line) - 1) {
+        line[len++] = (char)c;
+      } else {
+        overflow = true;
+      }
+      continue;
+    }
+    line[len] = '\0';
+    len = 0;
+    if (overflow) {
+      overflow = false;
+      Serial.println("Orden demasiado larga.");
+      continue;
+    }
+    int64_t t0 = esp_timer_get_time();
+    runCliCommand(line);
+    int64_t elapsed = esp_timer_get_time() - t0;
+    cliCommandStats.record(elapsed);
+    commandUs += elapsed;
+  }
+  cliPollStats.record(esp_timer_get_time() - startUs - commandUs);
+}
+
+void runCliCommand(char* line) {
+  while (*line == ' ') line++;
+  if (*line == '\0') return;
+  char* args = line;
+  while (*args != '\0' && *args != ' ') args++;
+  if (*args != '\0') *args++ = '\0';
+  for (size_t i = 0; i < sizeof(kCliCommands) / sizeof(kCliCommands[0]); i++) {
+    if (strcmp(line, kCliCommands[i].name) == 0) {
+      kCliCommands[i].handler(args);
+      return;
+    }
+  }
+  Serial.printf("Orden desconocida: %s (ayuda)\n", line);
+}
+
+void cliHelp(char* args) {
+  for (size_t i = 0; i < sizeof(kCliCommands) / sizeof(kCliCommands[0]); i++) {
+    Serial.printf("  %s %s\n", kCliCommands[i].name, kCliCommands[i].usage);
+  }
+}
+
+void cliReadings(char* args) {
+  if (!haveLogged) {
+    Serial.println("Sin muestras todavia.");
+    return;
+  }
+  Serial.printf("Muestra %u, hace %.1f s\n", (unsigned)lastLogged.seq,
+                (esp_timer_get_time() - lastLogged.readUs) / 1e6);
+  printSample(lastLogged);
+}
+
+void cliStats(char* args) {
+  printStats();
+}
+
+void printHistogram(const char* name, const LatencyStats& stats) {
+  if (stats.count == 0) return;
+  Serial.printf("%s (%u):", name, (unsigned)stats.count);
+  for (int k = 0; k < LATENCY_BUCKETS; k++) {
+    if (stats.buckets[k] == 0) continue;
+    Serial.printf(" %s%lu:%u", k == LATENCY_BUCKETS - 1 ? ">=" : "", k ? 1UL << k : 0UL,
+                  (unsigned)stats.buckets[k]);
+  }
+  Serial.println(" us");
+}
+
+void cliHistograms(char* args) {
+  printHistogram("adquisicion", acquisitionStats);
+  printHistogram("despacho", dispatchStats);
+  printHistogram("jitter", samplingJitter);
+  printHistogram("retardo_isr", samplingDelay);
+  printHistogram("tx", txLatency);
+  printHistogram("tx_llama", flameTxLatency);
+  printHistogram("espera_bus_lora", spiBus.waitStats[SPI_CLIENT_RADIO]);
+  printHistogram("espera_bus_sd", spiBus.waitStats[SPI_CLIENT_SD]);
+  printHistogram("antiguedad_gas", mqHeaterStats.readingAge);
+  printHistogram("consola_sondeo", cliPollStats);
+  printHistogram("consola_orden", cliCommandStats);
+  printHistogram("fec_codificar", fecEncodeStats);
+  printHistogram("fec_decodificar", fecDecodeStats);
+}
+
+void cliConfig(char* args) {
+  char* key = strtok(args, " ");
+  char* value = strtok(NULL, " ");
+  for (size_t i = 0; i < sizeof(kCliSettings) / sizeof(kCliSettings[0]); i++) {
+    const CliSetting& setting = kCliSettings[i];
+    if (key != NULL && strcmp(key, setting.name) != 0) continue;
+    if (value != NULL) {
+      if (setting.set == NULL) {
+        Serial.printf("%s es de solo lectura\n", setting.name);
+        return;
+      }
+      if (!setting.set(strtol(value, NULL, 10))) {
+        Serial.printf("Valor no valido para %s\n", setting.name);
+        return;
+      }
+    }
+    Serial.printf("%s = %d\n", setting.name, (int)setting.get());
+    if (key != NULL) return;
+  }
+  if (key != NULL) Serial.printf("Clave desconocida: %s\n", key);
+}
+
+// Sin RTC ni red, el técnico pone en hora el nodo; time() sobrevive al sueño profundo
+void cliClock(char* args) {
+  char* end;
+  unsigned long epoch = strtoul(args, &end, 10);
+  if (end != args) {
+    struct timeval tv = {(time_t)epoch, 0};
+    settimeofday(&tv, NULL);
+    telemetryResync = true;  // el predictor usa la hora del sistema
+  }
+  time_t now = time(NULL);
+  struct tm t;
+  localtime_r(&now, &t);
+  char text[32];
+  strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S %Z", &t);
+  Serial.printf("%s (%lu)%s\n", text, (unsigned long)now, clockValid() ? "" : ", reloj sin poner en hora");
+}
+
+void cliDailySummary(char* args) {
+  printDailySummaries();
+}
+
+// Reanudar tras un corte: repetir la orden con el offset de la última trama
+// recibida. tools/recibir_log lo hace solo y escribe el log en columnas.
+void cliExport(char* args) {
+  char* p = args;
+  uint32_t offset = strtoul(p, &p, 10);
+  uint32_t length = strtoul(p, &p, 10);
+  bool compress = EXPORT_COMPRESS && strstr(p, "crudo") == NULL;
+  startExport(offset, length, compress);
+}
+
+bool selfTestLine(const char* name, bool ok, const char* detail) {
+  Serial.printf("  %-14s %s %s\n", name, ok ? "OK   " : "FALLO", detail);
+  return ok;
+}
+
+// Sin tocar los sensores, que son de la tarea de sensado: se comprueba el
+// estado de los periféricos y la última muestra registrada
+void cliSelfTest(char* args) {
+  char detail[48];
+  int failures = 0;
+  failures += !selfTestLine("SD", sdAvailable, sdAvailable ? "" : "sin tarjeta, log en flash");
+  failures += !selfTestLine("Flash interna", fallbackAvailable, "");
+  failures += !selfTestLine("LoRa", loraReady, "");
+  failures += !selfTestLine("Reloj", clockValid(), clockValid() ? "" : "usar hora <epoch>");
+  if (haveLogged) {
+    failures += !selfTestLine("DHT22", !lastLogged.dhtError, "");
+    failures += !selfTestLine("DS18B20", !lastLogged.ds18b20Error, "");
+    failures += !selfTestLine("PMS5003", lastLogged.pmValid, "");
+  } else {
+    failures += !selfTestLine("Sensores", false, "sin muestras todavia");
+  }
+  failures += !selfTestLine("MQ", mqHaveReading, mqCalibrated ? "calibrado" : "sin calibrar");
+  snprintf(detail, sizeof(detail), "%u mV, %u%%", (unsigned)energy.batteryMv, energy.soc);
+  failures += !selfTestLine("Bateria", energy.batteryMv > POWER_FAIL_MV, detail);
+  const TaskHandle_t tasks[] = {sensingTaskHandle, radioTaskHandle, logTaskHandle};
+  const char* const taskNames[] = {"Pila sensado", "Pila radio", "Pila log"};
+  for (int i = 0; i < 3; i++) {
+    unsigned freeBytes = uxTaskGetStackHighWaterMark(tasks[i]);  // en bytes en ESP-IDF
+    snprintf(detail, sizeof(detail), "%u B libres como minimo", freeBytes);
+    failures += !selfTestLine(taskNames[i], freeBytes >= 512, detail);
+  }
+  snprintf(detail, sizeof(detail), "%u B libres, minimo %u B", (unsigned)ESP.getFreeHeap(),
+           (unsigned)ESP.getMinFreeHeap());
+  failures += !selfTestLine("Heap", ESP.getMinFreeHeap() >= 16384, detail);
+  Serial.printf("Autotest: %s (%d fallos)\n", failures ? "FALLOS" : "OK", failures);
+}
+
+// --- Transferencia masiva LoRa ---
+// Tiempo en el aire con la configuración de la radio; la fórmula está en nucleo.h
+uint32_t loraAirtimeMs(size_t len) {
+  return loraAirtimeMs(len, LORA_SF, LORA_BW, LORA_CR);
+}
+
+// Desde la tarea de log: lee el rango, calcula la paridad y pasa el testigo a la radio
+bool startBulkTransfer(uint32_t offset, uint32_t length) {
+  if (bulkTx.active.load()) {
+    Serial.println("Transferencia LoRa en curso.");
+    return false;
+  }
+  if (!sdAvailable) {
+    Serial.println("Transferencia LoRa: SD no disponible.");
+    return false;
+  }
+  if (length == 0 || length > BULK_MAX_DATA * BULK_FRAG_BYTES) {
+    length = BULK_MAX_DATA * BULK_FRAG_BYTES;
+  }
+  memset(bulkTx.frags, 0, sizeof(bulkTx.frags));
+  storageLock();
+  LogReader reader;
+  size_t n = logReaderOpen(reader) ? logReaderRead(reader, offset, &bulkTx.frags[0][0], length) : 0;
+  logReaderClose(reader);
+  storageUnlock();
+  if (n == 0) {
+    Serial.printf("Transferencia LoRa: nada que enviar desde %u.\n", (unsigned)offset);
+    return false;
+  }
+
+  bulkTx.id++;
+  bulkTx.length = n;
+  bulkTx.k = (n + BULK_FRAG_BYTES - 1) / BULK_FRAG_BYTES;
+  bulkTx.m = (bulkTx.k * BULK_REDUNDANCIA_PCT + 99) / 100;
+  if (bulkTx.m > BULK_MAX_PARITY) bulkTx.m = BULK_MAX_PARITY;
+  bulkTx.crc = esp_rom_crc32_le(0, &bulkTx.frags[0][0], n);
+  bulkTx.next = 0;
+  bulkTx.airtimeMs = 0;
+  bulkTx.startMs = millis();
+  int64_t startUs = esp_timer_get_time();
+  fecEncode(bulkTx.frags, bulkTx.k, bulkTx.m);
+  fecEncodeStats.record(esp_timer_get_time() - startUs);
+  uint32_t airtime = (bulkTx.k + bulkTx.m) * loraAirtimeMs(BULK_HEADER_BYTES + BULK_FRAG_BYTES);
+  Serial.printf("Transferencia LoRa %u: %u B en %u+%u fragmentos, %.1f s de aire\n",
+                bulkTx.id, (unsigned)n, bulkTx.k, bulkTx.m, airtime / 1000.0);
+  bulkTx.active.store(true);
+  xTaskNotify(radioTaskHandle, RADIO_NOTIFY_BULK, eSetBits);
+  return true;
+}
+
+size_t buildBulkFrame(const BulkTransfer& tx, uint8_t index, uint8_t* frame) {
+  frame[0] = 'B';
+  frame[1] = 'K';
+  frame[2] = tx.id;
+  frame[3] = index;
+  frame[4] = tx.k;
+  frame[5] = tx.m;
+  memcpy(frame + 6, &tx.length, 2);
+  memcpy(frame + 8, &tx.crc, 4);
+  memcpy(frame + BULK_HEADER_BYTES, tx.frags[index], BULK_FRAG_BYTES);
+  return BULK_HEADER_BYTES + BULK_FRAG_BYTES;
+}
+
+// Tarea de radio. Devuelve cuánto esperar antes del siguiente fragmento.
+uint32_t sendBulkFragment() {
+  uint8_t frame[BULK_HEADER_BYTES + BULK_FRAG_BYTES];
+  size_t len = buildBulkFrame(bulkTx, bulkTx.next, frame);
+  uint32_t airtime = loraAirtimeMs(len);
+  uint32_t wait = dutyCycle.waitMs(airtime);
+  if (wait > 0) return wait;
+  if (!transmitLoRa((const char*)frame, len)) return BULK_RETRY_MS;
+  bulkTx.airtimeMs += airtime;
+  if (++bulkTx.next < bulkTx.k + bulkTx.m) return 0;
+
+  bulkTx.active.store(false);
+  if (serialVerbose()) {
+    Serial.printf("Transferencia LoRa %u completa: %u B, %u ms de aire en %.1f s\n", bulkTx.id,
+                  bulkTx.length, (unsigned)bulkTx.airtimeMs, (millis() - bulkTx.startMs) / 1000.0);
+  }
+  return 0;
+}
+
+void cliBulkSend(char* args) {
+  char* p = args;
+  uint32_t offset = strtoul(p, &p, 10);
+  uint32_t length = strtoul(p, &p, 10);
+  startBulkTransfer(offset, length);
+}
+
+#if BULK_RECEPTOR
+// Devuelve true cuando la carga está reconstruida y su CRC cuadra
+bool bulkReceive(BulkReassembly& rx, const uint8_t* frame, size_t len) {
+  if (len != BULK_HEADER_BYTES + BULK_FRAG_BYTES || frame[0] != 'B' || frame[1] != 'K') {
+    return false;
+  }
+  uint8_t k = frame[4];
+  uint8_t m = frame[5];
+  uint8_t index = frame[3];
+  if (k == 0 || k > BULK_MAX_DATA || m > BULK_MAX_PARITY || index >= k + m) return false;
+  uint16_t length;
+  uint32_t crc;
+  memcpy(&length, frame + 6, 2);
+  memcpy(&crc, frame + 8, 4);
+  // El CRC final lee length bytes de frags: más de k fragmentos se saldría
+  if (length == 0 || length > k * BULK_FRAG_BYTES) return false;
+  if (frame[2] != rx.id || k != rx.k || m != rx.m || length != rx.length || crc != rx.crc ||
+      rx.count == 0) {
+    // Transferencia nueva, aunque repita id: se descarta la incompleta
+    rx.id = frame[2];
+    rx.k = k;
+    rx.m = m;
+    rx.count = 0;
+    rx.received = 0;
+    rx.complete = false;
+    rx.length = length;
+    rx.crc = crc;
+  }
+  if (rx.complete || (rx.received >> index) & 1) return false;
+  memcpy(rx.frags[index], frame + BULK_HEADER_BYTES, BULK_FRAG_BYTES);
+  rx.received |= 1ULL << index;
+  if (++rx.count < rx.k) return false;
+
+  int64_t startUs = esp_timer_get_time();
+  bool ok = fecDecode(rx.frags, rx.k, rx.m, rx.received);
+  fecDecodeStats.record(esp_timer_get_time() - startUs);
+  rx.complete = ok && esp_rom_crc32_le(0, &rx.frags[0][0], rx.length) == rx.crc;
+  return rx.complete;
+}
+
+// Canal con pérdidas independientes: cuántas transferencias de tamaño máximo
+// se reconstruyen con FEC y cuántas llegarían enteras sin él
+void cliFecBench(char* args) {
+  char* p = args;
+  uint32_t lossPct = strtoul(p, &p, 10);
+  uint32_t trials = strtoul(p, &p, 10);
+  if (lossPct == 0) lossPct = 10;
+  if (trials == 0 || trials > 200) trials = 50;
+
+  uint32_t recovered = 0;
+  uint32_t withoutFec = 0;
+  uint32_t framesSent = 0;
+  uint8_t frame[BULK_HEADER_BYTES + BULK_FRAG_BYTES];
+  for (uint32_t t = 0; t < trials; t++) {
+    benchTx.id++;
+    benchTx.k = BULK_MAX_DATA;
+    benchTx.m = (BULK_MAX_DATA * BULK_REDUNDANCIA_PCT + 99) / 100;
+    benchTx.length = BULK_MAX_DATA * BULK_FRAG_BYTES;
+    esp_fill_random(&benchTx.frags[0][0], benchTx.length);
+    benchTx.crc = esp_rom_crc32_le(0, &benchTx.frags[0][0], benchTx.length);
+    int64_t startUs = esp_timer_get_time();
+    fecEncode(benchTx.frags, benchTx.k, benchTx.m);
+    fecEncodeStats.record(esp_timer_get_time() - startUs);
+
+    bulkRx.count = 0;
+    bool dataIntact = true;
+    bool done = false;
+    for (uint8_t i = 0; i < benchTx.k + benchTx.m && !done; i++) {
+      framesSent++;
+      if (esp_random() % 100 < lossPct) {
+        if (i < benchTx.k) dataIntact = false;
+        continue;
+      }
+      size_t len = buildBulkFrame(benchTx, i, frame);
+      done = bulkReceive(bulkRx, frame, len);
+    }
+    if (done && memcmp(bulkRx.frags, benchTx.frags, benchTx.length) == 0) recovered++;
+    if (dataIntact) withoutFec++;
+  }
+  Serial.printf("FEC %u+%u, perdida %u%%: %u/%u reconstruidas (sin FEC %u/%u), "
+                "%u fragmentos enviados\n",
+                (unsigned)BULK_MAX_DATA, (unsigned)benchTx.m, (unsigned)lossPct,
+                (unsigned)recovered, (unsigned)trials, (unsigned)withoutFec, (unsigned)trials,
+                (unsigned)framesSent);
+  Serial.printf("Codificar: media %.1f ms; decodificar: media %.1f ms, max %.1f ms\n",
+                fecEncodeStats.sumUs / 1000.0 / fecEncodeStats.count,
+                fecDecodeStats.count ? fecDecodeStats.sumUs / 1000.0 / fecDecodeStats.count : 0.0,
+                fecDecodeStats.maxUs / 1000.0);
+}
+#endif
+
+// --- Resumen diario ---
+void accumulateDay(const SampleRecord& sample) {
+  struct tm now;
+  int32_t day = localDay(now);
+  if (day != dailyAcc.day) {
+    if (dailyAcc.startS != 0) closeDay();
+    memset(&dailyAcc, 0, sizeof(dailyAcc));
+    dailyAcc.day = day;
+    dailyAcc.startS = (uint32_t)time(NULL);
+  }
+
+  if (sample.fastPath) {
+    dailyAcc.flameEvents++;
+    return;
+  }
+  dailyAcc.msAtLevel[sample.level] += samplePeriodMs;
+  if (sample.dhtError) dailyAcc.dhtErrors++;
+  if (sample.ds18b20Error) dailyAcc.ds18b20Errors++;
+  if (!sample.pmValid) dailyAcc.pmInvalid++;
+  for (int c = 0; c < TEL_COUNT; c++) {
+    int32_t value;
+    if (!telemetryValue(sample, (TelChannel)c, value)) continue;
+    dailyAcc.channels[c].add(kTelChannels[c].decimals ? value / 10.0f : (float)value);
+  }
+}
+
+void closeDay() {
+  DailySummary summary;
+  memset(&summary, 0, sizeof(summary));
+  summary.magic = DAILY_MAGIC;
+  summary.day = dailyAcc.day;
+  summary.startS = dailyAcc.startS;
+  for (int c = 0; c < TEL_COUNT; c++) {
+    const ChannelAggregate& agg = dailyAcc.channels[c];
+    summary.samples = agg.count > summary.samples ? agg.count : summary.samples;
+    summary.min[c] = agg.count ? agg.min : NAN;
+    summary.max[c] = agg.count ? agg.max : NAN;
+    summary.mean[c] = agg.count ? agg.mean : NAN;
+  }
+  for (int i = 0; i <= AL_CRITICA; i++) summary.secondsAtLevel[i] = dailyAcc.msAtLevel[i] / 1000;
+  summary.dhtErrors = dailyAcc.dhtErrors;
+  summary.ds18b20Errors = dailyAcc.ds18b20Errors;
+  summary.pmInvalid = dailyAcc.pmInvalid;
+  summary.flameEvents = dailyAcc.flameEvents;
+  summary.fwi = fireWeather.codes.fwi;
+  summary.crc = esp_rom_crc32_le(0, (const uint8_t*)&summary, offsetof(DailySummary, crc));
+  if (dailyQueue.push(summary)) xTaskNotifyGive(logTaskHandle);
+}
+
+// En la SD si tiene sistema de ficheros; si no, en LittleFS (120 B por día),
+// escrito al momento: un resumen al día no justifica esperar a llenar un lote
+bool writeDailySummary(const DailySummary& summary) {
+  if (sdAvailable && logFs != NULL &&
+      appendToSd(DAILY_PATH, (const uint8_t*)&summary, sizeof(summary))) {
+    return true;
+  }
+  return fallbackAvailable && dailyFallbackLog.append(&summary, sizeof(summary)) &&
+         dailyFallbackLog.flush();
+}
+
+void printDailyRow(const DailySummary& summary, uint32_t& shown, uint32_t& corrupt) {
+  if (!dailySummaryValid(summary)) {
+    corrupt++;
+    return;
+  }
+  if (shown++ == 0) Serial.println(DAILY_CSV_HEADER);
+  char row[96];
+  dailySummaryRow(summary, row, sizeof(row));
+  Serial.println(row);
+}
+
+// Vista de temporada: una línea por día, primero lo que hay en la SD y después
+// lo que queda en la flash sin migrar. Los registros con CRC erróneo se saltan.
+// tools/resumen_diario hace lo mismo con el fichero copiado de la SD.
+void printDailySummaries() {
+  DailySummary summary;
+  uint32_t shown = 0;
+  uint32_t corrupt = 0;
+  if (sdAvailable && logFs != NULL) {
+    storageLock();
+    flushSdFile(DAILY_PATH);
+    File file = logFs->open(DAILY_PATH, FILE_READ);
+    while (file && file.read((uint8_t*)&summary, sizeof(summary)) == sizeof(summary)) {
+      printDailyRow(summary, shown, corrupt);
+    }
+    if (file) file.close();
+    storageUnlock();
+  }
+  if (fallbackAvailable) {
+    uint32_t size = dailyFallbackLog.size();
+    for (uint32_t offset = 0; offset + sizeof(summary) <= size; offset += sizeof(summary)) {
+      if (dailyFallbackLog.read(offset, (uint8_t*)&summary, sizeof(summary)) != sizeof(summary)) {
+        break;
+      }
+      printDailyRow(summary, shown, corrupt);
+    }
+  }
+  if (shown == 0) Serial.println("Sin resumenes diarios.");
+  if (corrupt) Serial.printf("%u registros corruptos omitidos\n", (unsigned)corrupt);
+}
+
+// --- Gestión de energía ---
+// energyPolicy(), batterySoc() y su tabla están en nucleo.h
+void energyBegin() {
+  analogSetPinAttenuation(SOLAR_PIN, ADC_11db);
+  if (energyLevel >= EN_COUNT) energyLevel = EN_NORMAL;
+  energyUpdate((EnergyLevel)energyLevel);
+}
+
+// applied: el perfil en uso, que con alerta es el normal; su consumo es el que
+// se compara con la descarga medida
+void energyUpdate(EnergyLevel applied) {
+  uint32_t now = millis();
+  uint32_t batterySum = 0;
+  uint32_t solarSum = 0;
+  for (int i = 0; i < 8; i++) {
+    batterySum += readBatteryMv();
+    solarSum += analogReadMilliVolts(SOLAR_PIN);
+  }
+  energy.batteryMv = batterySum / 8;
+  energy.solarMv = (uint16_t)(solarSum / 8 * SOLAR_DIVIDER);
+  energy.charging = energy.solarMv >= SOLAR_CHARGING_MV;
+
+  uint8_t soc = batterySoc(energy.batteryMv);
+  float hours = energy.lastCheckMs != 0 ? (now - energy.lastCheckMs) / 3600000.0f : 0;
+  energy.soc = soc;
+  energy.lastCheckMs = now;
+  energyForecast.update(hours, soc, energy.charging, kEnergyProfiles[applied].loadMa,
+                        BATTERY_CAPACITY_MAH);
+
+  float runtimeH[EN_COUNT];
+  for (int p = 0; p < EN_COUNT; p++) {
+    runtimeH[p] = energyForecast.runtimeH(soc, kEnergyProfiles[p].loadMa, BATTERY_CAPACITY_MAH);
+  }
+  energy.runtimeH = runtimeH[energyLevel];
+  EnergyLevel next = energyPolicy((EnergyLevel)energyLevel, soc, energyForecast.charging(),
+                                  runtimeH, energyForecast.hoursToCharge());
+  if (next != energyLevel) {
+    energyLevel = next;
+    energy.profileChanges++;
+  }
+}
+
+// Solo desde la tarea de sensado: el temporizador de muestreo es suyo. La
+// potencia LoRa la aplica la tarea de radio antes de la siguiente trama.
+// Solo al cambiar de perfil: entre cambios mandan los ajustes de la consola
+void applyEnergyProfile(const EnergyProfile& profile) {
+  static const EnergyProfile* applied = NULL;
+  if (&profile == applied) return;
+  applied = &profile;
+  if (profile.samplePeriodMs != samplePeriodMs) setSamplePeriod(profile.samplePeriodMs);
+  loraTxPowerDbm.store(profile.txPowerDbm);
+  serialDump.store(profile.serialDump);
+}
+
+void setSamplePeriod(uint32_t periodMs) {
+  samplePeriodMs = periodMs;
+  samplePeriodChanged = true;
+  timerAlarmDisable(sampleTimer);
+  timerAlarmWrite(sampleTimer, (uint64_t)periodMs * 1000ULL, true);
+  timerWrite(sampleTimer, 0);  // si el contador ya pasó la nueva alarma, no dispararía
+  timerAlarmEnable(sampleTimer);
+}
+
+// --- Registro crudo en anillo ---
+// RawRing y el formato de los registros están en nucleo.h
+
+// Llamar con el bus tomado (mountStorage()).
+// Monta la tarjeta sin sistema de ficheros. Si el superbloque es válido se
+// recupera la posición; si no, se crea un anillo vacío.
+bool rawLogBegin() {
+  rawCard.pdrv = sdcard_init(SD_CS_PIN, &SPI, RAW_SD_FREQ_HZ);
+  if (rawCard.pdrv == 0xFF) return false;
+
+  RawMountResult mounted = rawRing.mount();
+  if (mounted == RAW_ERROR_LECTURA) return false;
+  if (mounted == RAW_SIN_ANILLO) {
+    if (!rawRing.format()) return false;
+    if (serialVerbose()) {
+      Serial.printf("SD cruda: anillo nuevo de %u sectores.\n",
+                    (unsigned)rawRing.superblock().sectorCount);
+    }
+    return true;
+  }
+  if (serialVerbose()) {
+    Serial.printf("SD cruda: reanudando en sector %u, registro %u.\n",
+                  (unsigned)rawRing.superblock().head, (unsigned)rawRing.nextSeq());
+  }
+  return true;
+}
+
+bool rawWriteSuperblock() {
+  storageLock();
+  bool ok = rawRing.storeSuperblock();
+  storageUnlock();
+  return ok;
+}
+
+bool rawLogAppend(const RawRecord& rec) {
+  int64_t start = esp_timer_get_time();
+  storageLock();
+  bool ok = rawRing.append(rec);
+  storageUnlock();
+  if (!ok) return false;
+  storageStats.bytes += sizeof(RawRecord);
+  storageStats.busyUs += esp_timer_get_time() - start;
+  storageStats.writes++;
+  return true;
+}
+
+void printStats() {
+  static const char* const names[SPI_CLIENT_COUNT] = {"LoRa", "SD"};
+  for (int i = 0; i < SPI_CLIENT_COUNT; i++) {
+    const LatencyStats& st = spiBus.waitStats[i];
+    if (st.count == 0) continue;
+    Serial.printf("Espera bus SPI %s: %u accesos, media %.0f us, max %.0f us\n", names[i],
+                  (unsigned)st.count, (double)st.sumUs / st.count, (double)st.maxUs);
+  }
+  Serial.printf("Escrituras SD interrumpidas por la radio: %u\n", (unsigned)spiBus.preemptions);
+  Serial.printf("Energia: perfil %s, bateria %.2f V (%u%%), panel %.2f V%s, tendencia %.1f %%/h, "
+                "autonomia %.0f h, carga en %.1f h, consumo x%.2f del modelo, "
+                "%u cambios de perfil\n",
+                kEnergyProfiles[energyLevel].name, energy.batteryMv / 1000.0, energy.soc,
+                energy.solarMv / 1000.0,
+                energyForecast.charging() ? " (cargando)"
+                : energy.charging         ? " (no cubre el consumo)"
+                                          : "",
+                energyForecast.socTrend(), energy.runtimeH, energyForecast.hoursToCharge(),
+                energyForecast.loadScale(), (unsigned)energy.profileChanges);
+  portENTER_CRITICAL(&mqMux);
+  uint32_t nowMs = millis();
+  uint64_t heaterOnMs = mqHeaterStats.onMs + (mqHeaterOn ? nowMs - mqHeaterOnMs : 0);
+  portEXIT_CRITICAL(&mqMux);
+  Serial.printf("Calefactores MQ: %.0f%% del tiempo, %.0f mAh ahorrados, %u ciclos, "
+                "%u calibraciones (x%.2f / x%.2f)\n",
+                nowMs ? heaterOnMs * 100.0 / nowMs : 100.0,
+                (nowMs - heaterOnMs) / 3600000.0 * MQ_HEATER_MA, (unsigned)mqHeaterStats.cycles,
+                (unsigned)mqHeaterStats.calibrations, mqCal.ratio[0], mqCal.ratio[1]);
+  const LatencyStats& age = mqHeaterStats.readingAge;
+  if (age.count > 0) {
+    Serial.printf("Antiguedad lectura de gas: media %.1f s, max %.1f s\n",
+                  age.sumUs / 1e6 / age.count, age.maxUs / 1e6);
+  }
+  if (cliPollStats.count > 0) {
+    Serial.printf("Consola: %u ordenes, sondeo media %.1f us, max %.0f us\n",
+                  (unsigned)cliCommandStats.count,
+                  (double)cliPollStats.sumUs / cliPollStats.count, (double)cliPollStats.maxUs);
+  }
+  Serial.printf("Aire LoRa: %.1f s usados, credito %.1f s\n", dutyCycle.usedMs / 1000.0,
+                dutyCycle.creditMs / 1000.0);
+  if (radioOverflows.load() > 0) {
+    Serial.printf("Tramas LoRa descartadas por longitud: %u\n", (unsigned)radioOverflows.load());
+  }
+  if (exportStats.exports > 0) {
+    Serial.printf("Exportaciones: %u, ultima %u B de log en %u B y %u ms\n",
+                  (unsigned)exportStats.exports, (unsigned)exportStats.lastBytes,
+                  (unsigned)exportStats.lastSent, (unsigned)exportStats.lastMs);
+  }
+  if (aggregationStats.rollups > 0) {
+    uint32_t raw = aggregationStats.rawKept + aggregationStats.rawSkipped;
+    Serial.printf("Agregacion: %u cubetas, %u descartadas; log crudo %u de %u muestras\n",
+                  (unsigned)aggregationStats.rollups, (unsigned)aggregationStats.drops,
+                  (unsigned)aggregationStats.rawKept, (unsigned)raw);
+  }
+#if TELEMETRY
+  if (telemetryStats.samples > 0) {
+    Serial.printf("Telemetria: %u tramas para %u muestras (%.0f%% ahorrado), %u latidos, "
+                  "%u canales suprimidos, %u descartadas\n",
+                  (unsigned)telemetryStats.frames, (unsigned)telemetryStats.samples,
+                  100.0 - telemetryStats.frames * 100.0 / telemetryStats.samples,
+                  (unsigned)telemetryStats.heartbeats, (unsigned)telemetryStats.suppressed,
+                  (unsigned)telemetryStats.drops);
+    Serial.printf("Error max. de reconstruccion T/H/MQ2/MQ135/PM25/V: %d/%d/%d/%d/%d/%d\n",
+                  (int)telemetryStats.maxError[TEL_TEMP], (int)telemetryStats.maxError[TEL_HUM],
+                  (int)telemetryStats.maxError[TEL_MQ2], (int)telemetryStats.maxError[TEL_MQ135],
+                  (int)telemetryStats.maxError[TEL_PM25], (int)telemetryStats.maxError[TEL_VIENTO]);
+  }
+#endif
+  if (samplingDelay.count > 0) {
+    Serial.printf("Muestreo: jitter media %.1f us, max %.0f us; retardo ISR->tarea media %.1f us, "
+                  "max %.0f us; %u periodos perdidos\n",
+                  samplingJitter.count ? (double)samplingJitter.sumUs / samplingJitter.count : 0.0,
+                  (double)samplingJitter.maxUs, (double)samplingDelay.sumUs / samplingDelay.count,
+                  (double)samplingDelay.maxUs, (unsigned)missedSamples);
+  }
+  if (acquisitionStats.count > 0) {
+    Serial.printf("Adquisicion de sensores: media %.1f ms, max %.1f ms\n",
+                  acquisitionStats.sumUs / 1000.0 / acquisitionStats.count,
+                  acquisitionStats.maxUs / 1000.0);
+    NodeSensors::printTrace();
+  }
+  if (dispatchStats.count > 0) {
+    Serial.printf("Despacho de muestra: media %.1f us, max %.1f us\n",
+                  (double)dispatchStats.sumUs / dispatchStats.count, (double)dispatchStats.maxUs);
+  }
+  if (flameTxLatency.count > 0) {
+    Serial.printf("Latencia llama->TX: media %.1f ms, max %.1f ms (%u eventos)\n",
+                  flameTxLatency.sumUs / 1000.0 / flameTxLatency.count,
+                  flameTxLatency.maxUs / 1000.0, (unsigned)flameTxLatency.count);
+  }
+  const FwiCodes& fwi = fireWeather.codes;
+  Serial.printf("FWI: %.1f (FFMC %.1f, DMC %.1f, DC %.1f, ISI %.1f, BUI %.1f)%s\n", fwi.fwi,
+                fwi.ffmc, fwi.dmc, fwi.dc, fwi.isi, fwi.bui,
+                fwi.fwi >= FWI_UMBRAL_MUY_ALTO ? ", umbrales reforzados" : "");
+#if ADAPTIVE_THRESHOLDS
+  AlertThresholds th = currentAlertThresholds();
+  Serial.printf("Umbrales actuales: %.1f C, %.1f %%%s; evitadas %u, anticipadas %u; "
+                "linea base guardada %u veces, %u fallos\n",
+                th.tempCritica, th.humCritica, currentBaseline() ? " (aprendidos)" : "",
+                (unsigned)adaptiveStats.suppressed, (unsigned)adaptiveStats.raised,
+                (unsigned)adaptiveStats.saves, (unsigned)adaptiveStats.saveFailures);
+#endif
+  Serial.printf("Cambios de nivel a BAJA/MEDIA/ALTA/CRITICA: %u/%u/%u/%u\n",
+                (unsigned)levelTransitions[AL_BAJA].load(), (unsigned)levelTransitions[AL_MEDIA].load(),
+                (unsigned)levelTransitions[AL_ALTA].load(), (unsigned)levelTransitions[AL_CRITICA].load());
+  if (storageStats.busyUs > 0) {
+    Serial.printf("SD: %u escrituras, %.1f KB/s sostenidos; max %.1f ms por escritura, "
+                  "%u sincronizaciones de max %.1f ms\n",
+                  (unsigned)storageStats.writes, storageStats.bytes * 1000.0 / storageStats.busyUs,
+                  storageStats.maxWriteUs / 1000.0, (unsigned)storageStats.syncs,
+                  storageStats.maxSyncUs / 1000.0);
+  }
+  const FallbackStats& fallbackStats = fallbackLog.stats();
+  if (fallbackStats.flashWrites > 0) {
+    Serial.printf("Flash interna: %u escrituras de %.0f B de media, %.1f ms media, %.1f ms max, "
+                  "%u rotaciones, %u B migrados\n",
+                  (unsigned)fallbackStats.flashWrites,
+                  (double)fallbackStats.bytes / fallbackStats.flashWrites,
+                  fallbackStats.totalWriteUs / 1000.0 / fallbackStats.flashWrites,
+                  fallbackStats.maxWriteUs / 1000.0, (unsigned)fallbackStats.rotations,
+                  (unsigned)fallbackStats.migrated);
+  }
+}
+
+void printTraceRow(const char* name, int idx) {
+  static const char* const phases[FASE_COUNT] = {"inicio", "lectura", "recogida"};
+  for (int p = 0; p < FASE_COUNT; p++) {
+    Serial.printf("traza,%s,%s,%u,%u\n", name, phases[p],
+                  (unsigned)acquisitionTrace.beginUs[idx][p],
+                  (unsigned)acquisitionTrace.endUs[idx][p]);
+  }
+}
+
+// --- Vigilancia ULP en sueño profundo ---
+UlpWatchConfig currentUlpWatchConfig() {
+  AlertThresholds th = currentAlertThresholds();
+  UlpWatchConfig cfg;
+  cfg.mq2Umbral = th.gasMq2;
+  cfg.mq135Umbral = th.gasMq135;
+  cfg.mq2Subida = ULP_SUBIDA_MQ2;
+  cfg.mq135Subida = ULP_SUBIDA_MQ135;
+  cfg.mq2Rearme = cfg.mq2Umbral > ULP_REARME_MQ2 ? cfg.mq2Umbral - ULP_REARME_MQ2 : 0;
+  cfg.mq135Rearme = cfg.mq135Umbral > ULP_REARME_MQ135 ? cfg.mq135Umbral - ULP_REARME_MQ135 : 0;
+  return cfg;
+}
+
+void startUlpWatch(const SampleRecord& last) {
+  enum {
+    LBL_DESPERTAR,
+    LBL_MQ2_ARMAR,
+    LBL_MQ2_UMBRAL,
+    LBL_MQ2_SUBIDA,
+    LBL_MQ135_ARMAR,
+    LBL_MQ135_UMBRAL,
+    LBL_MQ135_SUBIDA
+  };
+
+  UlpWatchConfig cfg = currentUlpWatchConfig();
+  // Las palabras de la ULP sobreviven al sueño profundo, no al arranque en frío
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  bool resumed = cause != ESP_SLEEP_WAKEUP_UNDEFINED;
+  UlpTrigger woke = cause == ESP_SLEEP_WAKEUP_ULP ? ulpWakeTrigger() : ULP_SIN_DISPARO;
+  bool armed2 = !resumed || (RTC_SLOW_MEM[ULP_VAR_MQ2_ARMADO] & 0xFFFF) != 0;
+  bool armed135 = !resumed || (RTC_SLOW_MEM[ULP_VAR_MQ135_ARMADO] & 0xFFFF) != 0;
+  RTC_SLOW_MEM[ULP_VAR_MQ2_ARMADO] =
+      ulpRearm(last.mq2, cfg.mq2Umbral, cfg.mq2Rearme, armed2, woke == ULP_MQ2_UMBRAL);
+  RTC_SLOW_MEM[ULP_VAR_MQ135_ARMADO] =
+      ulpRearm(last.mq135, cfg.mq135Umbral, cfg.mq135Rearme, armed135, woke == ULP_MQ135_UMBRAL);
+  RTC_SLOW_MEM[ULP_VAR_MQ2_UMBRAL] = cfg.mq2Umbral;
+  RTC_SLOW_MEM[ULP_VAR_MQ135_UMBRAL] = cfg.mq135Umbral;
+  RTC_SLOW_MEM[ULP_VAR_MQ2_SUBIDA] = cfg.mq2Subida;
+  RTC_SLOW_MEM[ULP_VAR_MQ135_SUBIDA] = cfg.mq135Subida;
+  RTC_SLOW_MEM[ULP_VAR_MQ2_REARME] = cfg.mq2Rearme;
+  RTC_SLOW_MEM[ULP_VAR_MQ135_REARME] = cfg.mq135Rearme;
+  // La subida se mide respecto a la última lectura de la CPU principal
+  RTC_SLOW_MEM[ULP_VAR_MQ2_PREVIO] = last.mq2;
+  RTC_SLOW_MEM[ULP_VAR_MQ135_PREVIO] = last.mq135;
+
+  // SUBR activa el flag de desbordamiento cuando el resultado sería negativo:
+  // "umbral - lectura" desborda si lectura > umbral, igual que en ulpWatchModel().
+  // M_BL compara R0 con el inmediato: armado 0 salta el umbral.
+  const ulp_insn_t program[] = {
+    I_MOVI(R3, 0),
+    I_ADC(R0, 0, ULP_ADC_MQ2),
+    I_ST(R0, R3, ULP_VAR_MQ2_ACTUAL),
+    I_ADC(R0, 0, ULP_ADC_MQ135),
+    I_ST(R0, R3, ULP_VAR_MQ135_ACTUAL),
+
+    I_LD(R0, R3, ULP_VAR_MQ2_ACTUAL),
+    I_LD(R2, R3, ULP_VAR_MQ2_REARME),
+    I_SUBR(R2, R0, R2),
+    M_BXF(LBL_MQ2_ARMAR),
+    M_BX(LBL_MQ2_UMBRAL),
+    M_LABEL(LBL_MQ2_ARMAR),
+    I_MOVI(R2, 1),
+    I_ST(R2, R3, ULP_VAR_MQ2_ARMADO),
+    M_LABEL(LBL_MQ2_UMBRAL),
+    I_LD(R0, R3, ULP_VAR_MQ2_ARMADO),
+    M_BL(LBL_MQ2_SUBIDA, 1),
+    I_LD(R0, R3, ULP_VAR_MQ2_ACTUAL),
+    I_LD(R2, R3, ULP_VAR_MQ2_UMBRAL),
+    I_SUBR(R2, R2, R0),
+    M_BXF(LBL_DESPERTAR),
+    M_LABEL(LBL_MQ2_SUBIDA),
+    I_LD(R0, R3, ULP_VAR_MQ2_ACTUAL),
+    I_LD(R1, R3, ULP_VAR_MQ2_PREVIO),
+    I_LD(R2, R3, ULP_VAR_MQ2_SUBIDA),
+    I_ADDR(R1, R1, R2),
+    I_SUBR(R1, R1, R0),
+    M_BXF(LBL_DESPERTAR),
+
+    I_LD(R0, R3, ULP_VAR_MQ135_ACTUAL),
+    I_LD(R2, R3, ULP_VAR_MQ135_REARME),
+    I_SUBR(R2, R0, R2),
+    M_BXF(LBL_MQ135_ARMAR),
+    M_BX(LBL_MQ135_UMBRAL),
+    M_LABEL(LBL_MQ135_ARMAR),
+    I_MOVI(R2, 1),
+    I_ST(R2, R3, ULP_VAR_MQ135_ARMADO),
+    M_LABEL(LBL_MQ135_UMBRAL),
+    I_LD(R0, R3, ULP_VAR_MQ135_ARMADO),
+    M_BL(LBL_MQ135_SUBIDA, 1),
+    I_LD(R0, R3, ULP_VAR_MQ135_ACTUAL),
+    I_LD(R2, R3, ULP_VAR_MQ135_UMBRAL),
+    I_SUBR(R2, R2, R0),
+    M_BXF(LBL_DESPERTAR),
+    M_LABEL(LBL_MQ135_SUBIDA),
+    I_LD(R0, R3, ULP_VAR_MQ135_ACTUAL),
+    I_LD(R1, R3, ULP_VAR_MQ135_PREVIO),
+    I_LD(R2, R3, ULP_VAR_MQ135_SUBIDA),
+    I_ADDR(R1, R1, R2),
+    I_SUBR(R1, R1, R0),
+    M_BXF(LBL_DESPERTAR),
+
+    // Sin disparo: la lectura actual pasa a ser la previa
+    I_LD(R0, R3, ULP_VAR_MQ2_ACTUAL),
+    I_ST(R0, R3, ULP_VAR_MQ2_PREVIO),
+    I_LD(R0, R3, ULP_VAR_MQ135_ACTUAL),
+    I_ST(R0, R3, ULP_VAR_MQ135_PREVIO),
+    I_HALT(),
+
+    M_LABEL(LBL_DESPERTAR),
+    I_RD_REG(RTC_CNTL_LOW_POWER_ST_REG, RTC_CNTL_RDY_FOR_WAKEUP_S, RTC_CNTL_RDY_FOR_WAKEUP_S),
+    M_BL(LBL_DESPERTAR, 1),
+    I_WAKE(),
+    I_END(),
+    I_HALT()
+  };
+
+  adc1_config_width(ADC_WIDTH_BIT_12);
+  adc1_config_channel_atten(ULP_ADC_MQ2, ADC_ATTEN_DB_11);
+  adc1_config_channel_atten(ULP_ADC_MQ135, ADC_ATTEN_DB_11);
+  adc1_ulp_enable();
+
+  size_t size = sizeof(program) / sizeof(ulp_insn_t);
+  if (ulp_process_macros_and_load(ULP_PROG_OFFSET, program, &size) != ESP_OK) {
+    if (serialVerbose()) Serial.println("Error cargando programa ULP.");
+    return;
+  }
+  ulp_set_wakeup_period(0, ULP_PERIODO_US);
+  ulp_run(ULP_PROG_OFFSET);
+}
+
+// Qué comparación despertó, repitiendo el último ciclo de la ULP con el modelo
+UlpTrigger ulpWakeTrigger() {
+  UlpWatchState st;
+  st.mq2Previo = RTC_SLOW_MEM[ULP_VAR_MQ2_PREVIO] & 0xFFFF;
+  st.mq135Previo = RTC_SLOW_MEM[ULP_VAR_MQ135_PREVIO] & 0xFFFF;
+  st.mq2Armado = (RTC_SLOW_MEM[ULP_VAR_MQ2_ARMADO] & 0xFFFF) != 0;
+  st.mq135Armado = (RTC_SLOW_MEM[ULP_VAR_MQ135_ARMADO] & 0xFFFF) != 0;
+  return ulpWatchModel(currentUlpWatchConfig(), st, RTC_SLOW_MEM[ULP_VAR_MQ2_ACTUAL] & 0xFFFF,
+                       RTC_SLOW_MEM[ULP_VAR_MQ135_ACTUAL] & 0xFFFF);
+}
+
+void reportUlpWakeup() {
+  UlpTrigger trigger = ulpWakeTrigger();
+  const char* reason = "desconocido";
+  switch (trigger) {
+    case ULP_MQ2_UMBRAL: reason = "MQ2 sobre umbral"; break;
+    case ULP_MQ2_SUBIDA: reason = "subida rapida MQ2"; break;
+    case ULP_MQ135_UMBRAL: reason = "MQ135 sobre umbral"; break;
+    case ULP_MQ135_SUBIDA: reason = "subida rapida MQ135"; break;
+    default: break;
+  }
+  Serial.printf("Despertado por ULP: %s (MQ2: %u, MQ135: %u)\n", reason,
+                (unsigned)(RTC_SLOW_MEM[ULP_VAR_MQ2_ACTUAL] & 0xFFFF),
+                (unsigned)(RTC_SLOW_MEM[ULP_VAR_MQ135_ACTUAL] & 0xFFFF));
+}
+
+void enterDeepSleep(const SampleRecord& last) {
+  startUlpWatch(last);
+#if MQ_HEATER_PIN >= 0
+  digitalWrite(MQ_HEATER_PIN, HIGH);
+  rtc_gpio_hold_en((gpio_num_t)MQ_HEATER_PIN);
+#endif
+  esp_sleep_enable_ulp_wakeup();
+  esp_sleep_enable_timer_wakeup((uint64_t)samplePeriodMs * 1000ULL);
+  rtc_gpio_pullup_en((gpio_num_t)FLAME_PIN);  // el pull-up digital no se mantiene dormido
+  esp_sleep_enable_ext0_wakeup((gpio_num_t)FLAME_PIN, FLAME_ACTIVE_LEVEL);
+  if (serialVerbose()) Serial.println("Durmiendo con vigilancia ULP.");
+  Serial.flush();
+  esp_deep_sleep_start();
+}
+
+// --- Reloj ---
+bool clockValid() {
+  return time(NULL) >= RELOJ_VALIDO_DESDE;
+}
+
+// Índice de día local, monótono dentro de una misma base de tiempo
+int32_t localDay(struct tm& now) {
+  time_t t = time(NULL);
+  localtime_r(&t, &now);
+  return (now.tm_year + 1900) * 366 + now.tm_yday;
+}
+
+// --- Índice meteorológico de incendios ---
+// fwiNextDay() y sus tablas están en nucleo.h
+void fireWeatherBegin() {
+  FwiState saved;
+  if (prefs.getBytes("fwi", &saved, sizeof(saved)) == sizeof(saved)) {
+    fireWeather = saved;
+  }
+}
+
+// Guarda la primera lectura válida desde el mediodía local y, al cambiar de
+// día, avanza los códigos con ella. Sin pluviómetro la lluvia es 0: tras un
+// episodio de lluvia los códigos deben reiniciarse a los valores iniciales.
+void fireWeatherUpdate(const SampleRecord& sample) {
+  struct tm now;
+  int32_t day = localDay(now);
+  if (day != fwiNoon.day) {
+    if (fwiNoon.valid && fwiNoon.day != fireWeather.day) {
+      fireWeather.codes = fwiNextDay(fireWeather.codes, fwiNoon.temperature, fwiNoon.humidity,
+                                     fwiNoon.windKmh, 0.0f, fwiNoon.month);
+      fireWeather.day = fwiNoon.day;
+      prefs.putBytes("fwi", &fireWeather, sizeof(fireWeather));
+    }
+    fwiNoon.day = day;
+    fwiNoon.valid = false;
+  }
+  if (!fwiNoon.valid && now.tm_hour >= 12 && !sample.dhtError) {
+    fwiNoon.valid = true;
+    fwiNoon.month = clockValid() ? now.tm_mon : FWI_MES_DEFECTO - 1;
+    fwiNoon.temperature = sample.temperature;
+    fwiNoon.humidity = sample.humidity;
+    fwiNoon.windKmh = sample.windKmh;
+  }
+}
+
+// --- Umbrales adaptativos ---
+void adaptiveBegin() {
+  if (prefs.getBytes("base", diurnalBaseline, sizeof(diurnalBaseline)) ==
+      sizeof(diurnalBaseline)) {
+    return;
+  }
+  for (int h = 0; h < 24; h++) {
+    diurnalBaseline[h].tempAlta.reset(0.95f);
+    diurnalBaseline[h].humBaja.reset(0.05f);
+  }
+}
+
+// Sin reloj en hora la hora del día no significa nada: se sigue con los fijos
+const HourBaseline* currentBaseline() {
+  if (!clockValid()) return NULL;
+  struct tm now;
+  localDay(now);
+  const HourBaseline& base = diurnalBaseline[now.tm_hour];
+  if (base.tempAlta.count() < ADAPT_MIN_MUESTRAS) return NULL;
+  return &base;
+}
+
+// Solo aprende en BAJA para que un incendio no se convierta en línea base
+void adaptiveLearn(const SampleRecord& sample) {
+  AlertThresholds th = currentAlertThresholds();
+  bool fixedHit = sample.temperature > TEMP_CRITICA || sample.humidity < HUM_CRITICA;
+  bool adaptiveHit = sample.temperature > th.tempCritica || sample.humidity < th.humCritica;
+  if (fixedHit && !adaptiveHit) adaptiveStats.suppressed++;
+  if (adaptiveHit && !fixedHit) adaptiveStats.raised++;
+
+  if (!clockValid() || sample.level != AL_BAJA) return;
+  struct tm now;
+  localDay(now);
+  HourBaseline& base = diurnalBaseline[now.tm_hour];
+  base.tempAlta.add(sample.temperature);
+  base.humBaja.add(sample.humidity);
+
+  // Si la tarea de log aún no guardó la anterior, se reintenta en la siguiente muestra
+  if (millis() - lastBaselineSaveMs >= ADAPT_GUARDADO_MS && !baselineSavePending.load()) {
+    lastBaselineSaveMs = millis();
+    memcpy(baselineSnapshot, diurnalBaseline, sizeof(baselineSnapshot));
+    baselineSavePending.store(true);
+    xTaskNotifyGive(logTaskHandle);
+  }
+}
+
+// Tarea de log. putBytes devuelve 0 si NVS está llena o falla la escritura.
+void saveBaseline() {
+  if (prefs.putBytes("base", baselineSnapshot, sizeof(baselineSnapshot)) ==
+      sizeof(baselineSnapshot)) {
+    adaptiveStats.saves++;
+  } else {
+    adaptiveStats.saveFailures++;
+    if (serialVerbose()) Serial.println("Error al guardar la linea base en NVS.");
   }
+  baselineSavePending.store(false);
 }
@@ -0,0 +1,1552 @@
+// Lógica pura de Centinela Verde: sin Arduino, FreeRTOS ni periféricos.
+// La incluye el firmware y la compila en el host test/ (make -C test). Define
+// funciones y tablas, así que se incluye desde un único .cpp por programa.
+#ifndef CENTINELA_NUCLEO_H
+#define CENTINELA_NUCLEO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+// --- Vigilancia ULP ---
+enum UlpTrigger {
+  ULP_SIN_DISPARO,
+  ULP_MQ2_UMBRAL,
+  ULP_MQ2_SUBIDA,
+  ULP_MQ135_UMBRAL,
+  ULP_MQ135_SUBIDA
+};
+
+struct UlpWatchConfig {
+  uint16_t mq2Umbral;
+  uint16_t mq135Umbral;
+  uint16_t mq2Subida;
+  uint16_t mq135Subida;
+  uint16_t mq2Rearme;    // por debajo, el umbral vuelve a poder despertar
+  uint16_t mq135Rearme;
+};
+
+// Las palabras de RTC_SLOW_MEM que la ULP lee y escribe en cada ciclo
+struct UlpWatchState {
+  uint16_t mq2Previo;
+  uint16_t mq135Previo;
+  bool mq2Armado;
+  bool mq135Armado;
+};
+
+// Modelo en C del programa ULP de startUlpWatch(): mismas comparaciones y mismo
+// orden. El umbral despierta solo armado, es decir, al cruzarlo hacia arriba;
+// una lectura bajo el rearme lo arma. Sin disparo, la lectura pasa a previo.
+UlpTrigger ulpWatchModel(const UlpWatchConfig& cfg, UlpWatchState& st, uint16_t mq2,
+                         uint16_t mq135) {
+  if (mq2 < cfg.mq2Rearme) st.mq2Armado = true;
+  if (st.mq2Armado && mq2 > cfg.mq2Umbral) return ULP_MQ2_UMBRAL;
+  if (mq2 > st.mq2Previo + cfg.mq2Subida) return ULP_MQ2_SUBIDA;
+  if (mq135 < cfg.mq135Rearme) st.mq135Armado = true;
+  if (st.mq135Armado && mq135 > cfg.mq135Umbral) return ULP_MQ135_UMBRAL;
+  if (mq135 > st.mq135Previo + cfg.mq135Subida) return ULP_MQ135_SUBIDA;
+  st.mq2Previo = mq2;
+  st.mq135Previo = mq135;
+  return ULP_SIN_DISPARO;
+}
+
+// Armado de un umbral al volver a dormir, con la lectura de la CPU. Por encima
+// del umbral sin alarma (sin corroborar) queda desarmado: si no, la ULP
+// despertaría en el ciclo siguiente, y así cada 250 ms. Entre rearme y umbral
+// conserva el estado, salvo que fuera ese umbral el que despertó.
+bool ulpRearm(uint16_t reading, uint16_t umbral, uint16_t rearme, bool armed, bool woke) {
+  if (reading > umbral) return false;
+  if (reading < rearme) return true;
+  return armed && !woke;
+}
+
+// --- Formato numérico ---
+// Sin asignaciones ni printf: cada función escribe en el búfer del llamante y
+// devuelve el puntero al final, sin terminador. end es el final del búfer y
+// siempre queda un byte libre para el '\0'; un campo que no cabe entero no se
+// escribe y se devuelve end, que el llamante trata como desbordado.
+#define FMT_UINT_MAX 10
+#define FMT_INT_MAX 11
+#define FMT_U16_MAX 5                  // formatUint de un uint16_t
+#define FMT_FIXED_LIMIT 999999         // saturación de la parte entera
+#define FMT_FIXED_MAX(d) (8 + (d))     // signo, 6 cifras, punto y decimales
+
+constexpr char kDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+constexpr uint32_t kPow10[] = {1, 10, 100, 1000, 10000};
+
+// Copia n bytes si caben enteros antes de end
+char* appendBytes(char* out, char* end, const char* src, size_t n) {
+  if (out >= end || (size_t)(end - out) <= n) return end;
+  memcpy(out, src, n);
+  return out + n;
+}
+
+char* appendStr(char* out, char* end, const char* str) {
+  return appendBytes(out, end, str, strlen(str));
+}
+
+char* appendChar(char* out, char* end, char c) {
+  return appendBytes(out, end, &c, 1);
+}
+
+// Escribe los dígitos justo antes de tail; devuelve el primero
+static char* digitsBefore(char* tail, uint32_t value) {
+  while (value >= 100) {
+    uint32_t pair = (value % 100) * 2;
+    value /= 100;
+    *--tail = kDigitPairs[pair + 1];
+    *--tail = kDigitPairs[pair];
+  }
+  if (value >= 10) {
+    *--tail = kDigitPairs[value * 2 + 1];
+    *--tail = kDigitPairs[value * 2];
+  } else {
+    *--tail = '0' + value;
+  }
+  return tail;
+}
+
+char* formatUint(char* out, char* end, uint32_t value) {
+  char tmp[FMT_UINT_MAX];
+  char* t = digitsBefore(tmp + sizeof(tmp), value);
+  return appendBytes(out, end, t, tmp + sizeof(tmp) - t);
+}
+
+char* formatInt(char* out, char* end, int32_t value) {
+  char tmp[FMT_INT_MAX];
+  char* t = digitsBefore(tmp + sizeof(tmp), value < 0 ? 0u - (uint32_t)value : value);
+  if (value < 0) *--t = '-';
+  return appendBytes(out, end, t, tmp + sizeof(tmp) - t);
+}
+
+// Redondeo al más cercano, como String(x, decimals); decimals <= 4. La parte
+// entera satura en ±FMT_FIXED_LIMIT y NaN sale como "nan" (un sensor averiado
+// no puede alargar la trama).
+char* formatFixed(char* out, char* end, float value, uint8_t decimals) {
+  if (isnan(value)) return appendStr(out, end, "nan");
+  // Doble tope: en float antes de llroundf y en entero después, porque el
+  // redondeo a 4 decimales cerca del límite puede pasarse
+  if (value > FMT_FIXED_LIMIT) value = FMT_FIXED_LIMIT;
+  if (value < -FMT_FIXED_LIMIT) value = -FMT_FIXED_LIMIT;
+
+  char tmp[FMT_FIXED_MAX(4)];
+  char* t = tmp + sizeof(tmp);
+  uint32_t scale = kPow10[decimals];
+  int64_t scaled = llroundf(value * scale);
+  bool negative = scaled < 0;
+  if (negative) scaled = -scaled;
+  int64_t limit = (int64_t)FMT_FIXED_LIMIT * scale;
+  if (scaled > limit) scaled = limit;
+  if (decimals > 0) {
+    uint32_t frac = (uint32_t)(scaled % scale);
+    for (uint8_t i = 0; i < decimals; i++, frac /= 10) *--t = '0' + frac % 10;
+    *--t = '.';
+  }
+  t = digitsBefore(t, (uint32_t)(scaled / scale));
+  if (negative) *--t = '-';
+  return appendBytes(out, end, t, tmp + sizeof(tmp) - t);
+}
+
+// --- PMS5003 ---
+// Tramas de 32 bytes del PMS5003: 0x42 0x4D, longitud (28), 13 palabras de
+// datos big-endian y la suma de los 30 bytes anteriores. El analizador no
+// bloquea: se le pasa lo que haya en el búfer de la UART byte a byte.
+class PmsFrameParser {
+ public:
+  PmsFrameParser() : pm1(0), pm25(0), pm10(0), frames(0), checksumErrors(0), pos_(0) {}
+
+  // Devuelve true al completar una trama válida
+  bool feed(uint8_t byte) {
+    if (pos_ == 0 && byte != 0x42) return false;
+    if (pos_ == 1 && byte != 0x4D) {
+      pos_ = (byte == 0x42) ? 1 : 0;
+      return false;
+    }
+    frame_[pos_++] = byte;
+    if (pos_ == 4 && word(2) != FRAME_LEN - 4) {
+      pos_ = 0;
+      return false;
+    }
+    if (pos_ < FRAME_LEN) return false;
+
+    pos_ = 0;
+    uint16_t sum = 0;
+    for (int i = 0; i < FRAME_LEN - 2; i++) sum += frame_[i];
+    if (sum != word(FRAME_LEN - 2)) {
+      checksumErrors++;
+      return false;
+    }
+    pm1 = word(10);
+    pm25 = word(12);
+    pm10 = word(14);
+    frames++;
+    return true;
+  }
+
+  uint16_t pm1;
+  uint16_t pm25;
+  uint16_t pm10;
+  uint32_t frames;
+  uint32_t checksumErrors;
+
+ private:
+  static const int FRAME_LEN = 32;
+  uint16_t word(int i) const { return (frame_[i] << 8) | frame_[i + 1]; }
+  uint8_t frame_[FRAME_LEN];
+  int pos_;
+};
+
+// Órdenes de 7 bytes: 42 4D, orden, dos datos y la suma de los cinco anteriores
+const uint8_t kPmsPassiveCmd[] = {0x42, 0x4D, 0xE1, 0x00, 0x00, 0x01, 0x70};
+const uint8_t kPmsReadCmd[] = {0x42, 0x4D, 0xE2, 0x00, 0x00, 0x01, 0x71};
+
+// --- Calefactor MQ ---
+// En ciclo, el gas se mide cada MQ_CICLO_MS tras MQ_PRECALENTAMIENTO_MS de
+// calentamiento; el equilibrio térmico llega a MQ_CALENTADO_COMPLETO_MS
+#define MQ_CICLO_MS 60000
+#define MQ_PRECALENTAMIENTO_MS 20000
+#define MQ_CALENTADO_COMPLETO_MS 120000
+#define MQ_HOLGURA_MS 100  // el encendido se adelanta: latencia del temporizador y de la lectura
+
+// Relación lectura en equilibrio / lectura parcial, medida en aire limpio
+struct MqWarmCalibration {
+  float ratio[2];
+  uint32_t warmMs;  // calentamiento al que corresponde la lectura parcial
+};
+
+// Corrección del calentamiento parcial: la relación calibrada en warmMs,
+// interpolada hasta 1 en el equilibrio térmico
+float mqWarmFactor(const MqWarmCalibration& cal, int channel, uint32_t warmMs) {
+  if (warmMs >= MQ_CALENTADO_COMPLETO_MS) return 1.0f;
+  float ratio = cal.ratio[channel];
+  if (warmMs <= cal.warmMs) return ratio;
+  float t = (float)(warmMs - cal.warmMs) / (MQ_CALENTADO_COMPLETO_MS - cal.warmMs);
+  return ratio + (1.0f - ratio) * t;
+}
+
+// La siguiente medida cae en una muestra: la primera a cycleMs o más de la actual
+uint32_t mqMeasureDelayMs(uint32_t periodMs, uint32_t cycleMs) {
+  uint32_t n = (cycleMs + periodMs - 1) / periodMs;
+  return (n > 0 ? n : 1) * periodMs;
+}
+
+// Encendido del calefactor contado desde la muestra actual, para que esa
+// muestra lo encuentre con el precalentamiento hecho
+uint32_t mqPreheatDelayMs(uint32_t periodMs, uint32_t cycleMs) {
+  uint32_t measure = mqMeasureDelayMs(periodMs, cycleMs);
+  uint32_t lead = MQ_PRECALENTAMIENTO_MS + MQ_HOLGURA_MS;
+  return measure > lead ? measure - lead : 0;
+}
+
+// --- Viento ---
+// Anemómetro en el PCNT, leído cada segundo sin borrarlo, y veleta resistiva
+#define WIND_KMH_PER_HZ 2.4
+#define WIND_GUST_SECONDS 3      // la racha es la máxima media de estos segundos
+#define WIND_PCNT_LIMITE 32767   // counter_h_lim: al llegar, el PCNT vuelve a 0
+
+// Tensiones de la veleta SparkFun (divisor con 10k a 3V3) en cuentas de ADC,
+// una por cada sector de 22,5 grados empezando en el norte
+constexpr uint16_t kWindVaneAdc[16] = {3143, 1624, 1845, 335, 372, 264, 738, 506,
+                                       1149, 979, 2520, 2397, 3780, 3309, 3548, 2810};
+
+uint8_t windVaneSector(uint16_t adc) {
+  uint8_t best = 0;
+  uint16_t bestDiff = 0xFFFF;
+  for (uint8_t i = 0; i < 16; i++) {
+    uint16_t diff = adc > kWindVaneAdc[i] ? adc - kWindVaneAdc[i] : kWindVaneAdc[i] - adc;
+    if (diff < bestDiff) {
+      bestDiff = diff;
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Pulsos entre dos lecturas del contador, que cuenta de 0 a WIND_PCNT_LIMITE - 1
+uint16_t windPulseDelta(int16_t prev, int16_t now) {
+  return now >= prev ? now - prev : now + WIND_PCNT_LIMITE - prev;
+}
+
+struct WindAccumulator {
+  uint32_t seconds;
+  uint32_t pulses;
+  uint32_t maxGustPulses;  // sobre WIND_GUST_SECONDS segundos
+  float dirX;              // suma de vectores unitarios de la veleta
+  float dirY;
+};
+
+// Lo alimenta el temporizador de 1 s y lo vacía cada muestra; el firmware lo
+// protege con un spinlock, por eso tick() y drain() no hacen más que sumar
+class WindSampler {
+ public:
+  WindSampler() : pos_(0) {
+    memset(&acc_, 0, sizeof(acc_));
+    memset(recent_, 0, sizeof(recent_));
+  }
+
+  void tick(uint16_t pulses, uint8_t sector) {
+    recent_[pos_] = pulses;
+    pos_ = (pos_ + 1) % WIND_GUST_SECONDS;
+    uint32_t gust = 0;
+    for (int i = 0; i < WIND_GUST_SECONDS; i++) gust += recent_[i];
+    acc_.seconds++;
+    acc_.pulses += pulses;
+    if (gust > acc_.maxGustPulses) acc_.maxGustPulses = gust;
+    // Con las cazoletas paradas la veleta no apunta a ningún sitio
+    if (pulses > 0) {
+      float angle = sector * (float)(M_PI / 8);
+      acc_.dirX += sinf(angle);
+      acc_.dirY += cosf(angle);
+    }
+  }
+
+  WindAccumulator drain() {
+    WindAccumulator acc = acc_;
+    memset(&acc_, 0, sizeof(acc_));
+    return acc;
+  }
+
+ private:
+  WindAccumulator acc_;
+  uint16_t recent_[WIND_GUST_SECONDS];
+  uint8_t pos_;
+};
+
+// Media, racha y dirección de lo acumulado; false sin un segundo completo.
+// dirDeg no se toca si no hubo viento.
+bool windSummary(const WindAccumulator& acc, float& kmh, float& gustKmh, uint16_t& dirDeg) {
+  if (acc.seconds == 0) return false;
+  kmh = (float)acc.pulses / acc.seconds * WIND_KMH_PER_HZ;
+  gustKmh = (float)acc.maxGustPulses / WIND_GUST_SECONDS * WIND_KMH_PER_HZ;
+  if (acc.dirX != 0 || acc.dirY != 0) {
+    float deg = atan2f(acc.dirX, acc.dirY) * (float)(180 / M_PI);
+    dirDeg = (uint16_t)lroundf(deg < 0 ? deg + 360 : deg) % 360;
+  }
+  return true;
+}
+
+// --- Índice meteorológico de incendios ---
+// Códigos del sistema FWI: FFMC, DMC y DC arrastran la humedad del combustible
+// de un día al siguiente; ISI, BUI y FWI se derivan de ellos.
+struct FwiCodes {
+  float ffmc;
+  float dmc;
+  float dc;
+  float isi;
+  float bui;
+  float fwi;
+};
+
+// Factores de duración del día de Van Wagner (1987) para latitudes medias del
+// hemisferio norte, usados por DMC y DC.
+constexpr float kFwiDayLength[12] = {6.5f, 7.5f, 9.0f, 12.8f, 13.9f, 13.9f,
+                                     12.4f, 10.9f, 9.4f, 8.0f, 7.0f, 6.0f};
+constexpr float kFwiDayFactor[12] = {-1.6f, -1.6f, -1.6f, 0.9f, 3.8f, 5.8f,
+                                     6.4f, 5.0f, 2.4f, 0.4f, -1.6f, -1.6f};
+
+// Ecuaciones de Van Wagner y Pickett (1985); test/ las compara con la tabla de
+// referencia del sistema canadiense.
+FwiCodes fwiNextDay(const FwiCodes& prev, float temp, float rh, float windKmh, float rainMm,
+                    uint8_t month) {
+  FwiCodes out;
+  if (rh > 100) rh = 100;
+  if (rh < 0) rh = 0;
+  if (windKmh < 0) windKmh = 0;
+
+  // FFMC: humedad del combustible fino
+  float mo = 147.2f * (101 - prev.ffmc) / (59.5f + prev.ffmc);
+  if (rainMm > 0.5f) {
+    float rf = rainMm - 0.5f;
+    float gain = 42.5f * rf * expf(-100 / (251 - mo)) * (1 - expf(-6.93f / rf));
+    if (mo > 150) gain += 0.0015f * (mo - 150) * (mo - 150) * sqrtf(rf);
+    mo += gain;
+    if (mo > 250) mo = 250;
+  }
+  float dry = 0.18f * (21.1f - temp) * (1 - expf(-0.115f * rh));
+  float ed = 0.942f * powf(rh, 0.679f) + 11 * expf((rh - 100) / 10) + dry;
+  float m = mo;
+  if (mo > ed) {
+    float ko = 0.424f * (1 - powf(rh / 100, 1.7f)) + 0.0694f * sqrtf(windKmh) * (1 - powf(rh / 100, 8));
+    float kd = ko * 0.581f * expf(0.0365f * temp);
+    m = ed + (mo - ed) * powf(10, -kd);
+  } else {
+    float ew = 0.618f * powf(rh, 0.753f) + 10 * expf((rh - 100) / 10) + dry;
+    if (mo < ew) {
+      float dh = (100 - rh) / 100;
+      float k1 = 0.424f * (1 - powf(dh, 1.7f)) + 0.0694f * sqrtf(windKmh) * (1 - powf(dh, 8));
+      float kw = k1 * 0.581f * expf(0.0365f * temp);
+      m = ew - (ew - mo) * powf(10, -kw);
+    }
+  }
+  out.ffmc = 59.5f * (250 - m) / (147.2f + m);
+  if (out.ffmc > 101) out.ffmc = 101;
+  if (out.ffmc < 0) out.ffmc = 0;
+
+  // DMC: capa de humus superficial
+  float t = temp < -1.1f ? -1.1f : temp;
+  float pr = prev.dmc;
+  if (rainMm > 1.5f) {
+    float rw = 0.92f * rainMm - 1.27f;
+    float wmi = 20 + 280 / expf(0.023f * prev.dmc);
+    float b;
+    if (prev.dmc <= 33) b = 100 / (0.5f + 0.3f * prev.dmc);
+    else if (prev.dmc <= 65) b = 14 - 1.3f * logf(prev.dmc);
+    else b = 6.2f * logf(prev.dmc) - 17.2f;
+    float wmr = wmi + 1000 * rw / (48.77f + b * rw);
+    pr = 43.43f * (5.6348f - logf(wmr - 20));
+    if (pr < 0) pr = 0;
+  }
+  out.dmc = pr + 1.894f * (t + 1.1f) * (100 - rh) * kFwiDayLength[month] * 1e-4f;
+
+  // DC: capas profundas
+  t = temp < -2.8f ? -2.8f : temp;
+  float pe = (0.36f * (t + 2.8f) + kFwiDayFactor[month]) / 2;
+  if (pe < 0) pe = 0;
+  float dr = prev.dc;
+  if (rainMm > 2.8f) {
+    float rd = 0.83f * rainMm - 1.27f;
+    float qr = 800 * expf(-prev.dc / 400) + 3.937f * rd;
+    dr = 400 * logf(800 / qr);
+    if (dr < 0) dr = 0;
+  }
+  out.dc = dr + pe;
+
+  // ISI: propagación inicial
+  float mf = 147.2f * (101 - out.ffmc) / (59.5f + out.ffmc);
+  float ff = 91.9f * expf(-0.1386f * mf) * (1 + powf(mf, 5.31f) / 4.93e7f);
+  out.isi = 0.208f * expf(0.05039f * windKmh) * ff;
+
+  // BUI: combustible disponible
+  if (out.dmc == 0 && out.dc == 0) {
+    out.bui = 0;
+  } else if (out.dmc <= 0.4f * out.dc) {
+    out.bui = 0.8f * out.dmc * out.dc / (out.dmc + 0.4f * out.dc);
+  } else {
+    out.bui = out.dmc - (1 - 0.8f * out.dc / (out.dmc + 0.4f * out.dc)) *
+                            (0.92f + powf(0.0114f * out.dmc, 1.7f));
+  }
+  if (out.bui < 0) out.bui = 0;
+
+  // FWI: intensidad del frente
+  float fd = out.bui <= 80 ? 0.626f * powf(out.bui, 0.809f) + 2
+                           : 1000 / (25 + 108.64f * expf(-0.023f * out.bui));
+  float bb = 0.1f * out.isi * fd;
+  out.fwi = bb > 1 ? expf(2.72f * powf(0.434f * logf(bb), 0.647f)) : bb;
+  return out;
+}
+
+// --- Cuantiles ---
+// Estimador P² (Jain y Chlamtac, 1985): sigue un cuantil con cinco marcadores
+// sin guardar las muestras.
+class P2Quantile {
+ public:
+  void reset(float p) {
+    p_ = p;
+    count_ = 0;
+    for (int i = 0; i < 5; i++) n_[i] = i + 1;
+    np_[0] = 1;
+    np_[1] = 1 + 2 * p;
+    np_[2] = 1 + 4 * p;
+    np_[3] = 3 + 2 * p;
+    np_[4] = 5;
+  }
+
+  void add(float x) {
+    if (count_ < 5) {
+      // Arranque: los cinco primeros valores, ordenados, son los marcadores
+      int i = count_++;
+      while (i > 0 && q_[i - 1] > x) {
+        q_[i] = q_[i - 1];
+        i--;
+      }
+      q_[i] = x;
+      return;
+    }
+    count_++;
+    int k;
+    if (x < q_[0]) {
+      q_[0] = x;
+      k = 0;
+    } else if (x >= q_[4]) {
+      q_[4] = x;
+      k = 3;
+    } else {
+      k = 0;
+      while (x >= q_[k + 1]) k++;
+    }
+    for (int i = k + 1; i < 5; i++) n_[i] += 1;
+    const float dn[5] = {0, p_ / 2, p_, (1 + p_) / 2, 1};
+    for (int i = 0; i < 5; i++) np_[i] += dn[i];
+
+    for (int i = 1; i < 4; i++) {
+      float d = np_[i] - n_[i];
+      if ((d >= 1 && n_[i + 1] - n_[i] > 1) || (d <= -1 && n_[i - 1] - n_[i] < -1)) {
+        int s = d > 0 ? 1 : -1;
+        float qp = parabolic(i, s);
+        if (q_[i - 1] < qp && qp < q_[i + 1]) {
+          q_[i] = qp;
+        } else {
+          q_[i] += s * (q_[i + s] - q_[i]) / (n_[i + s] - n_[i]);
+        }
+        n_[i] += s;
+      }
+    }
+  }
+
+  void restart() { reset(p_); }
+
+  uint32_t count() const { return count_; }
+  float value() const { return count_ >= 5 ? q_[2] : NAN; }
+
+ private:
+  float parabolic(int i, int s) const {
+    return q_[i] + s / (n_[i + 1] - n_[i - 1]) *
+                       ((n_[i] - n_[i - 1] + s) * (q_[i + 1] - q_[i]) / (n_[i + 1] - n_[i]) +
+                        (n_[i + 1] - n_[i] - s) * (q_[i] - q_[i - 1]) / (n_[i] - n_[i - 1]));
+  }
+
+  float p_;
+  float q_[5];   // alturas de los marcadores
+  float n_[5];   // posiciones reales
+  float np_[5];  // posiciones deseadas
+  uint32_t count_;
+};
+
+// P² no olvida sus marcadores extremos. Para seguir los cambios de estación se
+// usan dos estimadores solapados: el de relevo empieza a mitad de ventana y
+// sustituye al activo cuando este la completa. La ventana es en muestras.
+template <uint32_t kWindow>
+class SlidingQuantile {
+ public:
+  void reset(float p) {
+    active_.reset(p);
+    relay_.reset(p);
+  }
+
+  void add(float x) {
+    active_.add(x);
+    if (active_.count() > kWindow / 2) relay_.add(x);
+    if (active_.count() >= kWindow) {
+      active_ = relay_;
+      relay_.restart();
+    }
+  }
+
+  uint32_t count() const { return active_.count(); }
+  float value() const { return active_.value(); }
+
+ private:
+  P2Quantile active_;
+  P2Quantile relay_;
+};
+
+// --- Umbrales adaptativos ---
+// Cada hora del día aprende la línea base del nodo (P95 de temperatura y P5 de
+// humedad en nivel BAJA) y la alerta salta al desviarse de ella. Los límites
+// acotan el umbral aprendido para que un verano anómalo no lo desplace sin fin.
+#define ADAPT_MARGEN_TEMP 5.0     // °C sobre el P95 de la hora
+#define ADAPT_MARGEN_HUM 8.0      // puntos bajo el P5 de la hora
+#define ADAPT_TEMP_MIN 25.0
+#define ADAPT_TEMP_MAX 50.0
+#define ADAPT_HUM_MIN 8.0
+#define ADAPT_HUM_MAX 40.0
+#define ADAPT_MIN_MUESTRAS 360    // por hora antes de sustituir a los umbrales fijos
+#define ADAPT_VENTANA_MUESTRAS 8640  // ~12 días por hora; se recuerda entre media y una ventana
+
+// Línea base de una hora del día, se guarda tal cual en NVS
+struct HourBaseline {
+  SlidingQuantile<ADAPT_VENTANA_MUESTRAS> tempAlta;  // P95
+  SlidingQuantile<ADAPT_VENTANA_MUESTRAS> humBaja;   // P5
+};
+
+float adaptiveTempLimit(const HourBaseline& base) {
+  float t = base.tempAlta.value() + (float)ADAPT_MARGEN_TEMP;
+  return t < ADAPT_TEMP_MIN ? ADAPT_TEMP_MIN : t > ADAPT_TEMP_MAX ? ADAPT_TEMP_MAX : t;
+}
+
+float adaptiveHumLimit(const HourBaseline& base) {
+  float h = base.humBaja.value() - (float)ADAPT_MARGEN_HUM;
+  return h < ADAPT_HUM_MIN ? ADAPT_HUM_MIN : h > ADAPT_HUM_MAX ? ADAPT_HUM_MAX : h;
+}
+
+// --- Corte de alimentación ---
+// Presupuesto del vaciado de emergencia. Un registro solo se empieza si, con el
+// peor coste de escritura visto, aún queda la reserva para cerrar antes del
+// plazo. Una escritura más lenta que todas las anteriores puede pasarse, pero
+// como mucho en lo que exceda a esa estimación.
+class FlushBudget {
+ public:
+  FlushBudget(int64_t deadlineUs, int64_t reserveUs, int64_t estimateUs)
+      : deadlineUs_(deadlineUs), reserveUs_(reserveUs), worstUs_(estimateUs) {}
+
+  bool canStart(int64_t nowUs) const { return nowUs + worstUs_ + reserveUs_ <= deadlineUs_; }
+
+  void record(int64_t costUs) {
+    if (costUs > worstUs_) worstUs_ = costUs;
+  }
+
+  int64_t worstUs() const { return worstUs_; }
+
+ private:
+  int64_t deadlineUs_;
+  int64_t reserveUs_;
+  int64_t worstUs_;
+};
+
+// --- Gestión de energía ---
+#define ENERGY_SOC_AHORRO 50       // % por debajo de los cuales se entra en cada perfil
+#define ENERGY_SOC_RESERVA 25
+#define ENERGY_SOC_CRITICO 10
+#define ENERGY_HISTERESIS 5        // % extra para volver al perfil anterior
+#define ENERGY_HISTERESIS_H 2      // horas de reserva extra para salir de ella con panel
+#define ENERGY_AUTONOMIA_MARGEN_H 6  // sobre lo que queda de noche: un amanecer nublado
+#define ENERGY_NOCHE_INICIAL_H 15    // noche supuesta hasta medir una (invierno a 42° N)
+#define ENERGY_NOCHE_MIN_H 4         // descargas más cortas son nubes, no noches
+#define ENERGY_VENTANA_H 3           // horas de descarga por medida de consumo
+#define ENERGY_VENTANA_PANEL_H 1     // horas con panel para ver si cubre el consumo
+
+enum EnergyLevel {
+  EN_NORMAL,
+  EN_AHORRO,
+  EN_RESERVA,
+  EN_CRITICO,
+  EN_COUNT
+};
+
+// Tensión en reposo de una celda LiPo frente a carga restante
+struct SocPoint {
+  uint16_t mv;
+  uint8_t soc;
+};
+constexpr SocPoint kSocTable[] = {{3300, 0},  {3500, 5},  {3600, 10}, {3700, 25},
+                                  {3750, 40}, {3800, 55}, {3850, 65}, {3900, 75},
+                                  {4000, 85}, {4100, 95}, {4200, 100}};
+
+uint8_t batterySoc(uint16_t mv) {
+  const size_t n = sizeof(kSocTable) / sizeof(kSocTable[0]);
+  if (mv <= kSocTable[0].mv) return 0;
+  for (size_t i = 1; i < n; i++) {
+    if (mv < kSocTable[i].mv) {
+      const SocPoint& a = kSocTable[i - 1];
+      const SocPoint& b = kSocTable[i];
+      return a.soc + (uint32_t)(mv - a.mv) * (b.soc - a.soc) / (b.mv - a.mv);
+    }
+  }
+  return 100;
+}
+
+// Previsión para energyPolicy(): cuánto falta para que vuelva la carga y cuánto
+// consume de verdad cada perfil. La noche es la última descarga larga medida;
+// el consumo, el modelo del perfil escalado por la descarga medida sin panel.
+class EnergyForecast {
+ public:
+  EnergyForecast()
+      : socTrend_(0), loadScale_(1), nightH_(ENERGY_NOCHE_INICIAL_H), dischargeH_(0),
+        windowH_(0), windowSoc_(0), loadMa_(0), lastSoc_(0), haveSoc_(false),
+        panel_(false), windowPanel_(false), panelShort_(false) {}
+
+  // Cada comprobación: horas desde la anterior, carga leída, si hay tensión de
+  // panel y el consumo modelado del perfil aplicado
+  void update(float hours, uint8_t soc, bool panel, float loadMa, float capacityMah) {
+    if (haveSoc_ && hours > 0) {
+      float trend = ((float)soc - lastSoc_) / hours;
+      socTrend_ += 0.05f * (trend - socTrend_);  // ~20 min de constante
+    }
+    haveSoc_ = true;
+    lastSoc_ = soc;
+    panel_ = panel;
+    if (panel) {
+      if (dischargeH_ >= ENERGY_NOCHE_MIN_H) nightH_ = dischargeH_;
+      dischargeH_ = 0;
+    } else {
+      dischargeH_ += hours;
+      panelShort_ = false;
+    }
+
+    // Ventanas largas con el mismo perfil y el mismo estado del panel, así el
+    // escalón de 1 % de la lectura pesa poco: sin panel miden el consumo, con
+    // panel si este lo cubre
+    if (windowH_ == 0 || loadMa != loadMa_ || panel != windowPanel_) {
+      loadMa_ = loadMa;
+      windowPanel_ = panel;
+      windowH_ = hours > 0 ? hours : 1e-6f;
+      windowSoc_ = soc;
+      return;
+    }
+    windowH_ += hours;
+    float drop = windowSoc_ - soc;
+    if (panel) {
+      if (windowH_ < ENERGY_VENTANA_PANEL_H) return;
+      panelShort_ = drop >= 2;
+    } else {
+      if (windowH_ < ENERGY_VENTANA_H) return;
+      if (drop > 0 && soc > 0) {
+        float ratio = drop * capacityMah / 100 / (loadMa * windowH_);
+        if (ratio < 0.5f) ratio = 0.5f;
+        if (ratio > 2.5f) ratio = 2.5f;
+        loadScale_ += 0.3f * (ratio - loadScale_);
+      }
+    }
+    windowH_ = hours;
+    windowSoc_ = soc;
+  }
+
+  // Carga de verdad: hay panel y la batería no baja con el perfil aplicado
+  bool charging() const { return panel_ && !panelShort_; }
+
+  float runtimeH(uint8_t soc, float loadMa, float capacityMah) const {
+    return capacityMah * soc / 100 / (loadMa * loadScale_);
+  }
+
+  // Con panel insuficiente cuenta la noche entera: el día ya no va a cargar
+  float hoursToCharge() const { return nightH_ > dischargeH_ ? nightH_ - dischargeH_ : 0; }
+  float socTrend() const { return socTrend_; }
+  float loadScale() const { return loadScale_; }
+  float nightH() const { return nightH_; }
+
+ private:
+  float socTrend_;    // %/h, media exponencial
+  float loadScale_;   // consumo medido / modelado
+  float nightH_;
+  float dischargeH_;  // horas seguidas sin panel
+  float windowH_;
+  float windowSoc_;
+  float loadMa_;
+  uint8_t lastSoc_;
+  bool haveSoc_;
+  bool panel_;
+  bool windowPanel_;
+  bool panelShort_;   // la última ventana con panel bajó la carga
+};
+
+// Decisión del perfil de energía; test/ la recorre con un año solar simulado.
+// Baja de perfil por carga restante y, sin panel, hasta el primero cuya
+// autonomía (runtimeH, por perfil) cubre hoursToCharge más el margen. Con panel
+// primero se guarda la noche: por encima de reserva solo si la autonomía en
+// reserva ya la cubre. Sube solo al superar el umbral más la histéresis, y
+// nunca mientras se descarga sin panel.
+EnergyLevel energyPolicy(EnergyLevel current, uint8_t soc, bool charging,
+                         const float runtimeH[EN_COUNT], float hoursToCharge) {
+  EnergyLevel target = EN_NORMAL;
+  if (soc < ENERGY_SOC_CRITICO) target = EN_CRITICO;
+  else if (soc < ENERGY_SOC_RESERVA) target = EN_RESERVA;
+  else if (soc < ENERGY_SOC_AHORRO) target = EN_AHORRO;
+  float needH = hoursToCharge + ENERGY_AUTONOMIA_MARGEN_H;
+  if (!charging) {
+    while (target < EN_CRITICO && runtimeH[target] < needH) target = (EnergyLevel)(target + 1);
+  } else if (target < EN_RESERVA) {
+    float bankH = current >= EN_RESERVA ? needH + ENERGY_HISTERESIS_H : needH;
+    if (runtimeH[EN_RESERVA] < bankH) target = EN_RESERVA;
+  }
+
+  if (target >= current) return target;
+  static const uint8_t limits[EN_COUNT] = {100, ENERGY_SOC_AHORRO, ENERGY_SOC_RESERVA,
+                                           ENERGY_SOC_CRITICO};
+  if (!charging || soc < limits[current] + ENERGY_HISTERESIS) return current;
+  return (EnergyLevel)(current - 1);
+}
+
+// --- Telemetría predictiva ---
+// Predictor de último valor más tendencia, en enteros para que nodo y colector
+// den exactamente la misma predicción. Se alimenta solo con valores transmitidos.
+class TrendPredictor {
+ public:
+  // constexpr: inicialización estática, así RTC_DATA_ATTR no lo reinicia al despertar
+  constexpr TrendPredictor() : t0_(0), t1_(0), v0_(0), v1_(0), count_(0) {}
+
+  int32_t predict(uint32_t tMs) const {
+    if (count_ < 2) return v1_;
+    int32_t span = (int32_t)(t1_ - t0_);
+    if (span <= 0) return v1_;
+    return v1_ + (int32_t)((int64_t)(v1_ - v0_) * (int32_t)(tMs - t1_) / span);
+  }
+
+  void update(uint32_t tMs, int32_t value) {
+    t0_ = t1_;
+    v0_ = v1_;
+    t1_ = tMs;
+    v1_ = value;
+    if (count_ < 2) count_++;
+  }
+
+  bool primed() const { return count_ > 0; }
+
+ private:
+  uint32_t t0_;
+  uint32_t t1_;
+  int32_t v0_;
+  int32_t v1_;
+  uint8_t count_;
+};
+
+// --- Compresión LZ ---
+#define EXPORT_LZ_HASH 512
+
+// LZ mínimo, cada trama se descomprime sola y reanudar no necesita historia.
+// Token < 0x80: token + 1 literales. Token >= 0x80: copia de (token & 0x7F) + 3
+// bytes desde una distancia de 2 bytes hacia atrás. Devuelve 0 si no cabe en cap.
+size_t lzCompress(const uint8_t* in, size_t len, uint8_t* out, size_t cap) {
+  static uint16_t table[EXPORT_LZ_HASH];
+  memset(table, 0xFF, sizeof(table));
+  size_t o = 0;
+  size_t i = 0;
+  size_t litStart = 0;
+  // Vuelca los literales pendientes [litStart, i) en tramos de 128
+  auto flushLiterals = [&]() {
+    while (litStart < i) {
+      size_t run = i - litStart > 128 ? 128 : i - litStart;
+      if (o + 1 + run > cap) return false;
+      out[o++] = run - 1;
+      memcpy(out + o, in + litStart, run);
+      o += run;
+      litStart += run;
+    }
+    return true;
+  };
+
+  while (i < len) {
+    size_t match = 0;
+    size_t candidate = 0;
+    if (i + 3 <= len) {
+      uint16_t h = ((in[i] << 5) ^ (in[i + 1] << 2) ^ in[i + 2]) & (EXPORT_LZ_HASH - 1);
+      candidate = table[h];
+      table[h] = i;
+      if (candidate != 0xFFFF) {
+        while (i + match < len && match < 130 && in[candidate + match] == in[i + match]) match++;
+      }
+    }
+    if (match < 3) {
+      i++;
+      continue;
+    }
+    if (!flushLiterals() || o + 3 > cap) return 0;
+    size_t distance = i - candidate;
+    out[o++] = 0x80 | (match - 3);
+    out[o++] = distance & 0xFF;
+    out[o++] = distance >> 8;
+    i += match;
+    litStart = i;
+  }
+  return flushLiterals() ? o : 0;
+}
+
+// El lado del receptor (tools/recibir_log); devuelve 0 si la trama está mal
+// formada o no cabe en cap
+size_t lzDecompress(const uint8_t* in, size_t len, uint8_t* out, size_t cap) {
+  size_t i = 0;
+  size_t o = 0;
+  while (i < len) {
+    uint8_t token = in[i++];
+    if (token < 0x80) {
+      size_t run = token + 1;
+      if (i + run > len || o + run > cap) return 0;
+      memcpy(out + o, in + i, run);
+      i += run;
+      o += run;
+    } else {
+      if (i + 2 > len) return 0;
+      size_t count = (token & 0x7F) + 3;
+      size_t distance = in[i] | (in[i + 1] << 8);
+      i += 2;
+      if (distance == 0 || distance > o || o + count > cap) return 0;
+      for (size_t k = 0; k < count; k++, o++) out[o] = out[o - distance];  // puede solaparse
+    }
+  }
+  return o;
+}
+
+// --- Transferencia masiva LoRa ---
+#define BULK_FRAG_BYTES 128
+#define BULK_MAX_DATA 32            // 4 KB por transferencia
+#define BULK_MAX_PARITY 16
+#define BULK_MAX_FRAGS (BULK_MAX_DATA + BULK_MAX_PARITY)
+
+// Semtech AN1200.13, cabecera explícita, CRC activo, sin optimización de baja
+// velocidad. cr es el denominador de 4/cr.
+uint32_t loraAirtimeMs(size_t len, uint8_t sf, float bwHz, uint8_t cr) {
+  const float symbolMs = (1 << sf) * 1000.0f / bwHz;
+  int32_t bits = 8 * (int32_t)len - 4 * sf + 28 + 16;
+  int32_t blocks = bits > 0 ? (bits + 4 * sf - 1) / (4 * sf) : 0;
+  float symbols = 8 + 4.25f + 8 + blocks * cr;
+  return (uint32_t)ceilf(symbols * symbolMs);
+}
+
+// GF(256) con el polinomio 0x11D; gfExp duplicada para no reducir módulo 255
+uint8_t gfExp[512];
+uint8_t gfLog[256];
+
+void gfBegin() {
+  uint16_t x = 1;
+  for (int i = 0; i < 255; i++) {
+    gfExp[i] = gfExp[i + 255] = x;
+    gfLog[x] = i;
+    x <<= 1;
+    if (x & 0x100) x ^= 0x11D;
+  }
+  gfExp[510] = gfExp[511] = gfExp[0];
+  gfLog[0] = 0;
+}
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+// Matriz de Cauchy 1 / (x_i + y_j) con x_i = k + i, y_j = j: cualquier
+// submatriz cuadrada es invertible, así que sirven k fragmentos cualesquiera
+uint8_t cauchyCoef(uint8_t k, uint8_t row, uint8_t col) {
+  return gfExp[255 - gfLog[(uint8_t)((k + row) ^ col)]];
+}
+
+// Paridad en frags[k .. k + m) a partir de los datos en frags[0 .. k)
+void fecEncode(uint8_t (*frags)[BULK_FRAG_BYTES], uint8_t k, uint8_t m) {
+  for (uint8_t i = 0; i < m; i++) {
+    uint8_t* parity = frags[k + i];
+    memset(parity, 0, BULK_FRAG_BYTES);
+    for (uint8_t j = 0; j < k; j++) {
+      uint8_t logCoef = gfLog[cauchyCoef(k, i, j)];
+      const uint8_t* data = frags[j];
+      for (int b = 0; b < BULK_FRAG_BYTES; b++) {
+        if (data[b]) parity[b] ^= gfExp[gfLog[data[b]] + logCoef];
+      }
+    }
+  }
+}
+
+// Recupera los fragmentos de datos que faltan invirtiendo la submatriz de
+// las k filas recibidas (identidad para datos, Cauchy para paridad). received
+// lleva un bit por fragmento y sale con todos los de datos marcados.
+bool fecDecode(uint8_t (*frags)[BULK_FRAG_BYTES], uint8_t k, uint8_t m, uint64_t& received) {
+  static uint8_t a[BULK_MAX_DATA][BULK_MAX_DATA];
+  static uint8_t inv[BULK_MAX_DATA][BULK_MAX_DATA];
+  uint8_t rows[BULK_MAX_DATA];
+  uint8_t missing = 0;
+  for (uint8_t j = 0; j < k; j++) {
+    if (!((received >> j) & 1)) missing++;
+  }
+  if (missing == 0) return true;
+
+  // Filas: los datos recibidos y tantos fragmentos de paridad como huecos
+  uint8_t r = 0;
+  for (uint8_t idx = 0; idx < k + m && r < k; idx++) {
+    if ((received >> idx) & 1) rows[r++] = idx;
+  }
+  if (r < k) return false;
+  for (uint8_t i = 0; i < k; i++) {
+    for (uint8_t j = 0; j < k; j++) {
+      a[i][j] = rows[i] < k ? (rows[i] == j) : cauchyCoef(k, rows[i] - k, j);
+      inv[i][j] = i == j;
+    }
+  }
+
+  // Gauss-Jordan; en GF(256) sumar y restar son XOR
+  for (uint8_t col = 0; col < k; col++) {
+    uint8_t pivot = col;
+    while (pivot < k && a[pivot][col] == 0) pivot++;
+    if (pivot == k) return false;
+    if (pivot != col) {
+      for (uint8_t j = 0; j < k; j++) {
+        uint8_t t = a[col][j];
+        a[col][j] = a[pivot][j];
+        a[pivot][j] = t;
+        t = inv[col][j];
+        inv[col][j] = inv[pivot][j];
+        inv[pivot][j] = t;
+      }
+    }
+    uint8_t scale = gfExp[255 - gfLog[a[col][col]]];
+    for (uint8_t j = 0; j < k; j++) {
+      a[col][j] = gfMul(a[col][j], scale);
+      inv[col][j] = gfMul(inv[col][j], scale);
+    }
+    for (uint8_t i = 0; i < k; i++) {
+      uint8_t factor = a[i][col];
+      if (i == col || factor == 0) continue;
+      for (uint8_t j = 0; j < k; j++) {
+        a[i][j] ^= gfMul(factor, a[col][j]);
+        inv[i][j] ^= gfMul(factor, inv[col][j]);
+      }
+    }
+  }
+
+  // Solo se calculan los huecos; las filas fuente nunca son huecos
+  for (uint8_t j = 0; j < k; j++) {
+    if ((received >> j) & 1) continue;
+    uint8_t* out = frags[j];
+    memset(out, 0, BULK_FRAG_BYTES);
+    for (uint8_t i = 0; i < k; i++) {
+      uint8_t coef = inv[j][i];
+      if (coef == 0) continue;
+      const uint8_t* src = frags[rows[i]];
+      for (int b = 0; b < BULK_FRAG_BYTES; b++) out[b] ^= gfMul(coef, src[b]);
+    }
+    received |= 1ULL << j;
+  }
+  return true;
+}
+
+// --- Muestra ---
+enum AlertLevel {
+  AL_BAJA,
+  AL_MEDIA,
+  AL_ALTA,
+  AL_CRITICA
+};
+
+enum TelChannel {
+  TEL_TEMP,
+  TEL_HUM,
+  TEL_MQ2,
+  TEL_MQ135,
+  TEL_PM25,
+  TEL_VIENTO,
+  TEL_COUNT
+};
+
+// Muestra completa que viaja del núcleo de sensado a los de E/S
+struct SampleRecord {
+  uint32_t seq;
+  int64_t readUs;  // esp_timer_get_time() al empezar la lectura
+  float temperature;
+  float humidity;
+  float internalTemperature;
+  int mq2;
+  int mq135;
+  uint16_t pm1;     // µg/m³, condiciones atmosféricas
+  uint16_t pm25;
+  uint16_t pm10;
+  AlertLevel level;
+  bool dhtError;
+  bool ds18b20Error;
+  bool pmValid;     // false hasta la primera trama válida
+  float windKmh;    // media desde la muestra anterior
+  float gustKmh;    // máxima media de WIND_GUST_SECONDS en el mismo intervalo
+  uint16_t windDirDeg;
+  bool flame;
+  bool fastPath;    // muestra disparada por la interrupción de llama
+};
+
+const char* getAlertLevelString(AlertLevel level) {
+  switch (level) {
+    case AL_BAJA: return "BAJA";
+    case AL_MEDIA: return "MEDIA";
+    case AL_ALTA: return "ALTA";
+    case AL_CRITICA: return "CRITICA";
+    default: return "DESCONOCIDO";
+  }
+}
+
+// --- Bus de eventos ---
+// Cada tema fija en compilación su carga y sus suscriptores; publish() se
+// expande a una llamada estática por suscriptor, sin tablas ni memoria dinámica.
+template <typename Payload, typename... Subscribers>
+struct Topic {
+  static void publish(const Payload& payload) {
+    int expand[] = {0, (Subscribers::onEvent(payload), 0)...};
+    (void)expand;
+  }
+};
+
+// --- Registro de sensores ---
+constexpr size_t sumOf() { return 0; }
+template <typename... Rest>
+constexpr size_t sumOf(size_t first, Rest... rest) { return first + sumOf(rest...); }
+
+// La parte de SensorRegistry que solo formatea: cada driver aporta sus
+// columnas de log y sus campos de radio, en el orden de la lista
+template <typename... Drivers>
+struct SensorColumns {
+  // Peor caso de appendLogColumns y appendRadioFields, para los static_assert
+  // de los llamantes
+  static constexpr size_t kLogMax = sumOf(Drivers::kLogMax...);
+  static constexpr size_t kRadioMax = sumOf(Drivers::kRadioMax...);
+
+  static char* appendLogHeader(char* out, char* end) {
+    int expand[] = {0, (out = appendStr(out, end, Drivers::logColumns()), 0)...};
+    (void)expand;
+    return out;
+  }
+
+  static char* appendLogColumns(char* out, char* end, const SampleRecord& sample) {
+    int expand[] = {0, (out = Drivers::appendLog(out, end, sample), 0)...};
+    (void)expand;
+    return out;
+  }
+
+  static char* appendRadioFields(char* out, char* end, const SampleRecord& sample) {
+    int expand[] = {0, (out = Drivers::appendRadio(out, end, sample), 0)...};
+    (void)expand;
+    return out;
+  }
+};
+
+// --- Resumen diario ---
+// Un registro de tamaño fijo por día. El formato lo comparten el firmware y
+// tools/resumen_diario: cambiarlo deja ilegibles los ficheros ya escritos.
+#define DAILY_MAGIC 0x44435652          // "RVCD"
+#define ZONA_HORARIA "CET-1CEST,M3.5.0,M10.5.0/3"  // la fecha de cada día es la local
+#define RELOJ_VALIDO_DESDE 1577836800  // 2020-01-01: antes, el reloj no está en hora
+#define DAILY_CSV_HEADER "dia,tmin,tmax,hmin,mq2max,mq135max,pm25max,vmax,min_alerta,fwi"
+
+struct DailySummary {
+  uint32_t magic;
+  int32_t day;      // localDay()
+  uint32_t startS;  // time() de la primera muestra del día
+  uint32_t samples;
+  float min[TEL_COUNT];
+  float max[TEL_COUNT];
+  float mean[TEL_COUNT];
+  uint32_t secondsAtLevel[AL_CRITICA + 1];
+  uint16_t dhtErrors;
+  uint16_t ds18b20Errors;
+  uint16_t pmInvalid;
+  uint16_t flameEvents;
+  float fwi;        // índice del día al cerrar el resumen
+  uint32_t crc;     // CRC-32 de todo lo anterior
+};
+static_assert(sizeof(DailySummary) == 120, "DailySummary cambia el formato del fichero");
+
+// CRC-32 de zlib, el mismo que esp_rom_crc32_le(0, ...). El firmware usa el
+// del ROM; este es para leer en el host lo que el firmware escribe.
+uint32_t crc32Le(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    for (int b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+bool dailySummaryValid(const DailySummary& s) {
+  return s.magic == DAILY_MAGIC &&
+         s.crc == crc32Le(0, (const uint8_t*)&s, offsetof(DailySummary, crc));
+}
+
+// Línea CSV de DAILY_CSV_HEADER, sin salto de línea. Sin reloj en hora el día
+// se muestra como d<día del año>.
+int dailySummaryRow(const DailySummary& s, char* out, size_t size) {
+  char date[16];
+  time_t start = s.startS;
+  struct tm t;
+  localtime_r(&start, &t);
+  if (start >= RELOJ_VALIDO_DESDE) {
+    strftime(date, sizeof(date), "%Y-%m-%d", &t);
+  } else {
+    snprintf(date, sizeof(date), "d%d", (int)(s.day % 366));
+  }
+  uint32_t alertS = s.secondsAtLevel[AL_MEDIA] + s.secondsAtLevel[AL_ALTA] +
+                    s.secondsAtLevel[AL_CRITICA];
+  return snprintf(out, size, "%s,%.1f,%.1f,%.1f,%.0f,%.0f,%.0f,%.1f,%u,%.1f", date,
+                  s.min[TEL_TEMP], s.max[TEL_TEMP], s.min[TEL_HUM], s.max[TEL_MQ2],
+                  s.max[TEL_MQ135], s.max[TEL_PM25], s.max[TEL_VIENTO],
+                  (unsigned)(alertS / 60), s.fwi);
+}
+
+// --- Respaldo en flash ---
+// Registro de respaldo mientras no hay SD. Dos segmentos en anillo: al llenarse
+// el activo pasa a ser el antiguo y se descarta el anterior. Los registros se
+// agrupan en RAM para que cada escritura a flash sea de FALLBACK_BATCH_BYTES y
+// no de una línea.
+//
+// La migración copia siempre el segmento antiguo (renombrando antes el activo si
+// no lo hay) desde la posición guardada en posPath, que avanza solo tras un
+// sync() del destino y siempre al final de una línea (o de un registro, con
+// recordBytes): una migración cortada se reanuda sin duplicar lo que ya está a
+// salvo en la SD.
+//
+// Fs: exists, size, append, read, remove, rename, writeAll y nowUs (LittleFsAdapter
+// en el firmware, el emulador de flash en test/). Sink: write y sync.
+#define FALLBACK_SEGMENT_BYTES 65536
+#define FALLBACK_BATCH_BYTES 512
+#define FALLBACK_SYNC_BYTES 8192  // migración: por defecto, se sincroniza el destino y se guarda la posición
+
+struct FallbackStats {
+  uint32_t flashWrites;
+  uint64_t bytes;
+  int64_t maxWriteUs;
+  int64_t totalWriteUs;
+  uint32_t rotations;  // cada una descarta el segmento antiguo
+  uint32_t migrated;   // bytes copiados al destino
+};
+
+template <typename Fs>
+class FallbackLog {
+ public:
+  // recordBytes: 0 para líneas de texto, o el tamaño de los registros binarios.
+  // syncBytes: cada cuánto se sincroniza el destino y se guarda la posición; lo
+  // que se repite tras un fallo es como mucho eso.
+  FallbackLog(Fs& fs, const char* activePath, const char* oldPath, const char* posPath,
+              size_t recordBytes = 0, uint32_t syncBytes = FALLBACK_SYNC_BYTES)
+      : fs_(fs), active_(activePath), old_(oldPath), pos_(posPath), recordBytes_(recordBytes),
+        syncBytes_(syncBytes), len_(0), stats_() {}
+
+  bool append(const void* data, size_t len) {
+    if (len > FALLBACK_BATCH_BYTES) return false;
+    if (len_ + len > FALLBACK_BATCH_BYTES && !flush()) return false;
+    memcpy(buf_ + len_, data, len);
+    len_ += len;
+    return true;
+  }
+
+  bool flush() {
+    if (len_ == 0) return true;
+    int64_t start = fs_.nowUs();
+    uint32_t size = 0;
+    size_t written = fs_.append(active_, buf_, len_, size);
+    if (written != len_) return false;
+
+    int64_t elapsed = fs_.nowUs() - start;
+    stats_.flashWrites++;
+    stats_.bytes += written;
+    stats_.totalWriteUs += elapsed;
+    if (elapsed > stats_.maxWriteUs) stats_.maxWriteUs = elapsed;
+    len_ = 0;
+
+    if (size >= FALLBACK_SEGMENT_BYTES) {
+      fs_.remove(old_);
+      fs_.remove(pos_);  // la posición era del segmento descartado
+      fs_.rename(active_, old_);
+      stats_.rotations++;
+    }
+    return true;
+  }
+
+  // Bytes en flash pendientes de migrar, en orden: el antiguo desde la posición
+  // guardada y después el activo. Llamar tras flush() para incluir el lote.
+  uint32_t size() {
+    uint32_t oldSize = fs_.exists(old_) ? fs_.size(old_) : 0;
+    uint32_t pos = loadPos();
+    return (oldSize > pos ? oldSize - pos : 0) + (fs_.exists(active_) ? fs_.size(active_) : 0);
+  }
+
+  size_t read(uint32_t offset, uint8_t* buf, size_t len) {
+    uint32_t oldSize = fs_.exists(old_) ? fs_.size(old_) : 0;
+    uint32_t pos = loadPos();
+    uint32_t oldLeft = oldSize > pos ? oldSize - pos : 0;
+    if (offset < oldLeft) {
+      if (len > oldLeft - offset) len = oldLeft - offset;
+      return fs_.read(old_, pos + offset, buf, len);
+    }
+    return fs_.read(active_, offset - oldLeft, buf, len);
+  }
+
+  template <typename Sink>
+  bool migrate(Sink& sink) {
+    if (!flush()) return false;
+    for (int pass = 0; pass < 2; pass++) {
+      if (!fs_.exists(old_)) {
+        if (!fs_.exists(active_)) return true;
+        if (!fs_.rename(active_, old_)) return false;
+      }
+      if (!copyOld(sink)) return false;
+    }
+    return true;
+  }
+
+  const FallbackStats& stats() const { return stats_; }
+
+ private:
+  template <typename Sink>
+  bool copyOld(Sink& sink) {
+    uint8_t chunk[FALLBACK_BATCH_BYTES];
+    uint32_t pos = loadPos();
+    uint32_t unsynced = 0;
+    for (;;) {
+      size_t n = fs_.read(old_, pos + unsynced, chunk, sizeof(chunk));
+      if (n == 0) break;
+      // Se corta en el último registro completo: la posición guardada queda siempre
+      // entre registros y, si el segmento se descarta, no llega medio a la SD
+      size_t whole = n;
+      if (recordBytes_) {
+        whole -= whole % recordBytes_;
+      } else {
+        while (whole > 0 && chunk[whole - 1] != '\n') whole--;
+      }
+      if (whole > 0) n = whole;
+      if (!sink.write(chunk, n)) return false;
+      unsynced += n;
+      if (unsynced >= syncBytes_) {
+        if (!sink.sync()) return false;
+        pos += unsynced;
+        stats_.migrated += unsynced;
+        unsynced = 0;
+        storePos(pos);
+      }
+    }
+    if (!sink.sync()) return false;
+    stats_.migrated += unsynced;
+    fs_.remove(old_);
+    fs_.remove(pos_);
+    return true;
+  }
+
+  uint32_t loadPos() {
+    uint32_t pos = 0;
+    if (fs_.read(pos_, 0, (uint8_t*)&pos, sizeof(pos)) != sizeof(pos)) return 0;
+    return pos;
+  }
+
+  void storePos(uint32_t pos) { fs_.writeAll(pos_, (const uint8_t*)&pos, sizeof(pos)); }
+
+  Fs& fs_;
+  const char* active_;
+  const char* old_;
+  const char* pos_;
+  size_t recordBytes_;
+  uint32_t syncBytes_;
+  uint8_t buf_[FALLBACK_BATCH_BYTES];
+  size_t len_;
+  FallbackStats stats_;
+};
+
+// --- Registro crudo en anillo ---
+// Modo crudo para tarjetas dedicadas: registros de 32 bytes con CRC, 16 por
+// sector, en un anillo de sectores tras un superbloque con cabeza y cola. Cada
+// anexado reescribe solo el sector en curso y, cada superblockEvery sectores
+// completados, el superbloque. El formato lo comparten el firmware y
+// tools/raw2csv.
+#define RAW_SECTOR_SIZE 512
+#define RAW_MAGIC 0x4C525643  // "CVRL"
+#define RAW_CSV_HEADER \
+  "seq,t_s,temp,hum,temp_int,mq2,mq135,pm25,viento,racha,dir,error_dht,error_ds18b20," \
+  "pm_valido,llama,nivel"
+
+struct RawRecord {
+  uint32_t seq;
+  uint32_t timeS;
+  int16_t temperature10;  // décimas de °C
+  int16_t humidity10;     // décimas de %
+  int16_t internal10;
+  uint16_t mq2;
+  uint16_t mq135;
+  uint8_t level;
+  uint8_t flags;          // bit0: error DHT22, bit1: error DS18B20, bit2: PM válido, bit3: llama
+  uint16_t pm25;
+  uint16_t wind10;        // décimas de km/h
+  uint16_t gust10;
+  uint16_t windDir;
+  uint32_t crc;           // CRC-32 de los bytes anteriores
+};
+static_assert(sizeof(RawRecord) == 32, "RawRecord debe ocupar 32 bytes");
+#define RAW_RECORDS_PER_SECTOR (RAW_SECTOR_SIZE / sizeof(RawRecord))
+
+struct RawSuperblock {
+  uint32_t magic;
+  uint32_t sectorCount;  // sectores de datos en el anillo
+  uint32_t head;         // sector en curso, relativo al primero de datos
+  uint32_t tail;         // sector más antiguo con datos
+  uint32_t nextSeq;      // secuencia del primer registro de head
+  uint32_t crc;
+};
+
+// Sin seq ni crc: los pone RawRing::append()
+RawRecord rawEncode(const SampleRecord& sample) {
+  RawRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.timeS = (uint32_t)(sample.readUs / 1000000);
+  rec.temperature10 = (int16_t)lroundf(sample.temperature * 10);
+  rec.humidity10 = (int16_t)lroundf(sample.humidity * 10);
+  rec.internal10 = (int16_t)lroundf(sample.internalTemperature * 10);
+  rec.mq2 = sample.mq2;
+  rec.mq135 = sample.mq135;
+  rec.level = sample.level;
+  rec.flags = (sample.dhtError ? 1 : 0) | (sample.ds18b20Error ? 2 : 0) | (sample.pmValid ? 4 : 0) |
+              (sample.flame ? 8 : 0);
+  rec.pm25 = sample.pm25;
+  rec.wind10 = (uint16_t)lroundf(sample.windKmh * 10);
+  rec.gust10 = (uint16_t)lroundf(sample.gustKmh * 10);
+  rec.windDir = sample.windDirDeg;
+  return rec;
+}
+
+bool rawRecordValid(const RawRecord& rec) {
+  return rec.crc == crc32Le(0, (const uint8_t*)&rec, offsetof(RawRecord, crc));
+}
+
+// Línea de RAW_CSV_HEADER con salto de línea; devuelve end si no cabe
+char* appendRawCsv(char* out, char* end, const RawRecord& rec) {
+  out = formatUint(out, end, rec.seq);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, rec.timeS);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, rec.temperature10 / 10.0f, 1);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, rec.humidity10 / 10.0f, 1);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, rec.internal10 / 10.0f, 1);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, rec.mq2);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, rec.mq135);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, rec.pm25);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, rec.wind10 / 10.0f, 1);
+  out = appendChar(out, end, ',');
+  out = formatFixed(out, end, rec.gust10 / 10.0f, 1);
+  out = appendChar(out, end, ',');
+  out = formatUint(out, end, rec.windDir);
+  for (int bit = 0; bit < 4; bit++) {
+    out = appendChar(out, end, ',');
+    out = appendChar(out, end, (rec.flags >> bit) & 1 ? '1' : '0');
+  }
+  out = appendChar(out, end, ',');
+  out = appendStr(out, end, getAlertLevelString((AlertLevel)rec.level));
+  return appendChar(out, end, '\n');
+}
+
+enum RawMountResult {
+  RAW_MONTADO,
+  RAW_SIN_ANILLO,     // superbloque ausente o de otra tarjeta: hay que formatear
+  RAW_ERROR_LECTURA
+};
+
+// Dev: sectors(), readSector(lba, buf) y writeSector(lba, buf): sd_diskio en el
+// firmware, una imagen de la tarjeta en tools/raw2csv y en test/
+template <typename Dev>
+class RawRing {
+ public:
+  RawRing(Dev& dev, uint32_t firstSector, uint32_t superblockEvery)
+      : dev_(dev), first_(firstSector), every_(superblockEvery), used_(0), sinceSb_(0) {
+    memset(&sb_, 0, sizeof(sb_));
+    memset(sector_, 0xFF, sizeof(sector_));
+  }
+
+  // Solo lee. Con un superbloque válido recupera la posición avanzando desde
+  // head por los sectores completados después de su última actualización.
+  RawMountResult mount() {
+    uint32_t total = dev_.sectors();
+    uint8_t buf[RAW_SECTOR_SIZE];
+    if (total <= first_ + 2 || !dev_.readSector(first_, buf)) return RAW_ERROR_LECTURA;
+    memcpy(&sb_, buf, sizeof(sb_));
+    if (sb_.magic != RAW_MAGIC || sb_.crc != superblockCrc(sb_) ||
+        sb_.sectorCount != total - first_ - 1 || sb_.head >= sb_.sectorCount ||
+        sb_.tail >= sb_.sectorCount) {
+      return RAW_SIN_ANILLO;
+    }
+
+    sinceSb_ = 0;
+    for (uint32_t scanned = 0; scanned <= every_; scanned++) {
+      if (!dev_.readSector(dataLba(sb_.head), (uint8_t*)sector_)) return RAW_ERROR_LECTURA;
+      used_ = 0;
+      while (used_ < RAW_RECORDS_PER_SECTOR && sector_[used_].seq == sb_.nextSeq + used_ &&
+             rawRecordValid(sector_[used_])) {
+        used_++;
+      }
+      if (used_ < RAW_RECORDS_PER_SECTOR) break;
+      nextSector();
+      // Cuentan para el próximo superbloque: si no, otro corte podría dejar
+      // la cabeza más allá de lo que recorre la siguiente recuperación
+      sinceSb_++;
+    }
+    memset((uint8_t*)sector_ + used_ * sizeof(RawRecord), 0xFF,
+           (RAW_RECORDS_PER_SECTOR - used_) * sizeof(RawRecord));
+    return RAW_MONTADO;
+  }
+
+  bool format() {
+    sb_.magic = RAW_MAGIC;
+    sb_.sectorCount = dev_.sectors() - first_ - 1;
+    sb_.head = 0;
+    sb_.tail = 0;
+    sb_.nextSeq = 1;
+    used_ = 0;
+    memset(sector_, 0xFF, sizeof(sector_));
+    return storeSuperblock();
+  }
+
+  bool storeSuperblock() {
+    uint8_t buf[RAW_SECTOR_SIZE];
+    memset(buf, 0, sizeof(buf));
+    sb_.crc = superblockCrc(sb_);
+    memcpy(buf, &sb_, sizeof(sb_));
+    sinceSb_ = 0;
+    return dev_.writeSector(first_, buf);
+  }
+
+  // Tiempo constante: una escritura de sector y, cada superblockEvery
+  // sectores completados, otra del superbloque
+  bool append(RawRecord rec) {
+    rec.seq = sb_.nextSeq + used_;
+    rec.crc = crc32Le(0, (const uint8_t*)&rec, offsetof(RawRecord, crc));
+    sector_[used_] = rec;
+    if (!dev_.writeSector(dataLba(sb_.head), (const uint8_t*)sector_)) return false;
+    if (++used_ < RAW_RECORDS_PER_SECTOR) return true;
+
+    nextSector();
+    memset(sector_, 0xFF, sizeof(sector_));
+    if (++sinceSb_ >= every_) return storeSuperblock();
+    return true;
+  }
+
+  // Los registros guardados como secuencia de bytes, del más antiguo al más
+  // reciente. El más antiguo avanza al dar la vuelta: el receptor se guía por seq.
+  uint32_t size() const {
+    uint32_t sectors = (sb_.head + sb_.sectorCount - sb_.tail) % sb_.sectorCount;
+    return (sectors * RAW_RECORDS_PER_SECTOR + used_) * sizeof(RawRecord);
+  }
+
+  size_t read(uint32_t offset, uint8_t* buf, size_t len) {
+    uint32_t total = size();
+    if (offset >= total) return 0;
+    if (len > total - offset) len = total - offset;
+    uint8_t sector[RAW_SECTOR_SIZE];
+    size_t done = 0;
+    while (done < len) {
+      uint32_t at = offset + done;
+      uint32_t index = (sb_.tail + at / RAW_SECTOR_SIZE) % sb_.sectorCount;
+      uint32_t within = at % RAW_SECTOR_SIZE;
+      const uint8_t* src = (const uint8_t*)sector_;
+      if (index != sb_.head) {
+        if (!dev_.readSector(dataLba(index), sector)) break;
+        src = sector;
+      }
+      size_t n = RAW_SECTOR_SIZE - within;
+      if (n > len - done) n = len - done;
+      memcpy(buf + done, src + within, n);
+      done += n;
+    }
+    return done;
+  }
+
+  const RawSuperblock& superblock() const { return sb_; }
+  uint32_t nextSeq() const { return sb_.nextSeq + used_; }
+
+ private:
+  static uint32_t superblockCrc(const RawSuperblock& sb) {
+    return crc32Le(0, (const uint8_t*)&sb, offsetof(RawSuperblock, crc));
+  }
+
+  uint32_t dataLba(uint32_t index) const { return first_ + 1 + index; }
+
+  void nextSector() {
+    sb_.nextSeq += RAW_RECORDS_PER_SECTOR;
+    sb_.head = (sb_.head + 1) % sb_.sectorCount;
+    if (sb_.head == sb_.tail) sb_.tail = (sb_.tail + 1) % sb_.sectorCount;
+    used_ = 0;
+  }
+
+  Dev& dev_;
+  uint32_t first_;
+  uint32_t every_;
+  RawSuperblock sb_;
+  RawRecord sector_[RAW_RECORDS_PER_SECTOR];
+  uint32_t used_;
+  uint32_t sinceSb_;
+};
+
+#endif  // CENTINELA_NUCLEO_H
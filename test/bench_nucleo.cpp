@@ -0,0 +1,439 @@
+// Tiempos en el host de las piezas de nucleo.h que sustituyeron código más
+// lento: make -C test bench. Los números sirven para comparar entre sí las
+// variantes de cada caso; en el ESP32 los absolutos son otros.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../nucleo.h"
+
+static double nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Mejor de varias pasadas, en ns por iteración: el mínimo descarta las
+// interrupciones del sistema
+template <typename F>
+static double timeNs(uint32_t iterations, F body) {
+  double best = 1e30;
+  for (int pass = 0; pass < 5; pass++) {
+    double start = nowNs();
+    for (uint32_t i = 0; i < iterations; i++) body(i);
+    double ns = (nowNs() - start) / iterations;
+    if (ns < best) best = ns;
+  }
+  return best;
+}
+
+static uint32_t sink = 0;  // el compilador no puede descartar lo que acaba aquí
+
+static void consume(const char* s, size_t len) { sink += len + (uint8_t)s[len / 2]; }
+
+// --- Formato numérico ---
+// Lo mínimo de String de Arduino para reproducir la línea de log de antes:
+// memoria dinámica que crece en cada concatenación y String(x, d) con dtostrf,
+// que en el ESP32 es sprintf("%*.*f")
+class HostString {
+ public:
+  HostString(const char* s = "") : buf_(NULL), len_(0), cap_(0) { concat(s, strlen(s)); }
+  explicit HostString(uint32_t v) : buf_(NULL), len_(0), cap_(0) {
+    char tmp[12];
+    printed(tmp, snprintf(tmp, sizeof(tmp), "%u", v));
+  }
+  explicit HostString(int32_t v) : buf_(NULL), len_(0), cap_(0) {
+    char tmp[12];
+    printed(tmp, snprintf(tmp, sizeof(tmp), "%d", v));
+  }
+  HostString(float v, int decimals) : buf_(NULL), len_(0), cap_(0) {
+    char tmp[33];
+    printed(tmp, snprintf(tmp, sizeof(tmp), "%*.*f", decimals + 2, decimals, v));
+  }
+  HostString(const HostString& o)
+      : buf_((char*)malloc(o.len_ + 1)), len_(o.len_), cap_(o.len_ + 1) {
+    memcpy(buf_, o.buf_, len_ + 1);
+  }
+  ~HostString() { free(buf_); }
+
+  HostString& operator+=(const HostString& o) { return concat(o.buf_, o.len_); }
+  HostString& operator+=(const char* s) { return concat(s, strlen(s)); }
+  const char* c_str() const { return buf_; }
+  size_t length() const { return len_; }
+
+ private:
+  void printed(const char* tmp, int n) { concat(tmp, n > 0 ? n : 0); }
+
+  HostString& concat(const char* s, size_t n) {
+    if (len_ + n + 1 > cap_) {
+      cap_ = len_ + n + 1;
+      buf_ = (char*)realloc(buf_, cap_);
+      if (buf_ == NULL) abort();
+    }
+    memcpy(buf_ + len_, s, n);
+    len_ += n;
+    buf_[len_] = '\0';
+    return *this;
+  }
+
+  char* buf_;
+  size_t len_;
+  size_t cap_;
+};
+
+HostString operator+(HostString a, const HostString& b) { return a += b; }
+HostString operator+(HostString a, const char* b) { return a += b; }
+
+struct LogSample {
+  uint32_t timeS;
+  float temperature;
+  float humidity;
+  float internal;
+  int32_t mq2;
+  int32_t mq135;
+};
+
+static LogSample logSample(uint32_t i) {
+  LogSample s;
+  s.timeS = 1700000000u + i * 10;
+  s.temperature = 18.0f + (i % 211) * 0.13f;
+  s.humidity = 35.0f + (i % 97) * 0.41f;
+  s.internal = 24.0f + (i % 53) * 0.07f;
+  s.mq2 = 300 + (int32_t)(i % 1100);
+  s.mq135 = 250 + (int32_t)(i % 900);
+  return s;
+}
+
+static void benchFormat() {
+  const uint32_t n = 200000;
+  char line[128];
+  char* end = line + sizeof(line);
+
+  double tUint = timeNs(n, [&](uint32_t i) {
+    char* p = formatUint(line, end, i * 2654435761u);
+    consume(line, p - line);
+  });
+  double tUintPrintf = timeNs(n, [&](uint32_t i) {
+    consume(line, snprintf(line, sizeof(line), "%u", i * 2654435761u));
+  });
+  double tFixed = timeNs(n, [&](uint32_t i) {
+    char* p = formatFixed(line, end, logSample(i).temperature, 1);
+    consume(line, p - line);
+  });
+  double tFixedPrintf = timeNs(n, [&](uint32_t i) {
+    consume(line, snprintf(line, sizeof(line), "%.1f", logSample(i).temperature));
+  });
+  double tFixedString = timeNs(n, [&](uint32_t i) {
+    HostString s(logSample(i).temperature, 1);
+    consume(s.c_str(), s.length());
+  });
+
+  // La línea de log completa: tiempo, tres decimales, dos enteros y el nivel
+  double tLine = timeNs(n, [&](uint32_t i) {
+    LogSample s = logSample(i);
+    char* p = formatUint(line, end, s.timeS);
+    p = appendStr(p, end, "s,");
+    p = formatFixed(p, end, s.temperature, 1);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, s.humidity, 1);
+    p = appendChar(p, end, ',');
+    p = formatFixed(p, end, s.internal, 1);
+    p = appendChar(p, end, ',');
+    p = formatInt(p, end, s.mq2);
+    p = appendChar(p, end, ',');
+    p = formatInt(p, end, s.mq135);
+    p = appendChar(p, end, ',');
+    p = appendStr(p, end, getAlertLevelString(AL_MEDIA));
+    consume(line, p - line);
+  });
+  double tLinePrintf = timeNs(n, [&](uint32_t i) {
+    LogSample s = logSample(i);
+    consume(line, snprintf(line, sizeof(line), "%us,%.1f,%.1f,%.1f,%d,%d,%s", s.timeS,
+                           s.temperature, s.humidity, s.internal, s.mq2, s.mq135,
+                           getAlertLevelString(AL_MEDIA)));
+  });
+  double tLineString = timeNs(n, [&](uint32_t i) {
+    LogSample s = logSample(i);
+    HostString log = HostString(s.timeS) + "s," + HostString(s.temperature, 1) + "," +
+                     HostString(s.humidity, 1) + "," + HostString(s.internal, 1) + "," +
+                     HostString(s.mq2) + "," + HostString(s.mq135) + "," +
+                     getAlertLevelString(AL_MEDIA);
+    consume(log.c_str(), log.length());
+  });
+
+  printf("Formato (ns)          nucleo.h  snprintf  String\n");
+  printf("  entero              %8.1f  %8.1f       -\n", tUint, tUintPrintf);
+  printf("  un decimal          %8.1f  %8.1f  %6.1f\n", tFixed, tFixedPrintf, tFixedString);
+  printf("  linea de log        %8.1f  %8.1f  %6.1f\n", tLine, tLinePrintf, tLineString);
+}
+
+// --- Bus de eventos ---
+// Nueve suscriptores, como SampleTopic, cada uno con un trabajo mínimo: lo que
+// se mide es el despacho. Se compara con las llamadas escritas a mano, con una
+// tabla de punteros a función y con una interfaz virtual, que es lo que haría
+// un bus registrado en tiempo de ejecución.
+static uint32_t busState[9];
+
+template <int N>
+struct BenchSubscriber {
+  static void onEvent(const SampleRecord& s) { busState[N] += s.seq * (N + 1) + s.mq2; }
+};
+
+typedef Topic<SampleRecord, BenchSubscriber<0>, BenchSubscriber<1>, BenchSubscriber<2>,
+              BenchSubscriber<3>, BenchSubscriber<4>, BenchSubscriber<5>, BenchSubscriber<6>,
+              BenchSubscriber<7>, BenchSubscriber<8> > BenchTopic;
+
+struct VirtualSubscriber {
+  virtual ~VirtualSubscriber() {}
+  virtual void onEvent(const SampleRecord& s) = 0;
+};
+
+template <int N>
+struct VirtualBench : VirtualSubscriber {
+  void onEvent(const SampleRecord& s) override { BenchSubscriber<N>::onEvent(s); }
+};
+
+static void (*busHandlers[9])(const SampleRecord&);
+static VirtualSubscriber* busObjects[9];
+
+static void benchBus() {
+  const uint32_t n = 2000000;
+  SampleRecord sample;
+  memset(&sample, 0, sizeof(sample));
+
+  double tTopic = timeNs(n, [&](uint32_t i) {
+    sample.seq = i;
+    BenchTopic::publish(sample);
+  });
+  double tDirect = timeNs(n, [&](uint32_t i) {
+    sample.seq = i;
+    BenchSubscriber<0>::onEvent(sample);
+    BenchSubscriber<1>::onEvent(sample);
+    BenchSubscriber<2>::onEvent(sample);
+    BenchSubscriber<3>::onEvent(sample);
+    BenchSubscriber<4>::onEvent(sample);
+    BenchSubscriber<5>::onEvent(sample);
+    BenchSubscriber<6>::onEvent(sample);
+    BenchSubscriber<7>::onEvent(sample);
+    BenchSubscriber<8>::onEvent(sample);
+  });
+
+  void (*handlers[9])(const SampleRecord&) = {
+      BenchSubscriber<0>::onEvent, BenchSubscriber<1>::onEvent, BenchSubscriber<2>::onEvent,
+      BenchSubscriber<3>::onEvent, BenchSubscriber<4>::onEvent, BenchSubscriber<5>::onEvent,
+      BenchSubscriber<6>::onEvent, BenchSubscriber<7>::onEvent, BenchSubscriber<8>::onEvent};
+  memcpy(busHandlers, handlers, sizeof(handlers));
+  double tTable = timeNs(n, [&](uint32_t i) {
+    sample.seq = i;
+    for (int k = 0; k < 9; k++) busHandlers[k](sample);
+  });
+
+  VirtualBench<0> v0;
+  VirtualBench<1> v1;
+  VirtualBench<2> v2;
+  VirtualBench<3> v3;
+  VirtualBench<4> v4;
+  VirtualBench<5> v5;
+  VirtualBench<6> v6;
+  VirtualBench<7> v7;
+  VirtualBench<8> v8;
+  VirtualSubscriber* objects[9] = {&v0, &v1, &v2, &v3, &v4, &v5, &v6, &v7, &v8};
+  memcpy(busObjects, objects, sizeof(objects));
+  double tVirtual = timeNs(n, [&](uint32_t i) {
+    sample.seq = i;
+    for (int k = 0; k < 9; k++) busObjects[k]->onEvent(sample);
+  });
+  for (uint32_t s : busState) sink += s;
+
+  printf("Bus, 9 suscriptores (ns por evento)\n");
+  printf("  Topic::publish      %8.2f\n", tTopic);
+  printf("  llamadas a mano     %8.2f\n", tDirect);
+  printf("  punteros a funcion  %8.2f\n", tTable);
+  printf("  interfaz virtual    %8.2f\n", tVirtual);
+}
+
+// --- Registro de sensores ---
+// Los appendLog y appendRadio de los drivers del firmware, sin el hardware
+struct BenchDht22 {
+  static constexpr size_t kLogMax = 2 * (1 + FMT_FIXED_MAX(1));
+  static constexpr size_t kRadioMax = 2 * FMT_FIXED_MAX(1) + 10;
+  static const char* logColumns() { return ",temp,hum"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    out = formatFixed(out, end, s.temperature, 1);
+    out = appendChar(out, end, ',');
+    return formatFixed(out, end, s.humidity, 1);
+  }
+  static char* appendRadio(char* out, char* end, const SampleRecord& s) {
+    out = appendStr(out, end, ",Temp:");
+    out = formatFixed(out, end, s.temperature, 1);
+    out = appendStr(out, end, ",Hum:");
+    return formatFixed(out, end, s.humidity, 1);
+  }
+};
+
+struct BenchDs18b20 {
+  static constexpr size_t kLogMax = 1 + FMT_FIXED_MAX(1);
+  static constexpr size_t kRadioMax = 0;
+  static const char* logColumns() { return ",temp_interna"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    return formatFixed(out, end, s.internalTemperature, 1);
+  }
+  static char* appendRadio(char* out, char*, const SampleRecord&) { return out; }
+};
+
+struct BenchMq {
+  static constexpr size_t kLogMax = 2 * (1 + FMT_INT_MAX);
+  static constexpr size_t kRadioMax = 2 * FMT_INT_MAX + 11;
+  static const char* logColumns() { return ",mq2,mq135"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    out = formatInt(out, end, s.mq2);
+    out = appendChar(out, end, ',');
+    return formatInt(out, end, s.mq135);
+  }
+  static char* appendRadio(char* out, char* end, const SampleRecord& s) {
+    out = appendStr(out, end, ",MQ2:");
+    out = formatInt(out, end, s.mq2);
+    out = appendStr(out, end, ",MQ135:");
+    return formatInt(out, end, s.mq135);
+  }
+};
+
+struct BenchPms5003 {
+  static constexpr size_t kLogMax = 3 * (1 + FMT_U16_MAX);
+  static constexpr size_t kRadioMax = 6 + FMT_U16_MAX;
+  static const char* logColumns() { return ",pm1,pm25,pm10"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    out = formatUint(out, end, s.pm1);
+    out = appendChar(out, end, ',');
+    out = formatUint(out, end, s.pm25);
+    out = appendChar(out, end, ',');
+    return formatUint(out, end, s.pm10);
+  }
+  static char* appendRadio(char* out, char* end, const SampleRecord& s) {
+    if (!s.pmValid) return out;
+    out = appendStr(out, end, ",PM25:");
+    return formatUint(out, end, s.pm25);
+  }
+};
+
+struct BenchFlame {
+  static constexpr size_t kLogMax = 2;
+  static constexpr size_t kRadioMax = 8;
+  static const char* logColumns() { return ",llama"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    return appendChar(out, end, s.flame ? '1' : '0');
+  }
+  static char* appendRadio(char* out, char* end, const SampleRecord& s) {
+    return s.flame ? appendStr(out, end, ",Llama:1") : out;
+  }
+};
+
+struct BenchWind {
+  static constexpr size_t kLogMax = 2 * (1 + FMT_FIXED_MAX(1)) + 1 + FMT_U16_MAX;
+  static constexpr size_t kRadioMax = 2 * FMT_FIXED_MAX(1) + FMT_U16_MAX + 19;
+  static const char* logColumns() { return ",viento,racha,dir_viento"; }
+  static char* appendLog(char* out, char* end, const SampleRecord& s) {
+    out = appendChar(out, end, ',');
+    out = formatFixed(out, end, s.windKmh, 1);
+    out = appendChar(out, end, ',');
+    out = formatFixed(out, end, s.gustKmh, 1);
+    out = appendChar(out, end, ',');
+    return formatUint(out, end, s.windDirDeg);
+  }
+  static char* appendRadio(char* out, char* end, const SampleRecord& s) {
+    out = appendStr(out, end, ",Viento:");
+    out = formatFixed(out, end, s.windKmh, 1);
+    out = appendStr(out, end, ",Racha:");
+    out = formatFixed(out, end, s.gustKmh, 1);
+    out = appendStr(out, end, ",Dir:");
+    return formatUint(out, end, s.windDirDeg);
+  }
+};
+
+typedef SensorColumns<BenchDht22, BenchDs18b20, BenchMq, BenchPms5003, BenchFlame, BenchWind>
+    BenchSensors;
+
+static SampleRecord registrySample(uint32_t i) {
+  SampleRecord s;
+  memset(&s, 0, sizeof(s));
+  LogSample l = logSample(i);
+  s.temperature = l.temperature;
+  s.humidity = l.humidity;
+  s.internalTemperature = l.internal;
+  s.mq2 = l.mq2;
+  s.mq135 = l.mq135;
+  s.pm1 = i % 40;
+  s.pm25 = i % 60;
+  s.pm10 = i % 90;
+  s.pmValid = true;
+  s.flame = (i & 7) == 0;
+  s.windKmh = (i % 300) * 0.1f;
+  s.gustKmh = (i % 450) * 0.1f;
+  s.windDirDeg = (i * 45) % 360;
+  return s;
+}
+
+static void benchRegistry() {
+  const uint32_t n = 200000;
+  char log[256];
+  char radio[256];
+  char* logEnd = log + sizeof(log);
+  char* radioEnd = radio + sizeof(radio);
+  uint32_t mismatches = 0;
+
+  double tRegistry = timeNs(n, [&](uint32_t i) {
+    SampleRecord s = registrySample(i);
+    char* p = BenchSensors::appendLogColumns(log, logEnd, s);
+    char* q = BenchSensors::appendRadioFields(radio, radioEnd, s);
+    consume(log, p - log);
+    consume(radio, q - radio);
+  });
+  double tManual = timeNs(n, [&](uint32_t i) {
+    SampleRecord s = registrySample(i);
+    char* p = BenchDht22::appendLog(log, logEnd, s);
+    p = BenchDs18b20::appendLog(p, logEnd, s);
+    p = BenchMq::appendLog(p, logEnd, s);
+    p = BenchPms5003::appendLog(p, logEnd, s);
+    p = BenchFlame::appendLog(p, logEnd, s);
+    p = BenchWind::appendLog(p, logEnd, s);
+    char* q = BenchDht22::appendRadio(radio, radioEnd, s);
+    q = BenchDs18b20::appendRadio(q, radioEnd, s);
+    q = BenchMq::appendRadio(q, radioEnd, s);
+    q = BenchPms5003::appendRadio(q, radioEnd, s);
+    q = BenchFlame::appendRadio(q, radioEnd, s);
+    q = BenchWind::appendRadio(q, radioEnd, s);
+    consume(log, p - log);
+    consume(radio, q - radio);
+  });
+
+  // Misma salida byte a byte, o la comparación no vale
+  for (uint32_t i = 0; i < 1000; i++) {
+    SampleRecord s = registrySample(i);
+    char manual[256];
+    char* p = BenchSensors::appendLogColumns(log, logEnd, s);
+    char* m = BenchDht22::appendLog(manual, manual + sizeof(manual), s);
+    m = BenchDs18b20::appendLog(m, manual + sizeof(manual), s);
+    m = BenchMq::appendLog(m, manual + sizeof(manual), s);
+    m = BenchPms5003::appendLog(m, manual + sizeof(manual), s);
+    m = BenchFlame::appendLog(m, manual + sizeof(manual), s);
+    m = BenchWind::appendLog(m, manual + sizeof(manual), s);
+    if (p - log != m - manual || memcmp(log, manual, p - log) != 0) mismatches++;
+  }
+
+  printf("Registro, 6 drivers: log y radio (ns por muestra)\n");
+  printf("  SensorColumns       %8.1f\n", tRegistry);
+  printf("  llamadas a mano     %8.1f\n", tManual);
+  if (mismatches) printf("  %u lineas distintas!\n", mismatches);
+}
+
+int main() {
+  benchFormat();
+  benchBus();
+  benchRegistry();
+  printf("(control %u)\n", sink);
+  return 0;
+}
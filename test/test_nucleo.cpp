@@ -0,0 +1,1945 @@
+// Pruebas en el host de la lógica pura de nucleo.h: make -C test
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "../nucleo.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond)                                                \
+  do {                                                             \
+    checks++;                                                      \
+    if (!(cond)) {                                                 \
+      failures++;                                                  \
+      printf("%s:%d: fallo: %s\n", __FILE__, __LINE__, #cond);     \
+    }                                                              \
+  } while (0)
+
+#define CHECK_NEAR(a, b, tol)                                                           \
+  do {                                                                                  \
+    checks++;                                                                           \
+    double va = (a), vb = (b);                                                          \
+    if (!(fabs(va - vb) <= (tol))) {                                                    \
+      failures++;                                                                       \
+      printf("%s:%d: fallo: %s = %g, esperado %g\n", __FILE__, __LINE__, #a, va, vb);   \
+    }                                                                                   \
+  } while (0)
+
+// --- Vigilancia ULP ---
+// Los valores de GAS_UMBRAL_*, ULP_SUBIDA_* y umbral menos ULP_REARME_* del firmware
+static const UlpWatchConfig kUlpCfg = {1500, 1200, 300, 250, 1350, 1080};
+
+// Un ciclo de la ULP con los dos umbrales armados
+static UlpTrigger ulpOnce(uint16_t prev2, uint16_t mq2, uint16_t prev135, uint16_t mq135) {
+  UlpWatchState st = {prev2, prev135, true, true};
+  return ulpWatchModel(kUlpCfg, st, mq2, mq135);
+}
+
+// Recorre una traza como el programa ULP, desde la primera lectura y armado
+static int ulpFirstWake(const uint16_t* mq2, const uint16_t* mq135, int n, UlpTrigger& trigger) {
+  UlpWatchState st = {mq2[0], mq135[0], true, true};
+  for (int i = 1; i < n; i++) {
+    trigger = ulpWatchModel(kUlpCfg, st, mq2[i], mq135[i]);
+    if (trigger != ULP_SIN_DISPARO) return i;
+  }
+  trigger = ULP_SIN_DISPARO;
+  return -1;
+}
+
+// Despertares en una traza de MQ2 muestreada por la ULP. La CPU no corrobora
+// y vuelve a dormir con su lectura, promediada y sin el ruido de la ULP; con
+// levelTriggered el umbral se queda siempre armado, como antes del rearme.
+static int ulpWakes(const std::vector<uint16_t>& mq2, const std::vector<uint16_t>& cpu,
+                    bool levelTriggered) {
+  UlpWatchState st = {cpu[0], 300, false, true};
+  st.mq2Armado = ulpRearm(cpu[0], kUlpCfg.mq2Umbral, kUlpCfg.mq2Rearme, true, false);
+  int wakes = 0;
+  for (size_t i = 0; i < mq2.size(); i++) {
+    if (levelTriggered) st.mq2Armado = true;
+    UlpTrigger trigger = ulpWatchModel(kUlpCfg, st, mq2[i], 300);
+    if (trigger == ULP_SIN_DISPARO) continue;
+    wakes++;
+    st.mq2Armado = ulpRearm(cpu[i], kUlpCfg.mq2Umbral, kUlpCfg.mq2Rearme, st.mq2Armado,
+                            trigger == ULP_MQ2_UMBRAL);
+    st.mq2Previo = cpu[i];
+  }
+  return wakes;
+}
+
+// Una hora a 4 Hz alrededor de mean con ruido de ±noise (pseudoaleatorio, fijo)
+static void ulpTrace(std::vector<uint16_t>& ulp, std::vector<uint16_t>& cpu, int mean, int noise,
+                     int cpuMean) {
+  for (uint32_t i = 0; i < 4 * 3600; i++) {
+    int jitter = (int)((i * 2654435761u >> 16) % (2 * noise + 1)) - noise;
+    ulp.push_back(mean + jitter);
+    cpu.push_back(cpuMean);
+  }
+}
+
+static void testUlpWatch() {
+  CHECK(ulpOnce(400, 400, 300, 300) == ULP_SIN_DISPARO);
+  // Umbral estricto: igual no dispara
+  CHECK(ulpOnce(1500, 1500, 300, 300) == ULP_SIN_DISPARO);
+  CHECK(ulpOnce(1500, 1501, 300, 300) == ULP_MQ2_UMBRAL);
+  CHECK(ulpOnce(400, 700, 300, 300) == ULP_SIN_DISPARO);
+  CHECK(ulpOnce(400, 701, 300, 300) == ULP_MQ2_SUBIDA);
+  CHECK(ulpOnce(400, 400, 300, 1201) == ULP_MQ135_UMBRAL);
+  CHECK(ulpOnce(400, 400, 300, 550) == ULP_SIN_DISPARO);
+  CHECK(ulpOnce(400, 400, 300, 551) == ULP_MQ135_SUBIDA);
+  // Orden del programa: MQ2 antes que MQ135, umbral antes que subida
+  CHECK(ulpOnce(400, 1600, 300, 1300) == ULP_MQ2_UMBRAL);
+  CHECK(ulpOnce(400, 800, 300, 1300) == ULP_MQ2_SUBIDA);
+  // Una bajada no es subida (en la ULP la resta no desborda)
+  CHECK(ulpOnce(1400, 100, 1100, 100) == ULP_SIN_DISPARO);
+
+  // Desarmado, el umbral no despierta pero la subida sí; bajo el rearme se arma
+  UlpWatchState st = {1600, 300, false, true};
+  CHECK(ulpWatchModel(kUlpCfg, st, 1650, 300) == ULP_SIN_DISPARO);
+  CHECK(ulpWatchModel(kUlpCfg, st, 1400, 300) == ULP_SIN_DISPARO);
+  CHECK(!st.mq2Armado);
+  CHECK(ulpWatchModel(kUlpCfg, st, 1750, 300) == ULP_MQ2_SUBIDA);
+  st.mq2Previo = 1600;
+  CHECK(ulpWatchModel(kUlpCfg, st, kUlpCfg.mq2Rearme - 1, 300) == ULP_SIN_DISPARO);
+  CHECK(st.mq2Armado);
+  CHECK(ulpWatchModel(kUlpCfg, st, 1501, 300) == ULP_MQ2_UMBRAL);
+
+  // Armado al volver a dormir
+  CHECK(ulpRearm(1200, 1500, 1350, false, true));
+  CHECK(!ulpRearm(1501, 1500, 1350, true, false));
+  CHECK(ulpRearm(1400, 1500, 1350, true, false));
+  CHECK(!ulpRearm(1400, 1500, 1350, true, true));
+  CHECK(!ulpRearm(1400, 1500, 1350, false, false));
+
+  // Subida lenta: no despierta por pendiente, sí al cruzar el umbral
+  const uint16_t slow2[] = {900, 1100, 1300, 1450, 1550};
+  const uint16_t flat135[] = {300, 300, 300, 300, 300};
+  UlpTrigger trigger;
+  CHECK(ulpFirstWake(slow2, flat135, 5, trigger) == 4);
+  CHECK(trigger == ULP_MQ2_UMBRAL);
+  // Humo repentino bajo el umbral: despierta por pendiente
+  const uint16_t jump2[] = {500, 520, 900, 950, 980};
+  CHECK(ulpFirstWake(jump2, flat135, 5, trigger) == 2);
+  CHECK(trigger == ULP_MQ2_SUBIDA);
+  // Ruido de ±50 alrededor del reposo: nunca despierta
+  const uint16_t noise2[] = {600, 650, 560, 640, 590};
+  const uint16_t noise135[] = {400, 380, 450, 410, 430};
+  CHECK(ulpFirstWake(noise2, noise135, 5, trigger) == -1);
+
+  // Una hora de gas alto sin corroborar: la ULP justo sobre el umbral y la CPU
+  // justo debajo, y los dos por encima
+  std::vector<uint16_t> ulp;
+  std::vector<uint16_t> cpu;
+  ulpTrace(ulp, cpu, 1520, 40, 1490);
+  int levelNear = ulpWakes(ulp, cpu, true);
+  int edgeNear = ulpWakes(ulp, cpu, false);
+  ulp.clear();
+  cpu.clear();
+  ulpTrace(ulp, cpu, 1600, 40, 1600);
+  int levelHigh = ulpWakes(ulp, cpu, true);
+  int edgeHigh = ulpWakes(ulp, cpu, false);
+  printf("ulp, una hora sin corroborar: cerca del umbral %d despertares (antes %d), "
+         "por encima %d (antes %d)\n", edgeNear, levelNear, edgeHigh, levelHigh);
+  CHECK(edgeNear <= 2);
+  CHECK(edgeHigh == 0);
+  CHECK(levelNear > 1000 && levelHigh > 1000);
+  // Tras bajar del rearme, un nuevo cruce despierta
+  for (int i = 0; i < 40; i++) {
+    ulp.push_back(1000);
+    cpu.push_back(1000);
+  }
+  ulp.push_back(1700);
+  cpu.push_back(1700);
+  CHECK(ulpWakes(ulp, cpu, false) == 1);
+}
+
+// --- Formato numérico ---
+// Formatea con end holgado y termina la cadena
+static const char* fmtUint(uint32_t v) {
+  static char buf[32];
+  *formatUint(buf, buf + sizeof(buf), v) = '\0';
+  return buf;
+}
+
+static const char* fmtInt(int32_t v) {
+  static char buf[32];
+  *formatInt(buf, buf + sizeof(buf), v) = '\0';
+  return buf;
+}
+
+static const char* fmtFixed(float v, uint8_t decimals) {
+  static char buf[32];
+  *formatFixed(buf, buf + sizeof(buf), v, decimals) = '\0';
+  return buf;
+}
+
+static void testFormat() {
+  char ref[32];
+  // Contra printf: bordes y 10000 valores pseudoaleatorios de cada tipo
+  const uint32_t edgesU[] = {0, 9, 10, 99, 100, 101, 999, 1000, 65535, 99999999,
+                             100000000, 4294967295u};
+  for (uint32_t v : edgesU) {
+    snprintf(ref, sizeof(ref), "%u", v);
+    CHECK(strcmp(fmtUint(v), ref) == 0);
+  }
+  const int32_t edgesI[] = {0, -1, 1, -9, -10, 2147483647, -2147483647 - 1};
+  for (int32_t v : edgesI) {
+    snprintf(ref, sizeof(ref), "%d", v);
+    CHECK(strcmp(fmtInt(v), ref) == 0);
+  }
+  srand(57);
+  int mismatches = 0;
+  for (int i = 0; i < 10000; i++) {
+    uint32_t u = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    snprintf(ref, sizeof(ref), "%u", u);
+    if (strcmp(fmtUint(u), ref) != 0) mismatches++;
+    int32_t v = (int32_t)u;
+    snprintf(ref, sizeof(ref), "%d", v);
+    if (strcmp(fmtInt(v), ref) != 0) mismatches++;
+    // Valores n / 10^d: sin empates de redondeo, printf es la referencia exacta
+    uint8_t d = i % 5;
+    int32_t n = (int32_t)(u % 2000001) - 1000000;
+    float f = (float)n / kPow10[d];
+    snprintf(ref, sizeof(ref), "%.*f", d, (double)n / kPow10[d]);
+    if (strcmp(fmtFixed(f, d), ref) != 0) mismatches++;
+  }
+  CHECK(mismatches == 0);
+
+  // Redondeo al más cercano y valores de sensor habituales
+  CHECK(strcmp(fmtFixed(23.46f, 1), "23.5") == 0);
+  CHECK(strcmp(fmtFixed(-5.04f, 1), "-5.0") == 0);
+  CHECK(strcmp(fmtFixed(0.0f, 2), "0.00") == 0);
+  CHECK(strcmp(fmtFixed(3.7f, 0), "4") == 0);
+  // Sensor averiado: NaN y valores fuera de escala no alargan el campo
+  CHECK(strcmp(fmtFixed(NAN, 1), "nan") == 0);
+  CHECK(strcmp(fmtFixed(1e30f, 1), "999999.0") == 0);
+  CHECK(strcmp(fmtFixed(-1e30f, 1), "-999999.0") == 0);
+  CHECK(strlen(fmtFixed(999999.9f, 4)) <= FMT_FIXED_MAX(4));
+  CHECK(strlen(fmtFixed(-999999.9f, 4)) <= FMT_FIXED_MAX(4));
+  CHECK(strlen(fmtUint(4294967295u)) == FMT_UINT_MAX);
+  CHECK(strlen(fmtInt(-2147483647 - 1)) == FMT_INT_MAX);
+
+  // Capacidad: el campo entra entero dejando sitio al '\0' o no entra
+  char small[6];
+  char* end = small + sizeof(small);
+  CHECK(appendStr(small, end, "abcde") == small + 5);
+  CHECK(appendStr(small, end, "abcdef") == end);
+  CHECK(formatUint(small, end, 12345) == small + 5);
+  CHECK(formatUint(small, end, 123456) == end);
+  CHECK(formatInt(small, end, -1234) == small + 5);
+  CHECK(formatInt(small, end, -12345) == end);
+  CHECK(formatFixed(small, end, 1.5f, 3) == small + 5);
+  CHECK(formatFixed(small, end, 12.5f, 3) == end);
+  char* p = appendStr(small, end, "abcd");
+  p = appendChar(p, end, 'x');
+  CHECK(p == small + 5);
+  CHECK(appendChar(p, end, 'y') == end);
+  // Desbordado una vez, sigue desbordado: el llamante solo mira el final
+  CHECK(appendStr(end, end, "") == end);
+  CHECK(formatUint(end, end, 0) == end);
+  // Lo que no cabe no se escribe a medias
+  memset(small, '-', sizeof(small));
+  formatUint(small + 2, end, 1234);
+  CHECK(small[2] == '-');
+}
+
+// --- PMS5003 ---
+// Trama de 32 bytes con PM1/PM2.5/PM10 atmosféricos en las palabras 5-7
+static void pmsFrame(uint8_t* frame, uint16_t pm1, uint16_t pm25, uint16_t pm10) {
+  memset(frame, 0, 32);
+  frame[0] = 0x42;
+  frame[1] = 0x4D;
+  frame[3] = 28;
+  const uint16_t words[3] = {pm1, pm25, pm10};
+  for (int i = 0; i < 3; i++) {
+    frame[10 + 2 * i] = words[i] >> 8;
+    frame[11 + 2 * i] = words[i] & 0xFF;
+  }
+  uint16_t sum = 0;
+  for (int i = 0; i < 30; i++) sum += frame[i];
+  frame[30] = sum >> 8;
+  frame[31] = sum & 0xFF;
+}
+
+static int pmsFeed(PmsFrameParser& parser, const uint8_t* data, size_t len) {
+  int frames = 0;
+  for (size_t i = 0; i < len; i++) frames += parser.feed(data[i]);
+  return frames;
+}
+
+static void testPmsParser() {
+  uint8_t frame[32];
+  PmsFrameParser parser;
+  pmsFrame(frame, 12, 345, 1000);
+  CHECK(pmsFeed(parser, frame, 31) == 0);
+  CHECK(parser.feed(frame[31]));
+  CHECK(parser.pm1 == 12 && parser.pm25 == 345 && parser.pm10 == 1000);
+
+  // Basura, cabecera partida y 0x42 repetido antes de la trama buena
+  const uint8_t junk[] = {0x00, 0x4D, 0x42, 0x00, 0x42, 0x42};
+  pmsFrame(frame, 1, 2, 3);
+  CHECK(pmsFeed(parser, junk, sizeof(junk)) == 0);
+  CHECK(pmsFeed(parser, frame + 1, 31) == 1);
+  CHECK(parser.pm25 == 2);
+
+  // Suma errónea: se cuenta y se conserva la medida anterior
+  pmsFrame(frame, 9, 99, 999);
+  frame[12] ^= 0x01;
+  uint32_t errors = parser.checksumErrors;
+  CHECK(pmsFeed(parser, frame, 32) == 0);
+  CHECK(parser.checksumErrors == errors + 1);
+  CHECK(parser.pm25 == 2);
+
+  // El acuse de 8 bytes del cambio de modo se descarta por la longitud y no
+  // impide leer la respuesta que va detrás
+  const uint8_t ack[] = {0x42, 0x4D, 0x00, 0x04, 0xE1, 0x00, 0x01, 0x74};
+  pmsFrame(frame, 5, 50, 500);
+  CHECK(pmsFeed(parser, ack, sizeof(ack)) == 0);
+  CHECK(pmsFeed(parser, frame, 32) == 1);
+  CHECK(parser.pm10 == 500);
+  CHECK(parser.frames == 3);
+
+  // Las órdenes llevan la suma de sus cinco primeros bytes
+  const uint8_t* cmds[] = {kPmsPassiveCmd, kPmsReadCmd};
+  for (const uint8_t* cmd : cmds) {
+    uint16_t sum = 0;
+    for (int i = 0; i < 5; i++) sum += cmd[i];
+    CHECK(cmd[5] == (sum >> 8) && cmd[6] == (sum & 0xFF));
+  }
+}
+
+// --- Índice meteorológico de incendios ---
+// Datos de prueba de Van Wagner y Pickett (1985): abril, arranque FFMC 85,
+// DMC 6, DC 15. Los días 2 y 7 solo encadenan el estado; se comparan los días
+// cuyos seis códigos coinciden con la tabla publicada.
+// --- Calefactor MQ ---
+// Ciclo de los calefactores durante un día con el periodo de muestreo dado. Sin
+// temporizador se enciende en la primera muestra pasado el instante y se mide
+// en la siguiente; con él, a la hora exacta. El temporizador llega hasta 2 ms
+// tarde y la lectura del MQ hasta 80 ms después de la marca.
+struct MqDay {
+  float heaterPct;    // tiempo encendido
+  float measuresPerH;
+  float maxAgeS;      // antigüedad máxima de la lectura entregada
+  uint32_t skipped;   // muestras que debían medir con el calefactor aún frío
+};
+
+static MqDay simulateMqHeater(uint32_t periodMs, bool preheatTimer) {
+  const uint32_t kDayMs = 86400000;
+  MqDay day = {0, 0, 0, 0};
+  bool on = false;
+  uint32_t onAt = 0;
+  uint64_t onTotal = 0;
+  uint32_t nextMeasure = 0;
+  uint32_t timerAt = 0;
+  bool timerArmed = false;
+  uint32_t lastMeasure = 0;
+  uint32_t measures = 0;
+  for (uint32_t tick = 0; tick < kDayMs; tick += periodMs) {
+    uint32_t jitter = (tick / periodMs) * 2654435761u >> 20;  // pseudoaleatorio, fijo
+    uint32_t now = tick + jitter % 80;
+    if (timerArmed && timerAt <= now) {
+      timerArmed = false;
+      if (!on) {
+        on = true;
+        onAt = timerAt + jitter % 3;
+      }
+    }
+    if (!on && (int32_t)(now - (nextMeasure - MQ_PRECALENTAMIENTO_MS)) >= 0) {
+      on = true;
+      onAt = now;
+    }
+    if (on && now - onAt >= MQ_PRECALENTAMIENTO_MS) {
+      onTotal += now - onAt;
+      on = false;
+      lastMeasure = tick;
+      measures++;
+      if (preheatTimer) {
+        nextMeasure = tick + mqMeasureDelayMs(periodMs, MQ_CICLO_MS);
+        timerAt = tick + mqPreheatDelayMs(periodMs, MQ_CICLO_MS);
+        timerArmed = true;
+      } else {
+        nextMeasure = now + MQ_CICLO_MS;
+      }
+    } else if (measures > 0 && tick >= nextMeasure) {
+      day.skipped++;
+    }
+    float age = (tick - lastMeasure) / 1000.0f;
+    if (measures > 0 && age > day.maxAgeS) day.maxAgeS = age;
+  }
+  day.heaterPct = 100.0f * onTotal / kDayMs;
+  day.measuresPerH = measures / 24.0f;
+  return day;
+}
+
+static void testMqHeater() {
+  MqWarmCalibration cal = {{1.5f, 0.8f}, MQ_PRECALENTAMIENTO_MS};
+  CHECK(mqWarmFactor(cal, 0, MQ_PRECALENTAMIENTO_MS) == 1.5f);
+  CHECK(mqWarmFactor(cal, 1, 1000) == 0.8f);
+  CHECK_NEAR(mqWarmFactor(cal, 0, (MQ_PRECALENTAMIENTO_MS + MQ_CALENTADO_COMPLETO_MS) / 2), 1.25,
+             1e-5);
+  CHECK(mqWarmFactor(cal, 1, MQ_CALENTADO_COMPLETO_MS) == 1.0f);
+
+  CHECK(mqMeasureDelayMs(30000, MQ_CICLO_MS) == 60000);
+  CHECK(mqMeasureDelayMs(45000, MQ_CICLO_MS) == 90000);
+  CHECK(mqMeasureDelayMs(60000, MQ_CICLO_MS) == 60000);
+  CHECK(mqMeasureDelayMs(120000, MQ_CICLO_MS) == 120000);
+  CHECK(mqPreheatDelayMs(30000, MQ_CICLO_MS) ==
+        60000 - MQ_PRECALENTAMIENTO_MS - MQ_HOLGURA_MS);
+  CHECK(mqPreheatDelayMs(10000, 15000) == 0);  // no da tiempo: encender ya
+
+  // Los periodos de RESERVA y CRITICO del firmware, y uno que no divide el ciclo.
+  // Los valores de MQ_HEATER_MA del firmware
+  const uint32_t kPeriods[] = {30000, 45000, 60000};
+  const float kHeaterMa = 300;
+  for (size_t i = 0; i < sizeof(kPeriods) / sizeof(kPeriods[0]); i++) {
+    MqDay before = simulateMqHeater(kPeriods[i], false);
+    MqDay after = simulateMqHeater(kPeriods[i], true);
+    printf("calefactor MQ cada %u s: sin temporizador %.0f mA, %.0f medidas/h, %.0f s de "
+           "antiguedad maxima; con el %.0f mA, %.0f medidas/h, %.0f s\n",
+           (unsigned)(kPeriods[i] / 1000), before.heaterPct / 100 * kHeaterMa,
+           before.measuresPerH, before.maxAgeS, after.heaterPct / 100 * kHeaterMa,
+           after.measuresPerH, after.maxAgeS);
+    CHECK(after.skipped == 0);
+    CHECK(after.heaterPct / after.measuresPerH < 0.8f * before.heaterPct / before.measuresPerH);
+    CHECK(after.maxAgeS <= before.maxAgeS);
+    CHECK_NEAR(after.measuresPerH, 3600000.0 / mqMeasureDelayMs(kPeriods[i], MQ_CICLO_MS), 0.1);
+    // Solo el precalentamiento y la holgura por medida
+    CHECK_NEAR(after.heaterPct,
+               100.0 * (MQ_PRECALENTAMIENTO_MS + MQ_HOLGURA_MS) /
+                   mqMeasureDelayMs(kPeriods[i], MQ_CICLO_MS), 0.5);
+  }
+}
+
+// --- Viento ---
+static void testWind() {
+  // Cada tensión de la tabla da su sector; entre dos vecinas en ADC, la más cercana
+  for (uint8_t i = 0; i < 16; i++) CHECK(windVaneSector(kWindVaneAdc[i]) == i);
+  uint8_t order[16];
+  for (uint8_t i = 0; i < 16; i++) order[i] = i;
+  for (int i = 0; i < 16; i++) {
+    for (int j = i + 1; j < 16; j++) {
+      if (kWindVaneAdc[order[j]] < kWindVaneAdc[order[i]]) {
+        uint8_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+      }
+    }
+  }
+  bool boundaries = true;
+  for (int i = 0; i + 1 < 16; i++) {
+    uint16_t lo = kWindVaneAdc[order[i]];
+    uint16_t hi = kWindVaneAdc[order[i + 1]];
+    uint16_t mid = (lo + hi) / 2;
+    if (windVaneSector(mid - 1) != order[i] || windVaneSector(mid + 1) != order[i + 1]) {
+      boundaries = false;
+    }
+  }
+  CHECK(boundaries);
+  CHECK(windVaneSector(0) == order[0]);
+  CHECK(windVaneSector(4095) == order[15]);
+
+  // El contador libre vuelve a 0 en WIND_PCNT_LIMITE
+  CHECK(windPulseDelta(100, 150) == 50);
+  CHECK(windPulseDelta(0, 0) == 0);
+  CHECK(windPulseDelta(WIND_PCNT_LIMITE - 7, 5) == 12);
+  // Dos horas a 60 Hz leyendo cada segundo: pasa por el límite 13 veces sin perder pulsos
+  uint32_t total = 0;
+  int16_t counter = 0;
+  int16_t last = 0;
+  uint32_t summed = 0;
+  for (int sec = 0; sec < 7200; sec++) {
+    uint32_t pulses = 55 + sec % 11;
+    total += pulses;
+    counter = (int16_t)((counter + pulses) % WIND_PCNT_LIMITE);
+    summed += windPulseDelta(last, counter);
+    last = counter;
+  }
+  CHECK(summed == total);
+
+  // Viento constante: racha igual a la media
+  WindSampler wind;
+  float kmh = 0, gust = 0;
+  uint16_t dir = 123;
+  CHECK(!windSummary(wind.drain(), kmh, gust, dir));
+  for (int i = 0; i < 60; i++) wind.tick(10, 4);
+  CHECK(windSummary(wind.drain(), kmh, gust, dir));
+  CHECK_NEAR(kmh, 10 * WIND_KMH_PER_HZ, 1e-4);
+  CHECK_NEAR(gust, kmh, 1e-4);
+  CHECK(dir == 90);
+  // Ráfaga de 3 s a triple velocidad: la racha la recoge entera, la media apenas
+  for (int i = 0; i < 60; i++) wind.tick(i >= 30 && i < 33 ? 30 : 10, 4);
+  windSummary(wind.drain(), kmh, gust, dir);
+  CHECK_NEAR(kmh, 11 * WIND_KMH_PER_HZ, 1e-4);
+  CHECK_NEAR(gust, 30 * WIND_KMH_PER_HZ, 1e-4);
+  // Un solo segundo: la racha es la media de 3 s, no el pico
+  for (int i = 0; i < 60; i++) wind.tick(i == 30 ? 30 : 10, 4);
+  windSummary(wind.drain(), kmh, gust, dir);
+  CHECK_NEAR(gust, 50.0 / 3 * WIND_KMH_PER_HZ, 1e-4);
+  // Dirección: media vectorial, 337,5 y 22,5 dan norte; en calma no cambia
+  for (int i = 0; i < 10; i++) wind.tick(5, i % 2 ? 15 : 1);
+  windSummary(wind.drain(), kmh, gust, dir);
+  CHECK(dir == 0);
+  for (int i = 0; i < 10; i++) wind.tick(0, 8);
+  windSummary(wind.drain(), kmh, gust, dir);
+  CHECK(dir == 0 && kmh == 0);
+  // Racha de 3 s con pulsos que no caben en 16 bits sumados
+  for (int i = 0; i < 3; i++) wind.tick(30000, 0);
+  windSummary(wind.drain(), kmh, gust, dir);
+  CHECK_NEAR(gust, 30000 * WIND_KMH_PER_HZ, 0.1);
+}
+
+struct FwiDay {
+  float temp, rh, wind, rain;
+  bool compare;
+  FwiCodes expect;
+};
+
+static const FwiDay kFwiTable[] = {
+    {17.0f, 42, 25, 0.0f, true, {87.7f, 8.5f, 19.0f, 10.9f, 8.5f, 10.1f}},
+    {20.0f, 21, 25, 2.4f, false, {}},
+    {8.5f, 40, 17, 0.0f, true, {87.0f, 11.8f, 26.1f, 6.5f, 11.7f, 7.6f}},
+    {6.5f, 25, 6, 0.0f, true, {88.8f, 13.2f, 28.2f, 4.9f, 13.1f, 6.2f}},
+    {13.0f, 34, 24, 0.0f, true, {89.1f, 15.4f, 31.5f, 12.6f, 15.3f, 14.8f}},
+    {6.0f, 40, 22, 0.4f, true, {88.7f, 16.5f, 33.5f, 10.7f, 16.4f, 13.5f}},
+};
+
+static void testFwi() {
+  FwiCodes codes = {85, 6, 15, 0, 0, 0};
+  for (const FwiDay& d : kFwiTable) {
+    codes = fwiNextDay(codes, d.temp, d.rh, d.wind, d.rain, 3);
+    if (!d.compare) continue;
+    CHECK_NEAR(codes.ffmc, d.expect.ffmc, 0.1);
+    CHECK_NEAR(codes.dmc, d.expect.dmc, 0.1);
+    CHECK_NEAR(codes.dc, d.expect.dc, 0.1);
+    CHECK_NEAR(codes.isi, d.expect.isi, 0.1);
+    CHECK_NEAR(codes.bui, d.expect.bui, 0.1);
+    CHECK_NEAR(codes.fwi, d.expect.fwi, 0.1);
+  }
+
+  // Lluvia fuerte: la humedad del combustible fino sube y el índice cae a cero
+  FwiCodes wet = fwiNextDay(codes, 7.0f, 93, 14, 9.0f, 3);
+  CHECK(wet.ffmc < codes.ffmc);
+  CHECK(wet.dmc < codes.dmc);
+  CHECK(wet.fwi < 0.5f);
+
+  // Humedad fuera de rango se recorta a 100 %
+  FwiCodes a = fwiNextDay(codes, 10.0f, 100, 10, 0.0f, 3);
+  FwiCodes b = fwiNextDay(codes, 10.0f, 130, 10, 0.0f, 3);
+  CHECK_NEAR(a.ffmc, b.ffmc, 1e-4);
+  CHECK_NEAR(a.fwi, b.fwi, 1e-4);
+}
+
+// --- Cuantiles ---
+static uint32_t lcgState = 1;
+
+static float uniform01() {
+  lcgState = lcgState * 1664525u + 1013904223u;
+  return ((lcgState >> 8) + 0.5f) / 16777216.0f;
+}
+
+// Box-Muller; la segunda variable se descarta
+static float gaussian(float mean, float sigma) {
+  float u1 = uniform01();
+  float u2 = uniform01();
+  return mean + sigma * sqrtf(-2 * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+static int cmpFloat(const void* a, const void* b) {
+  float x = *(const float*)a;
+  float y = *(const float*)b;
+  return (x > y) - (x < y);
+}
+
+// Cuantil exacto por ordenación, con el mismo criterio de rango que P²
+static float exactQuantile(float* v, int n, float p) {
+  qsort(v, n, sizeof(float), cmpFloat);
+  return v[(int)(p * (n - 1) + 0.5f)];
+}
+
+static void testQuantile() {
+  static float samples[20000];
+  const float ps[] = {0.05f, 0.5f, 0.95f};
+
+  // Normal: temperatura de una hora, media 24 °C y sigma 3
+  for (float p : ps) {
+    P2Quantile q;
+    q.reset(p);
+    CHECK(isnan(q.value()));
+    for (int i = 0; i < 20000; i++) {
+      samples[i] = gaussian(24, 3);
+      q.add(samples[i]);
+    }
+    CHECK(q.count() == 20000);
+    CHECK_NEAR(q.value(), exactQuantile(samples, 20000, p), 0.15);
+  }
+
+  // Uniforme sesgada a un lado: humedad entre 10 y 60 %
+  for (float p : ps) {
+    P2Quantile q;
+    q.reset(p);
+    for (int i = 0; i < 20000; i++) {
+      samples[i] = 10 + 50 * uniform01() * uniform01();
+      q.add(samples[i]);
+    }
+    CHECK_NEAR(q.value(), exactQuantile(samples, 20000, p), 0.5);
+  }
+
+  // Cambio de estación: la media sube 8 °C. P² solo no lo sigue del todo; el
+  // estimador deslizante, tras una ventana completa, da el cuantil del régimen
+  // nuevo.
+  const uint32_t kWindow = 4000;
+  SlidingQuantile<kWindow> sliding;
+  P2Quantile plain;
+  sliding.reset(0.95f);
+  plain.reset(0.95f);
+  for (int i = 0; i < 3 * (int)kWindow; i++) {
+    float x = gaussian(18, 3);
+    sliding.add(x);
+    plain.add(x);
+  }
+  int n = 0;
+  for (int i = 0; i < 2 * (int)kWindow; i++) {
+    float x = gaussian(26, 3);
+    sliding.add(x);
+    plain.add(x);
+    samples[n++] = x;
+  }
+  float expected = exactQuantile(samples, n, 0.95f);
+  CHECK_NEAR(sliding.value(), expected, 0.3);
+  CHECK(fabsf(plain.value() - expected) > fabsf(sliding.value() - expected));
+  CHECK(sliding.count() <= kWindow);
+
+  // El relevo arranca a mitad de ventana y sustituye al activo al completarla
+  SlidingQuantile<10> small;
+  small.reset(0.5f);
+  for (int i = 0; i < 9; i++) small.add(i);
+  CHECK(small.count() == 9);
+  small.add(9);
+  CHECK(small.count() == 5);
+}
+
+// --- Umbrales adaptativos ---
+// Dos meses de verano cada 5 s en dos sitios, con una ola de calor de 8 días
+// (+6 °C, -8 puntos de humedad) y tres fuegos cercanos de tarde (+14 °C y -30
+// puntos en 15 min, media hora). Se cuenta la alerta MEDIA por temperatura y
+// humedad (sin gas ni viento) con los umbrales fijos y con los aprendidos, que
+// solo aprenden en BAJA como adaptiveLearn(). Sin el ajuste por FWI.
+struct SummerSite {
+  const char* name;
+  float tMin, tPeak;
+  float rhMax, rhMin;
+};
+
+struct AlarmReplay {
+  uint32_t falseEpisodes;  // subidas a MEDIA fuera de los fuegos
+  uint32_t fires;          // fuegos detectados, de 3
+  float meanLatencyMin;
+};
+
+// Los valores de TEMP_CRITICA y HUM_CRITICA del firmware
+static const float kTempCritica = 40;
+static const float kHumCritica = 20;
+
+static AlarmReplay replaySummer(const SummerSite& site, bool adaptive) {
+  static HourBaseline base[24];
+  for (int h = 0; h < 24; h++) {
+    base[h].tempAlta.reset(0.95f);
+    base[h].humBaja.reset(0.05f);
+  }
+  const int kFireDays[3] = {20, 41, 52};
+  const uint32_t kPerDay = 86400 / 5;
+  uint32_t noise = 12345;  // generador propio: no mueve la secuencia de las demás pruebas
+  float anomaly = 0;
+  AlarmReplay r = {0, 0, 0};
+  float latencySum = 0;
+  bool wasAlarm = false;
+  for (int day = 0; day < 60; day++) {
+    noise = noise * 1664525u + 1013904223u;
+    anomaly = 0.7f * anomaly + ((noise >> 8) / 16777216.0f - 0.5f) * 2.4f;  // ±2 °C de un día a otro
+    bool heatwave = day >= 30 && day < 38;
+    float tPeak = site.tPeak + anomaly + (heatwave ? 6 : 0);
+    float rhMin = site.rhMin - anomaly - (heatwave ? 8 : 0);
+    int fire = -1;
+    for (int f = 0; f < 3; f++) {
+      if (kFireDays[f] == day) fire = f;
+    }
+    bool detected = false;
+    for (uint32_t i = 0; i < kPerDay; i++) {
+      float hour = i * 5 / 3600.0f;
+      float shape = 0.5f - 0.5f * cosf(2 * 3.14159265f * (hour - 5) / 24);  // mínimo a las 5, máximo a las 17
+      noise = noise * 1664525u + 1013904223u;
+      float jitter = (noise >> 8) / 16777216.0f - 0.5f;
+      float temp = site.tMin + (tPeak - site.tMin) * shape + jitter * 0.6f;
+      float rh = site.rhMax - (site.rhMax - rhMin) * shape - jitter * 3;
+      float fireMin = (hour - 14) * 60;
+      bool inFire = fire >= 0 && fireMin >= 0 && fireMin < 45;
+      if (inFire) {
+        float ramp = fireMin < 15 ? fireMin / 15 : 1;
+        temp += 14 * ramp;
+        rh -= 30 * ramp;
+      }
+      if (rh < 2) rh = 2;
+
+      HourBaseline& b = base[(int)hour];
+      bool learned = adaptive && b.tempAlta.count() >= ADAPT_MIN_MUESTRAS;
+      float tLimit = learned ? adaptiveTempLimit(b) : kTempCritica;
+      float hLimit = learned ? adaptiveHumLimit(b) : kHumCritica;
+      bool alarm = temp > tLimit && rh < hLimit;
+      if (!alarm) {
+        b.tempAlta.add(temp);
+        b.humBaja.add(rh);
+      }
+      if (alarm && inFire && !detected) {
+        detected = true;
+        r.fires++;
+        latencySum += fireMin;
+      }
+      if (alarm && !wasAlarm && !inFire) r.falseEpisodes++;
+      wasAlarm = alarm;
+    }
+  }
+  r.meanLatencyMin = r.fires ? latencySum / r.fires : 0;
+  return r;
+}
+
+static void testAdaptive() {
+  const SummerSite kSites[] = {
+      {"valle interior", 18, 37, 60, 22},
+      {"costa", 17, 27, 85, 50},
+  };
+  AlarmReplay fixedR[2];
+  AlarmReplay adaptR[2];
+  for (int i = 0; i < 2; i++) {
+    fixedR[i] = replaySummer(kSites[i], false);
+    adaptR[i] = replaySummer(kSites[i], true);
+    printf("umbrales %s, 60 dias: fijos %u falsas alarmas, %u/3 fuegos en %.1f min; "
+           "aprendidos %u falsas, %u/3 en %.1f min\n",
+           kSites[i].name, (unsigned)fixedR[i].falseEpisodes, (unsigned)fixedR[i].fires,
+           fixedR[i].meanLatencyMin, (unsigned)adaptR[i].falseEpisodes, (unsigned)adaptR[i].fires,
+           adaptR[i].meanLatencyMin);
+  }
+  // Interior: la ola de calor ya pasa de los fijos; los aprendidos la absorben
+  CHECK(fixedR[0].falseEpisodes > 0);
+  CHECK(adaptR[0].falseEpisodes < fixedR[0].falseEpisodes);
+  CHECK(adaptR[0].fires == 3);
+  CHECK(adaptR[0].meanLatencyMin < 15);  // antes de acabar la subida, algo después que los fijos
+  // Costa: el fuego no llega a los fijos; los aprendidos lo ven
+  CHECK(fixedR[1].fires < 3);
+  CHECK(adaptR[1].fires == 3);
+  CHECK(adaptR[1].falseEpisodes <= 2);
+
+  HourBaseline b;
+  b.tempAlta.reset(0.95f);
+  b.humBaja.reset(0.05f);
+  for (int i = 0; i < 1000; i++) {
+    b.tempAlta.add(60);
+    b.humBaja.add(1);
+  }
+  CHECK(adaptiveTempLimit(b) == (float)ADAPT_TEMP_MAX);
+  CHECK(adaptiveHumLimit(b) == (float)ADAPT_HUM_MIN);
+}
+
+// --- Corte de alimentación ---
+// Los valores de POWER_FAIL_BUDGET_MS, POWER_FAIL_RESERVE_MS y QUEUE_DEPTH del firmware
+static const int64_t kPowerBudgetUs = 150000;
+static const int64_t kPowerReserveUs = 40000;
+static const int kLogQueueDepth = 8;
+
+struct FlushRun {
+  int flushed;
+  int64_t overrunUs;  // fin del cierre menos el plazo; <= 0 si cumple
+};
+
+// Simula emergencyFlush(): arranque de la tarea de log, escrituras y cierre con
+// sync y NVS. budgeted = false reproduce el bucle ingenuo "mientras no venza".
+static FlushRun simulateFlush(bool budgeted, int queued, const int64_t* costs, int64_t startUs,
+                              int64_t closeUs) {
+  FlushBudget budget(kPowerBudgetUs, kPowerReserveUs, 3000);
+  int64_t now = startUs;
+  int i = 0;
+  while (i < queued && (budgeted ? budget.canStart(now) : now < kPowerBudgetUs)) {
+    now += costs[i];
+    budget.record(costs[i]);
+    i++;
+  }
+  FlushRun run = {i, now + closeUs - kPowerBudgetUs};
+  return run;
+}
+
+static void testPowerFail() {
+  FlushBudget b(100000, 30000, 5000);
+  CHECK(b.canStart(65000));
+  CHECK(!b.canStart(65001));
+  b.record(2000);
+  CHECK(b.worstUs() == 5000);
+  b.record(20000);
+  CHECK(b.worstUs() == 20000);
+  CHECK(!b.canStart(50001));
+
+  // Tarjeta normal (1-5 ms por registro, 5 % de bloqueos de 20-60 ms) y
+  // tarjeta degradada (bloqueos en el 40 %). El cierre cuesta 10-35 ms.
+  const float stallRates[] = {0.05f, 0.4f};
+  for (float stallRate : stallRates) {
+    const int kTrials = 2000;
+    int overruns = 0;
+    int naiveOverruns = 0;
+    int64_t worst = 0;
+    int64_t naiveWorst = 0;
+    long flushed = 0;
+    long naiveFlushed = 0;
+    for (int t = 0; t < kTrials; t++) {
+      int queued = (int)(uniform01() * (kLogQueueDepth + 1));
+      int64_t costs[kLogQueueDepth];
+      for (int i = 0; i < queued; i++) {
+        costs[i] = 1000 + (int64_t)(uniform01() * 4000);
+        if (uniform01() < stallRate) costs[i] += 20000 + (int64_t)(uniform01() * 40000);
+      }
+      int64_t startUs = (int64_t)(uniform01() * 5000);
+      int64_t closeUs = 10000 + (int64_t)(uniform01() * 25000);
+      FlushRun run = simulateFlush(true, queued, costs, startUs, closeUs);
+      FlushRun naive = simulateFlush(false, queued, costs, startUs, closeUs);
+      flushed += run.flushed;
+      naiveFlushed += naive.flushed;
+      if (run.overrunUs > 0) overruns++;
+      if (naive.overrunUs > 0) naiveOverruns++;
+      if (run.overrunUs > worst) worst = run.overrunUs;
+      if (naive.overrunUs > naiveWorst) naiveWorst = naive.overrunUs;
+    }
+    printf("corte, bloqueos %2.0f %%: %d/%d fuera de plazo (peor +%.1f ms), %ld registros; "
+           "sin presupuesto %d/%d (peor +%.1f ms), %ld registros\n",
+           stallRate * 100, overruns, kTrials, worst / 1000.0, flushed, naiveOverruns, kTrials,
+           naiveWorst / 1000.0, naiveFlushed);
+    // Solo un bloqueo peor que todos los vistos puede pasarse, y en menos que
+    // la reserva. Con la tarjeta sana se vacía casi lo mismo que sin límite.
+    CHECK(overruns * 100 <= kTrials);
+    CHECK(worst < kPowerReserveUs / 2);
+    CHECK(naiveOverruns > overruns && naiveWorst > worst);
+    if (stallRate < 0.1f) CHECK(flushed * 10 >= naiveFlushed * 9);
+  }
+}
+
+// --- Gestión de energía ---
+static void testEnergy() {
+  // Curva de descarga: extremos, puntos de la tabla e interpolación
+  CHECK(batterySoc(3000) == 0);
+  CHECK(batterySoc(3300) == 0);
+  CHECK(batterySoc(3400) == 2);
+  CHECK(batterySoc(3700) == 25);
+  CHECK(batterySoc(3725) == 32);
+  CHECK(batterySoc(4199) == 99);
+  CHECK(batterySoc(4200) == 100);
+  CHECK(batterySoc(4350) == 100);
+  uint8_t prev = 0;
+  bool monotonic = true;
+  for (uint16_t mv = 3200; mv <= 4300; mv++) {
+    uint8_t soc = batterySoc(mv);
+    if (soc < prev) monotonic = false;
+    prev = soc;
+  }
+  CHECK(monotonic);
+
+  // Bajada por carga restante, sin histéresis
+  const float kAmple[EN_COUNT] = {500, 500, 500, 500};
+  CHECK(energyPolicy(EN_NORMAL, 60, false, kAmple, 10) == EN_NORMAL);
+  CHECK(energyPolicy(EN_NORMAL, ENERGY_SOC_AHORRO - 1, false, kAmple, 10) == EN_AHORRO);
+  CHECK(energyPolicy(EN_NORMAL, ENERGY_SOC_RESERVA - 1, true, kAmple, 10) == EN_RESERVA);
+  CHECK(energyPolicy(EN_NORMAL, ENERGY_SOC_CRITICO - 1, true, kAmple, 10) == EN_CRITICO);
+  CHECK(energyPolicy(EN_AHORRO, 0, false, kAmple, 10) == EN_CRITICO);
+
+  // Sin panel, el primer perfil cuya autonomía cubre la noche y el margen;
+  // con panel no cuenta
+  const float kRuntime[EN_COUNT] = {10, 12, 40, 60};
+  CHECK(energyPolicy(EN_NORMAL, 80, false, kRuntime, 10 - ENERGY_AUTONOMIA_MARGEN_H) == EN_NORMAL);
+  CHECK(energyPolicy(EN_NORMAL, 80, false, kRuntime, 11 - ENERGY_AUTONOMIA_MARGEN_H) == EN_AHORRO);
+  CHECK(energyPolicy(EN_NORMAL, 80, false, kRuntime, 8) == EN_RESERVA);
+  CHECK(energyPolicy(EN_NORMAL, 80, false, kRuntime, 100) == EN_CRITICO);
+  CHECK(energyPolicy(EN_NORMAL, 80, true, kRuntime, 8) == EN_NORMAL);
+
+  // Subida: solo cargando y pasado el umbral más la histéresis, un perfil cada vez
+  CHECK(energyPolicy(EN_AHORRO, 90, false, kAmple, 10) == EN_AHORRO);
+  CHECK(energyPolicy(EN_AHORRO, ENERGY_SOC_AHORRO + ENERGY_HISTERESIS - 1, true, kAmple, 10) ==
+        EN_AHORRO);
+  CHECK(energyPolicy(EN_AHORRO, ENERGY_SOC_AHORRO + ENERGY_HISTERESIS, true, kAmple, 10) ==
+        EN_NORMAL);
+  CHECK(energyPolicy(EN_CRITICO, 90, true, kAmple, 10) == EN_RESERVA);
+  CHECK(energyPolicy(EN_RESERVA, ENERGY_SOC_RESERVA + 2, true, kAmple, 10) == EN_RESERVA);
+
+  // Con panel, por encima de reserva solo si la reserva ya cubre la noche; para
+  // salir de ella, con ENERGY_HISTERESIS_H de más
+  const float kBank[EN_COUNT] = {10, 12, 14, 60};
+  const float kNight = 14 - ENERGY_AUTONOMIA_MARGEN_H;
+  CHECK(energyPolicy(EN_NORMAL, 80, true, kBank, kNight) == EN_NORMAL);
+  CHECK(energyPolicy(EN_NORMAL, 80, true, kBank, kNight + 1) == EN_RESERVA);
+  CHECK(energyPolicy(EN_RESERVA, 80, true, kBank, kNight - ENERGY_HISTERESIS_H + 1) == EN_RESERVA);
+  CHECK(energyPolicy(EN_RESERVA, 80, true, kBank, kNight - ENERGY_HISTERESIS_H) == EN_AHORRO);
+
+  // Previsión: noche medida, descargas cortas ignoradas y consumo corregido
+  EnergyForecast forecast;
+  CHECK(forecast.hoursToCharge() == ENERGY_NOCHE_INICIAL_H);
+  for (int m = 0; m < 11 * 60; m++) forecast.update(1 / 60.0f, 80, false, 380, 3000);
+  forecast.update(1 / 60.0f, 80, true, 380, 3000);
+  CHECK_NEAR(forecast.nightH(), 11, 0.05);
+  for (int m = 0; m < 2 * 60; m++) forecast.update(1 / 60.0f, 80, false, 380, 3000);
+  CHECK_NEAR(forecast.hoursToCharge(), 9, 0.05);
+  forecast.update(1 / 60.0f, 80, true, 380, 3000);
+  CHECK_NEAR(forecast.nightH(), 11, 0.05);
+  CHECK(forecast.loadScale() == 1);  // sin descarga medida, el modelo tal cual
+  CHECK_NEAR(forecast.runtimeH(50, 300, 3000), 5, 0.01);
+  CHECK(forecast.charging());
+
+  // Panel que no cubre el perfil: cuenta como descarga hasta que la carga suba
+  for (int m = 0; m <= 60; m++) forecast.update(1 / 60.0f, 80 - m / 20, true, 380, 3000);
+  CHECK(!forecast.charging());
+  for (int m = 0; m <= 60; m++) forecast.update(1 / 60.0f, 77 + m / 20, true, 380, 3000);
+  CHECK(forecast.charging());
+  forecast.update(1 / 60.0f, 80, false, 380, 3000);
+  CHECK(!forecast.charging());
+}
+
+// Un año de sol a 42° N (días de 9,3 a 15,2 h) con días claros, nubosos y
+// cubiertos al azar y una semana cubierta en diciembre. El nodo consume un 25 %
+// más de lo que dicen los perfiles, como un modelo mal calibrado. En invierno,
+// dos días cubiertos seguidos dan menos de lo que gasta el perfil crítico y una
+// sola celda no llega: ahí solo se compara con la política de carga sin más.
+struct SolarYear {
+  uint32_t brownoutMin;
+  uint32_t fireBrownoutMin;       // de mayo a octubre, la campaña de incendios
+  float fireMinSoc;
+  uint32_t minutes[2][EN_COUNT];  // [invierno, verano][perfil]
+  float loadScale;
+  float winterNightH;             // previsión de noche a mitad de enero
+};
+
+// Los valores de BATTERY_CAPACITY_MAH y loadMa de kEnergyProfiles del firmware
+static const float kCapacityMah = 3000;
+static const float kProfileMa[EN_COUNT] = {380, 340, 90, 60};
+
+static SolarYear simulateSolarYear(bool predictive) {
+  const float kPanelPeakMa = 1500;  // panel de ~8 W al mediodía con cielo claro
+  const float kLoadError = 1.25f;
+  const float kLatitude = 42 * 3.14159265f / 180;
+  SolarYear year;
+  memset(&year, 0, sizeof(year));
+  year.fireMinSoc = 100;
+  EnergyForecast forecast;
+  EnergyLevel level = EN_NORMAL;
+  float mah = kCapacityMah * 0.8f;
+  for (int day = 0; day < 365; day++) {
+    float decl = 23.44f * 3.14159265f / 180 * sinf(2 * 3.14159265f * (284 + day) / 365);
+    float daylightH = 2 * acosf(-tanf(kLatitude) * tanf(decl)) * 12 / 3.14159265f;
+    float sunrise = 12 - daylightH / 2;
+    float sky = uniform01();
+    float cloud = sky < 0.6f ? 1.0f : sky < 0.85f ? 0.5f : 0.12f;
+    if (day >= 345 && day < 352) cloud = 0.3f;
+    int season = (day < 59 || day >= 334) ? 0 : (day >= 151 && day < 243) ? 1 : -1;
+    bool fireSeason = day >= 120 && day < 304;
+    for (int m = 0; m < 24 * 60; m++) {
+      float h = m / 60.0f;
+      float sun = (h > sunrise && h < sunrise + daylightH)
+                      ? sinf(3.14159265f * (h - sunrise) / daylightH) : 0;
+      float chargeMa = kPanelPeakMa * cloud * sun;
+      bool charging = chargeMa > 40;  // el panel pasa de SOLAR_CHARGING_MV
+      float loadMa = kProfileMa[level] * kLoadError;
+      if (mah <= 0) {
+        year.brownoutMin++;
+        if (fireSeason) year.fireBrownoutMin++;
+        loadMa = 0;
+      }
+      mah += (chargeMa - loadMa) / 60;
+      if (mah > kCapacityMah) mah = kCapacityMah;
+      if (mah < 0) mah = 0;
+      float socTrue = mah / kCapacityMah * 100;
+      if (fireSeason && socTrue < year.fireMinSoc) year.fireMinSoc = socTrue;
+      float reading = socTrue + (m % 2 ? 0.6f : -0.6f);  // ruido de la lectura de tensión
+      uint8_t soc = reading <= 0 ? 0 : reading >= 100 ? 100 : (uint8_t)reading;
+
+      forecast.update(1 / 60.0f, soc, charging, kProfileMa[level], kCapacityMah);
+      float runtimeH[EN_COUNT];
+      for (int p = 0; p < EN_COUNT; p++) {
+        runtimeH[p] = predictive ? forecast.runtimeH(soc, kProfileMa[p], kCapacityMah) : 1e6f;
+      }
+      level = energyPolicy(level, soc, predictive ? forecast.charging() : charging, runtimeH,
+                           forecast.hoursToCharge());
+      if (season >= 0) year.minutes[season][level]++;
+    }
+    if (day == 15) year.winterNightH = forecast.nightH();
+  }
+  year.loadScale = forecast.loadScale();
+  return year;
+}
+
+static void testSolarYear() {
+  static const char* const names[EN_COUNT] = {"normal", "ahorro", "reserva", "critico"};
+  SolarYear years[2];
+  for (int predictive = 0; predictive < 2; predictive++) {
+    SolarYear& y = years[predictive];
+    y = simulateSolarYear(predictive);
+    printf("energia %s: %u min sin alimentacion (%u en campana), minima en campana %.0f%%",
+           predictive ? "prevista" : "solo carga", (unsigned)y.brownoutMin,
+           (unsigned)y.fireBrownoutMin, y.fireMinSoc);
+    for (int season = 0; season < 2; season++) {
+      uint32_t total = 0;
+      for (int p = 0; p < EN_COUNT; p++) total += y.minutes[season][p];
+      printf(season ? "; verano" : "; invierno");
+      for (int p = 0; p < EN_COUNT; p++) {
+        printf(" %s %.0f%%", names[p], 100.0 * y.minutes[season][p] / total);
+      }
+    }
+    printf("\n");
+  }
+  const SolarYear& p = years[1];
+  printf("energia prevista: consumo x%.2f del modelo, noche de enero %.1f h\n", p.loadScale,
+         p.winterNightH);
+  CHECK(p.fireBrownoutMin == 0);
+  CHECK(years[0].fireBrownoutMin > 0);
+  CHECK(p.brownoutMin * 20 < years[0].brownoutMin);
+  CHECK_NEAR(p.loadScale, 1.25, 0.15);
+  CHECK(p.winterNightH > 13 && p.winterNightH < 16.5);
+  // En verano la previsión no impide el perfil normal con el panel cargando
+  uint32_t summer = 0;
+  for (int l = 0; l < EN_COUNT; l++) summer += p.minutes[1][l];
+  CHECK(p.minutes[1][EN_NORMAL] > summer / 3);
+}
+
+// --- Telemetría predictiva ---
+static void testTrend() {
+  TrendPredictor p;
+  CHECK(!p.primed());
+  CHECK(p.predict(1000) == 0);
+
+  // Con un solo punto se repite el último valor
+  p.update(1000, 250);
+  CHECK(p.primed());
+  CHECK(p.predict(5000) == 250);
+
+  // Con dos, extrapolación lineal entera truncada hacia cero
+  p.update(3000, 270);
+  CHECK(p.predict(3000) == 270);
+  CHECK(p.predict(5000) == 290);
+  CHECK(p.predict(4000) == 280);
+  CHECK(p.predict(3999) == 279);
+  p.update(5000, 260);
+  CHECK(p.predict(7000) == 250);
+  CHECK(p.predict(6001) == 255);
+
+  // Tramo nulo o negativo (reloj repetido o reiniciado): último valor
+  TrendPredictor same;
+  same.update(2000, 10);
+  same.update(2000, 40);
+  CHECK(same.predict(9000) == 40);
+  TrendPredictor back;
+  back.update(9000, 10);
+  back.update(1000, 40);
+  CHECK(back.predict(2000) == 40);
+
+  // Sin desbordar con valores y tiempos grandes: el producto va en 64 bits
+  TrendPredictor big;
+  big.update(0, -2000000);
+  big.update(1000, 2000000);
+  CHECK(big.predict(2000) == 6000000);
+  big.update(0xFFFFF000u, 100);
+  big.update(0x00000800u, 200);  // millis() dio la vuelta
+  CHECK(big.predict(0x00001000u) == 200 + 100 * 0x800 / 0x1800);
+
+  // Nodo y colector con el mismo predictor, alimentado solo con lo transmitido:
+  // el colector reconstruye cada muestra suprimida con error <= epsilon.
+  const int32_t kEpsilon = 5;
+  TrendPredictor node;
+  TrendPredictor collector;
+  int32_t worst = 0;
+  int sent = 0;
+  for (int i = 0; i < 2000; i++) {
+    uint32_t t = i * 10000u;
+    int32_t value = 200 + (int32_t)(60 * sinf(i / 50.0f)) + (i % 7) - 3;
+    bool send = !node.primed() || abs(value - node.predict(t)) > kEpsilon;
+    int32_t seen;
+    if (send) {
+      node.update(t, value);
+      collector.update(t, value);
+      seen = value;
+      sent++;
+    } else {
+      seen = collector.predict(t);
+    }
+    int32_t error = abs(seen - value);
+    if (error > worst) worst = error;
+  }
+  CHECK(worst <= kEpsilon);
+  CHECK(sent < 2000 / 3);
+}
+
+// --- Compresión LZ ---
+static const size_t kExportChunk = 1024;  // EXPORT_CHUNK del firmware
+
+// Comprime como exportLogChunk (cap = len - 1) y comprueba la vuelta
+static size_t lzRoundTrip(const uint8_t* data, size_t len) {
+  static uint8_t packed[kExportChunk];
+  static uint8_t unpacked[kExportChunk];
+  size_t packedLen = lzCompress(data, len, packed, len - 1);
+  if (packedLen == 0) return len;
+  CHECK(packedLen < len);
+  size_t n = lzDecompress(packed, packedLen, unpacked, sizeof(unpacked));
+  CHECK(n == len && memcmp(unpacked, data, len) == 0);
+  return packedLen;
+}
+
+// Líneas de log como las de logSample(), con series que derivan despacio
+static size_t csvLog(char* log, size_t cap) {
+  float temp = 22, hum = 45, inner = 24, wind = 5;
+  int mq2 = 400, mq135 = 350, pm = 8;
+  size_t n = 0;
+  for (uint32_t i = 0;; i++) {
+    temp += (uniform01() - 0.5f) * 0.2f;
+    hum += (uniform01() - 0.5f) * 0.4f;
+    inner += (uniform01() - 0.5f) * 0.1f;
+    wind += (uniform01() - 0.5f) * 0.6f;
+    if (wind < 0) wind = 0;
+    mq2 += (int)((uniform01() - 0.5f) * 6);
+    mq135 += (int)((uniform01() - 0.5f) * 6);
+    pm += (int)((uniform01() - 0.5f) * 3);
+    if (pm < 0) pm = 0;
+
+    char line[128];
+    char* end = line + sizeof(line);
+    char* p = formatUint(line, end, 86400 + i * 5);
+    p = appendChar(p, end, 's');
+    const float fixed[] = {temp, hum, inner};
+    for (float v : fixed) p = formatFixed(appendChar(p, end, ','), end, v, 1);
+    p = formatInt(appendChar(p, end, ','), end, mq2);
+    p = formatInt(appendChar(p, end, ','), end, mq135);
+    const uint32_t pms[] = {(uint32_t)pm * 2 / 3, (uint32_t)pm, (uint32_t)pm * 4 / 3};
+    for (uint32_t v : pms) p = formatUint(appendChar(p, end, ','), end, v);
+    p = appendStr(p, end, ",0");
+    p = formatFixed(appendChar(p, end, ','), end, wind, 1);
+    p = formatFixed(appendChar(p, end, ','), end, wind * 1.6f, 1);
+    p = formatUint(appendChar(p, end, ','), end, (uint32_t)(uniform01() * 16) * 22);
+    p = appendStr(p, end, ",BAJA\n");
+    if (n + (p - line) > cap) return n;
+    memcpy(log + n, line, p - line);
+    n += p - line;
+  }
+}
+
+static void testLz() {
+  // Registros CSV en tramas de 1 KiB: la compresión debe ahorrar al menos un 30 %
+  static char log[64 * 1024];
+  size_t logLen = csvLog(log, sizeof(log));
+  size_t raw = 0;
+  size_t packed = 0;
+  for (size_t off = 0; off + kExportChunk <= logLen; off += kExportChunk) {
+    raw += kExportChunk;
+    packed += lzRoundTrip((const uint8_t*)log + off, kExportChunk);
+  }
+  CHECK(packed <= raw * 7 / 10);
+
+  // Repeticiones largas: copias solapadas y de más de 130 bytes
+  static uint8_t data[kExportChunk];
+  memset(data, 'a', sizeof(data));
+  CHECK(lzRoundTrip(data, sizeof(data)) < 40);
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = "abc"[i % 3];
+  CHECK(lzRoundTrip(data, sizeof(data)) < 40);
+
+  // Datos aleatorios no comprimen: lzCompress devuelve 0 y se envía en crudo
+  for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(uniform01() * 256);
+  static uint8_t out[kExportChunk];
+  CHECK(lzCompress(data, sizeof(data), out, sizeof(data) - 1) == 0);
+
+  // Tramas cortas y mezcla de literales con copias, a tamaños variables
+  for (int trial = 0; trial < 200; trial++) {
+    size_t len = 2 + (size_t)(uniform01() * (kExportChunk - 2));
+    for (size_t i = 0; i < len; i++) {
+      data[i] = (i > 8 && uniform01() < 0.6f) ? data[i - 1 - (size_t)(uniform01() * 8)]
+                                             : (uint8_t)(uniform01() * 256);
+    }
+    lzRoundTrip(data, len);
+  }
+
+  // Sin sitio para un solo token: 0
+  memset(data, 'z', 64);
+  CHECK(lzCompress(data, 64, out, 2) == 0);
+}
+
+// --- Transferencia masiva LoRa ---
+// Multiplicación en GF(256) bit a bit, como referencia de las tablas
+static uint8_t gfMulSlow(uint8_t a, uint8_t b) {
+  uint16_t x = a;
+  uint8_t r = 0;
+  for (; b; b >>= 1) {
+    if (b & 1) r ^= x;
+    x <<= 1;
+    if (x & 0x100) x ^= 0x11D;
+  }
+  return r;
+}
+
+// Codifica k + m fragmentos aleatorios, borra los marcados en lost y decodifica
+static bool fecRoundTrip(uint8_t k, uint8_t m, uint64_t lost) {
+  static uint8_t sent[BULK_MAX_FRAGS][BULK_FRAG_BYTES];
+  static uint8_t rx[BULK_MAX_FRAGS][BULK_FRAG_BYTES];
+  for (int i = 0; i < k; i++) {
+    for (int b = 0; b < BULK_FRAG_BYTES; b++) sent[i][b] = (uint8_t)(uniform01() * 256);
+  }
+  fecEncode(sent, k, m);
+  uint64_t received = 0;
+  memset(rx, 0xEE, sizeof(rx));
+  for (int i = 0; i < k + m; i++) {
+    if ((lost >> i) & 1) continue;
+    memcpy(rx[i], sent[i], BULK_FRAG_BYTES);
+    received |= 1ULL << i;
+  }
+  if (!fecDecode(rx, k, m, received)) return false;
+  return (received & ((1ULL << k) - 1)) == (1ULL << k) - 1 &&
+         memcmp(rx, sent, (size_t)k * BULK_FRAG_BYTES) == 0;
+}
+
+// Borra count fragmentos distintos al azar de los k + m
+static uint64_t randomErasures(uint8_t total, uint8_t count) {
+  uint64_t lost = 0;
+  while (count > 0) {
+    uint8_t i = (uint8_t)(uniform01() * total);
+    if ((lost >> i) & 1) continue;
+    lost |= 1ULL << i;
+    count--;
+  }
+  return lost;
+}
+
+static void testFec() {
+  gfBegin();
+  bool mulOk = true;
+  bool invOk = true;
+  for (int a = 0; a < 256; a++) {
+    for (int b = 0; b < 256; b++) {
+      if (gfMul(a, b) != gfMulSlow(a, b)) mulOk = false;
+    }
+    if (a && gfMul(a, gfExp[255 - gfLog[a]]) != 1) invOk = false;
+  }
+  CHECK(mulOk);
+  CHECK(invOk);
+
+  // Tamaño máximo con la redundancia del firmware (32+8): cualquier patrón de
+  // hasta m borrados se recupera, uno más no
+  const uint8_t k = BULK_MAX_DATA;
+  const uint8_t m = (BULK_MAX_DATA * 25 + 99) / 100;  // BULK_REDUNDANCIA_PCT 25
+  int recovered = 0;
+  const int kTrials = 500;
+  for (int t = 0; t < kTrials; t++) {
+    uint8_t erasures = (uint8_t)(uniform01() * (m + 1));
+    if (fecRoundTrip(k, m, randomErasures(k + m, erasures))) recovered++;
+  }
+  CHECK(recovered == kTrials);
+  CHECK(!fecRoundTrip(k, m, randomErasures(k + m, m + 1)));
+  CHECK(fecRoundTrip(k, m, 0));
+
+  // Todos los datos perdidos: solo con paridad (k <= m)
+  CHECK(fecRoundTrip(4, 4, 0x0F));
+  CHECK(fecRoundTrip(1, 1, 0x01));
+  // Límites de la cabecera: 32 datos y 16 de paridad, con los 16 borrados
+  CHECK(fecRoundTrip(BULK_MAX_DATA, BULK_MAX_PARITY, randomErasures(BULK_MAX_FRAGS,
+                                                                     BULK_MAX_PARITY)));
+  CHECK(fecRoundTrip(BULK_MAX_DATA, BULK_MAX_PARITY, 0xFFFF));
+
+  // Tiempo en el aire: calculadora de Semtech, preámbulo 8, CRC, cabecera explícita
+  CHECK(loraAirtimeMs(10, 7, 125E3, 5) == 42);    // 41,22 ms
+  CHECK(loraAirtimeMs(51, 7, 125E3, 5) == 103);   // 102,66 ms
+  CHECK(loraAirtimeMs(51, 9, 125E3, 5) == 329);   // 328,70 ms
+  CHECK(loraAirtimeMs(140, 7, 125E3, 5) == 231);  // fragmento masivo, 230,66 ms
+  CHECK(loraAirtimeMs(51, 7, 250E3, 5) == 52);    // 51,33 ms
+  CHECK(loraAirtimeMs(51, 7, 125E3, 8) == 152);   // 4/8: 151,81 ms
+  CHECK(loraAirtimeMs(0, 7, 125E3, 5) == 26);     // solo cabecera y CRC
+}
+
+// --- Resumen diario ---
+static DailySummary makeSummary(uint32_t startS, int32_t day) {
+  DailySummary s;
+  memset(&s, 0, sizeof(s));
+  s.magic = DAILY_MAGIC;
+  s.day = day;
+  s.startS = startS;
+  s.samples = 17280;
+  s.min[TEL_TEMP] = 12.5f;
+  s.max[TEL_TEMP] = 31.0f;
+  s.min[TEL_HUM] = 18.0f;
+  s.max[TEL_MQ2] = 420;
+  s.max[TEL_MQ135] = 380;
+  s.max[TEL_PM25] = 12;
+  s.max[TEL_VIENTO] = 35.5f;
+  s.secondsAtLevel[AL_BAJA] = 81900;
+  s.secondsAtLevel[AL_MEDIA] = 1800;
+  s.secondsAtLevel[AL_ALTA] = 2400;
+  s.secondsAtLevel[AL_CRITICA] = 300;
+  s.fwi = 14.2f;
+  s.crc = crc32Le(0, (const uint8_t*)&s, offsetof(DailySummary, crc));
+  return s;
+}
+
+static void testDaily() {
+  // Vector de referencia del CRC-32 de zlib
+  CHECK(crc32Le(0, (const uint8_t*)"123456789", 9) == 0xCBF43926u);
+  CHECK(crc32Le(crc32Le(0, (const uint8_t*)"1234", 4), (const uint8_t*)"56789", 5) == 0xCBF43926u);
+
+  setenv("TZ", ZONA_HORARIA, 1);
+  tzset();
+  DailySummary s = makeSummary(1720000000, 2024 * 366 + 184);  // 2024-07-03, 11:46 CEST
+  CHECK(dailySummaryValid(s));
+  char row[96];
+  dailySummaryRow(s, row, sizeof(row));
+  CHECK(strcmp(row, "2024-07-03,12.5,31.0,18.0,420,380,12,35.5,75,14.2") == 0);
+
+  // Sin reloj en hora: día del año contado desde el arranque
+  DailySummary early = makeSummary(3600, 1970 * 366 + 5);
+  dailySummaryRow(early, row, sizeof(row));
+  CHECK(strncmp(row, "d5,", 3) == 0);
+
+  DailySummary bad = s;
+  bad.max[TEL_TEMP] += 1;
+  CHECK(!dailySummaryValid(bad));
+  bad = s;
+  bad.magic ^= 1;
+  bad.crc = crc32Le(0, (const uint8_t*)&bad, offsetof(DailySummary, crc));
+  CHECK(!dailySummaryValid(bad));
+}
+
+// --- Respaldo en flash ---
+// Emulador de la partición LittleFS: flash NOR de bloques de 4 KB que se borran
+// enteros y se programan por páginas. Modelo simplificado de LittleFS: anexar a
+// un fichero copia su último bloque parcial a uno nuevo (copy-on-write), cada
+// cambio confirma una página en el par de metadatos, que se compacta (borra) al
+// llenarse, y los ficheros de pocos bytes van en línea en los metadatos. El
+// asignador recorre los bloques libres en orden, como el de LittleFS.
+class FlashEmulator {
+ public:
+  static const int kBlocks = 352;  // partición spiffs de 1,375 MB de la tabla por defecto
+  static const uint32_t kBlockBytes = 4096;
+  static const uint32_t kPageBytes = 256;
+  static const uint32_t kInlineMax = 64;
+  static const int64_t kProgramPageUs = 400;
+  static const int64_t kEraseUs = 45000;
+
+  FlashEmulator() : erases_(kBlocks, 0), used_(kBlocks, false), cursor_(2), metaPages_(0),
+                    clockUs_(0), erasesTotal_(0), programmed_(0) {
+    used_[0] = used_[1] = true;  // par de metadatos
+  }
+
+  bool exists(const char* path) { return files_.count(path) > 0; }
+  uint32_t size(const char* path) { return exists(path) ? files_[path].data.size() : 0; }
+
+  size_t append(const char* path, const uint8_t* data, size_t len, uint32_t& size) {
+    File& f = files_[path];
+    uint32_t old = f.data.size();
+    f.data.insert(f.data.end(), data, data + len);
+    uint32_t now = f.data.size();
+    if (now > kInlineMax) {
+      // Se reescribe el bloque parcial final y se añaden los que hagan falta
+      uint32_t start = (old > kInlineMax) ? old - old % kBlockBytes : 0;
+      if (old > kInlineMax && old % kBlockBytes != 0) {
+        release(f.blocks.back());
+        f.blocks.pop_back();
+      }
+      for (uint32_t off = start; off < now; off += kBlockBytes) {
+        int b = allocate();
+        f.blocks.push_back(b);
+        uint32_t bytes = now - off < kBlockBytes ? now - off : kBlockBytes;
+        program(bytes);
+      }
+    }
+    commit();
+    size = now;
+    return len;
+  }
+
+  size_t read(const char* path, uint32_t offset, uint8_t* buf, size_t len) {
+    if (!exists(path)) return 0;
+    const std::vector<uint8_t>& d = files_[path].data;
+    if (offset >= d.size()) return 0;
+    if (len > d.size() - offset) len = d.size() - offset;
+    memcpy(buf, &d[offset], len);
+    return len;
+  }
+
+  bool remove(const char* path) {
+    if (!exists(path)) return true;
+    for (int b : files_[path].blocks) release(b);
+    files_.erase(path);
+    commit();
+    return true;
+  }
+
+  bool rename(const char* from, const char* to) {
+    if (!exists(from)) return false;
+    if (exists(to)) {
+      for (int b : files_[to].blocks) release(b);
+    }
+    files_[to] = files_[from];
+    files_.erase(from);
+    commit();
+    return true;
+  }
+
+  bool writeAll(const char* path, const uint8_t* data, size_t len) {
+    if (exists(path)) {
+      for (int b : files_[path].blocks) release(b);
+      files_.erase(path);
+    }
+    uint32_t size;
+    append(path, data, len, size);
+    return true;
+  }
+
+  int64_t nowUs() { return clockUs_; }
+  void advance(int64_t us) { clockUs_ += us; }
+
+  uint32_t maxErases() const {
+    uint32_t m = 0;
+    for (uint32_t e : erases_) m = e > m ? e : m;
+    return m;
+  }
+  uint64_t erasesTotal() const { return erasesTotal_; }
+  uint64_t programmed() const { return programmed_; }
+
+ private:
+  struct File {
+    std::vector<uint8_t> data;
+    std::vector<int> blocks;
+  };
+
+  int allocate() {
+    for (int i = 0; i < kBlocks; i++) {
+      int b = cursor_;
+      cursor_ = (cursor_ + 1) % kBlocks;
+      if (used_[b]) continue;
+      used_[b] = true;
+      erase(b);
+      return b;
+    }
+    return -1;  // no llega a pasar: dos segmentos de 64 KB caben de sobra
+  }
+
+  void release(int b) { used_[b] = false; }
+
+  void erase(int b) {
+    erases_[b]++;
+    erasesTotal_++;
+    clockUs_ += kEraseUs;
+  }
+
+  void program(uint32_t bytes) {
+    uint32_t pages = (bytes + kPageBytes - 1) / kPageBytes;
+    programmed_ += pages * kPageBytes;
+    clockUs_ += pages * kProgramPageUs;
+  }
+
+  void commit() {
+    program(kPageBytes);
+    if (++metaPages_ < kBlockBytes / kPageBytes) return;
+    metaPages_ = 0;
+    erase(metaBlock_ ^= 1);
+  }
+
+  std::map<std::string, File> files_;
+  std::vector<uint32_t> erases_;
+  std::vector<bool> used_;
+  int cursor_;
+  uint32_t metaPages_;
+  int metaBlock_ = 0;
+  int64_t clockUs_;
+  uint64_t erasesTotal_;
+  uint64_t programmed_;
+};
+
+// Destino de migración: lo escrito queda pendiente hasta sync(); un fallo
+// (tarjeta extraída) pierde lo pendiente
+struct FlakySink {
+  std::string durable;
+  std::string pending;
+  size_t failAfter;  // bytes que acepta write() antes de fallar
+  size_t accepted;
+  uint32_t syncs;
+
+  bool write(const uint8_t* data, size_t len) {
+    if (accepted + len > failAfter) {
+      pending.clear();
+      return false;
+    }
+    accepted += len;
+    pending.append((const char*)data, len);
+    return true;
+  }
+
+  bool sync() {
+    durable += pending;
+    pending.clear();
+    syncs++;
+    return true;
+  }
+};
+
+static size_t fallbackLine(char* line, uint32_t seq) {
+  return snprintf(line, 96, "%us,%.1f,%.1f,%.1f,%d,%d,%u,%u,%u,0,%.1f,%.1f,%u,BAJA\n", seq * 5,
+                  20 + (seq % 70) / 10.0, 40 + (seq % 200) / 10.0, 24.5, 400 + (int)(seq % 37),
+                  350 + (int)(seq % 23), seq % 9, seq % 13, seq % 17, (seq % 90) / 10.0,
+                  (seq % 140) / 10.0, (seq % 16) * 22);
+}
+
+// Secuencias de las líneas en orden; false si alguna línea no es entera
+static bool lineSeqs(const std::string& text, std::vector<uint32_t>& seqs) {
+  size_t at = 0;
+  while (at < text.size()) {
+    size_t nl = text.find('\n', at);
+    if (nl == std::string::npos) return false;
+    std::string line = text.substr(at, nl - at);
+    char expect[96];
+    uint32_t seq = strtoul(line.c_str(), NULL, 10) / 5;
+    fallbackLine(expect, seq);
+    if (line + "\n" != expect) return false;
+    seqs.push_back(seq);
+    at = nl + 1;
+  }
+  return true;
+}
+
+static const char* const kFbActive = "/fb_0.log";
+static const char* const kFbOld = "/fb_1.log";
+static const char* const kFbPos = "/fb_pos";
+
+static void testFallback() {
+  // Una semana sin SD a 5 s por muestra: por lotes frente a una escritura por línea
+  const uint32_t kWeek = 7 * 24 * 720;
+  double years[2];
+  double meanMs[2];
+  for (int batched = 0; batched < 2; batched++) {
+    FlashEmulator flash;
+    FallbackLog<FlashEmulator> log(flash, kFbActive, kFbOld, kFbPos);
+    for (uint32_t seq = 0; seq < kWeek; seq++) {
+      char line[96];
+      size_t len = fallbackLine(line, seq);
+      log.append(line, len);
+      if (!batched) log.flush();
+      flash.advance(5000000);
+    }
+    const FallbackStats& st = log.stats();
+    meanMs[batched] = st.totalWriteUs / 1000.0 / st.flashWrites;
+    // LittleFS reubica el par de metadatos cada block_cycles borrados, así que a
+    // lo largo de la vida el desgaste se reparte: la media es la que cuenta
+    years[batched] = 100000.0 * FlashEmulator::kBlocks / flash.erasesTotal() / 52;
+    printf("respaldo %s: %u escrituras, media %.1f ms, max %.1f ms, %u rotaciones, "
+           "%llu borrados (max %u por bloque en la semana), %.1f MB programados; %.0f años hasta 100k ciclos\n",
+           batched ? "por lotes" : "por linea", (unsigned)st.flashWrites, meanMs[batched],
+           st.maxWriteUs / 1000.0, (unsigned)st.rotations,
+           (unsigned long long)flash.erasesTotal(), flash.maxErases(),
+           flash.programmed() / 1048576.0, years[batched]);
+    CHECK(st.rotations > 0);
+  }
+  CHECK(years[1] >= 4 * years[0]);
+  CHECK(years[1] > 20);
+
+  // Migración cortada a mitad del segmento antiguo y reanudada: todas las
+  // líneas, en orden, sin duplicados
+  {
+    FlashEmulator flash;
+    FallbackLog<FlashEmulator> log(flash, kFbActive, kFbOld, kFbPos);
+    std::string all;
+    for (uint32_t seq = 0; seq < 1600; seq++) {
+      char line[96];
+      size_t len = fallbackLine(line, seq);
+      log.append(line, len);
+      all.append(line, len);
+    }
+    CHECK(log.flush());
+    CHECK(log.stats().rotations == 1);
+    CHECK(log.size() == all.size());
+    uint8_t head[64];
+    CHECK(log.read(0, head, sizeof(head)) == sizeof(head) && memcmp(head, all.data(), 64) == 0);
+
+    FlakySink sink = {"", "", 20000, 0, 0};
+    CHECK(!log.migrate(sink));
+    CHECK(sink.durable.size() >= 2 * FALLBACK_SYNC_BYTES && sink.durable.size() < 20000);
+    CHECK(sink.durable[sink.durable.size() - 1] == '\n');
+    CHECK(log.size() == all.size() - sink.durable.size());
+    uint8_t next[64];
+    CHECK(log.read(0, next, sizeof(next)) == sizeof(next) &&
+          memcmp(next, all.data() + sink.durable.size(), 64) == 0);
+
+    sink.failAfter = (size_t)-1;
+    CHECK(log.migrate(sink));
+    CHECK(sink.durable == all);
+    CHECK(log.size() == 0);
+    CHECK(!flash.exists(kFbOld) && !flash.exists(kFbActive) && !flash.exists(kFbPos));
+    CHECK(log.stats().migrated == all.size());
+  }
+
+  // Cortes repetidos, con rotaciones entre intentos que descartan el segmento a
+  // medio migrar: lo que llega está en orden y sin duplicados
+  {
+    FlashEmulator flash;
+    FallbackLog<FlashEmulator> log(flash, kFbActive, kFbOld, kFbPos);
+    FlakySink sink = {"", "", 0, 0, 0};
+    uint32_t seq = 0;
+    for (int attempt = 0; attempt < 12; attempt++) {
+      for (int i = 0; i < 700; i++) {
+        char line[96];
+        size_t len = fallbackLine(line, seq++);
+        log.append(line, len);
+      }
+      sink.failAfter = sink.accepted + 3000 + (size_t)(uniform01() * 30000);
+      log.migrate(sink);
+    }
+    sink.failAfter = (size_t)-1;
+    CHECK(log.migrate(sink));
+    std::vector<uint32_t> seqs;
+    CHECK(lineSeqs(sink.durable, seqs));
+    bool increasing = true;
+    for (size_t i = 1; i < seqs.size(); i++) {
+      if (seqs[i] <= seqs[i - 1]) increasing = false;
+    }
+    CHECK(increasing);
+    CHECK(!seqs.empty() && seqs.back() == seq - 1);
+  }
+
+  // Resúmenes diarios: registros binarios, la migración cortada se reanuda en
+  // el límite de un registro y el destino recibe cada día una sola vez
+  {
+    FlashEmulator flash;
+    FallbackLog<FlashEmulator> log(flash, "/resumen_diario.bin", "/resumen_diario_1.bin",
+                                   "/resumen_pos", sizeof(DailySummary));
+    std::string all;
+    bool written = true;
+    for (uint32_t day = 0; day < 600; day++) {
+      DailySummary s = makeSummary(1700000000 + day * 86400, 2023 * 366 + day);
+      written = log.append(&s, sizeof(s)) && log.flush() && written;
+      all.append((const char*)&s, sizeof(s));
+    }
+    CHECK(written);
+    CHECK(log.stats().rotations == 1);
+    CHECK(log.size() == all.size());
+
+    FlakySink sink = {"", "", 20000, 0, 0};
+    CHECK(!log.migrate(sink));
+    CHECK(!sink.durable.empty() && sink.durable.size() % sizeof(DailySummary) == 0);
+    DailySummary next;
+    CHECK(log.read(0, (uint8_t*)&next, sizeof(next)) == sizeof(next) && dailySummaryValid(next) &&
+          memcmp(&next, all.data() + sink.durable.size(), sizeof(next)) == 0);
+    sink.failAfter = (size_t)-1;
+    CHECK(log.migrate(sink));
+    CHECK(sink.durable == all);
+  }
+}
+
+// --- Registro crudo en anillo ---
+// Tarjeta SD en memoria con un modelo de coste por sector escrito: 0,25 ms de
+// transferencia SPI a 20 MHz más 1 ms de programación si la escritura sigue a
+// la anterior (mismo sector o el siguiente) o 4 ms si salta a otra zona (FAT,
+// directorio, superbloque) y la tarjeta tiene que cambiar de unidad de
+// asignación. Son valores típicos de tarjetas baratas, no una medida.
+struct MemCard {
+  static const int64_t kTransferUs = 250;
+  static const int64_t kSequentialUs = 1000;
+  static const int64_t kJumpUs = 4000;
+
+  std::vector<uint8_t> data;
+  uint32_t lastLba;
+  uint64_t writes;
+  uint64_t jumps;
+  int64_t busyUs;
+  uint64_t failAfter;  // escrituras que acepta antes de fallar (tarjeta extraída)
+
+  explicit MemCard(uint32_t sectors)
+      : data((size_t)sectors * RAW_SECTOR_SIZE, 0), lastLba(0), writes(0), jumps(0), busyUs(0),
+        failAfter(~0ull) {}
+
+  uint32_t sectors() { return data.size() / RAW_SECTOR_SIZE; }
+
+  bool readSector(uint32_t lba, uint8_t* buf) {
+    memcpy(buf, &data[(size_t)lba * RAW_SECTOR_SIZE], RAW_SECTOR_SIZE);
+    return true;
+  }
+
+  bool writeSector(uint32_t lba, const uint8_t* buf) {
+    if (writes >= failAfter) return false;
+    charge(lba);
+    memcpy(&data[(size_t)lba * RAW_SECTOR_SIZE], buf, RAW_SECTOR_SIZE);
+    return true;
+  }
+
+  void charge(uint32_t lba) {
+    bool sequential = writes > 0 && (lba == lastLba || lba == lastLba + 1);
+    busyUs += kTransferUs + (sequential ? kSequentialUs : kJumpUs);
+    jumps += !sequential;
+    writes++;
+    lastLba = lba;
+  }
+};
+
+// El camino FAT del firmware: fichero abierto, FatFs guarda el sector parcial
+// en el búfer del fichero y cada SD_SYNC_MS escribe ese sector, la entrada de
+// directorio y, si se asignó un clúster, las dos copias de la FAT.
+struct FatPathModel {
+  static const uint32_t kFatLba = 32;
+  static const uint32_t kFatCopyLba = 32 + 7600;
+  static const uint32_t kDirLba = 32 + 2 * 7600;
+  static const uint32_t kDataLba = 40000;
+  static const uint32_t kClusterSectors = 64;
+
+  MemCard& card;
+  uint32_t size;
+  bool bufferDirty;
+  bool fatDirty;
+  uint64_t metadataWrites;
+
+  void append(uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+      if (size % (kClusterSectors * RAW_SECTOR_SIZE) == 0) fatDirty = true;
+      size++;
+      bufferDirty = true;
+      if (size % RAW_SECTOR_SIZE == 0) {
+        card.charge(kDataLba + size / RAW_SECTOR_SIZE - 1);
+        bufferDirty = false;
+      }
+    }
+  }
+
+  void sync() {
+    if (bufferDirty) card.charge(kDataLba + size / RAW_SECTOR_SIZE);
+    if (fatDirty) {
+      card.charge(kFatLba + size / (kClusterSectors * RAW_SECTOR_SIZE) / 128);
+      card.charge(kFatCopyLba + size / (kClusterSectors * RAW_SECTOR_SIZE) / 128);
+      metadataWrites += 2;
+      fatDirty = false;
+    }
+    card.charge(kDirLba);
+    metadataWrites++;
+  }
+};
+
+static SampleRecord rawSample(uint32_t i) {
+  SampleRecord s;
+  memset(&s, 0, sizeof(s));
+  s.readUs = (int64_t)i * 5000000;
+  s.temperature = 18.5f + (i % 40) / 4.0f;
+  s.humidity = 35.0f + (i % 30);
+  s.internalTemperature = 24.1f;
+  s.mq2 = 400 + i % 50;
+  s.mq135 = 350 + i % 20;
+  s.pm25 = i % 60;
+  s.level = (AlertLevel)(i % 4);
+  s.pmValid = true;
+  s.flame = i % 97 == 0;
+  s.windKmh = (i % 120) / 4.0f;
+  s.gustKmh = s.windKmh + 3.5f;
+  s.windDirDeg = (i * 22) % 360;
+  return s;
+}
+
+// Los registros del anillo en orden; false si alguno no es válido
+static bool ringRecords(RawRing<MemCard>& ring, std::vector<RawRecord>& out) {
+  uint32_t size = ring.size();
+  out.resize(size / sizeof(RawRecord));
+  if (ring.read(0, (uint8_t*)out.data(), size) != size) return false;
+  for (const RawRecord& rec : out) {
+    if (!rawRecordValid(rec)) return false;
+  }
+  return true;
+}
+
+// Destino de migración del modo crudo, como RawRingSink del firmware
+struct TestRingSink {
+  RawRing<MemCard>* ring;
+
+  bool write(const uint8_t* data, size_t len) {
+    for (size_t at = 0; at + sizeof(RawRecord) <= len; at += sizeof(RawRecord)) {
+      RawRecord rec;
+      memcpy(&rec, data + at, sizeof(rec));
+      if (!ring->append(rec)) return false;
+    }
+    return true;
+  }
+
+  bool sync() { return ring->storeSuperblock(); }
+};
+
+// Los valores de RAW_FIRST_SECTOR y RAW_SUPERBLOCK_EVERY del firmware
+static const uint32_t kRawFirstSector = 2048;
+static const uint32_t kRawSuperblockEvery = 64;
+
+static void testRawRing() {
+  // Codificación y CSV
+  RawRecord rec = rawEncode(rawSample(97));
+  CHECK(rec.timeS == 485 && rec.temperature10 == 228 && rec.wind10 == 243 && rec.flags == 12);
+  rec.seq = 7;
+  rec.crc = crc32Le(0, (const uint8_t*)&rec, offsetof(RawRecord, crc));
+  CHECK(rawRecordValid(rec));
+  char line[160];
+  char* p = appendRawCsv(line, line + sizeof(line), rec);
+  *p = 0;
+  CHECK(strcmp(line, "7,485,22.8,42.0,24.1,447,367,37,24.3,27.8,334,0,0,1,1,MEDIA\n") == 0);
+
+  // Anexar, reiniciar sin superbloque al día y recuperar la posición
+  {
+    MemCard card(16 + 1 + 64);
+    RawRing<MemCard> ring(card, 16, 4);
+    CHECK(ring.mount() == RAW_SIN_ANILLO);
+    CHECK(ring.format());
+    for (uint32_t i = 0; i < 100; i++) ring.append(rawEncode(rawSample(i)));
+    CHECK(ring.nextSeq() == 101 && ring.size() == 100 * sizeof(RawRecord));
+
+    RawRing<MemCard> again(card, 16, 4);
+    CHECK(again.mount() == RAW_MONTADO);
+    CHECK(again.nextSeq() == 101 && again.superblock().head == 6);
+    std::vector<RawRecord> recs;
+    CHECK(ringRecords(again, recs) && recs.size() == 100);
+    bool same = true;
+    for (uint32_t i = 0; i < recs.size(); i++) {
+      RawRecord expect = rawEncode(rawSample(i));
+      same = same && recs[i].seq == i + 1 && recs[i].timeS == expect.timeS &&
+             recs[i].mq2 == expect.mq2 && recs[i].windDir == expect.windDir;
+    }
+    CHECK(same);
+
+    // Lecturas de bytes sueltos, cruzando sectores, iguales a la secuencia entera
+    const uint8_t* whole = (const uint8_t*)recs.data();
+    uint8_t part[700];
+    CHECK(again.read(500, part, sizeof(part)) == sizeof(part) &&
+          memcmp(part, whole + 500, sizeof(part)) == 0);
+    CHECK(again.read(3190, part, sizeof(part)) == 10 && memcmp(part, whole + 3190, 10) == 0);
+    CHECK(again.read(3200, part, sizeof(part)) == 0);
+
+    // Escritura cortada: el último registro no vale y se reescribe
+    RawRecord* last = (RawRecord*)&card.data[(16 + 1 + 6) * RAW_SECTOR_SIZE] + 3;
+    last->crc ^= 1;
+    RawRing<MemCard> torn(card, 16, 4);
+    CHECK(torn.mount() == RAW_MONTADO && torn.nextSeq() == 100);
+  }
+
+  // Dos cortes seguidos: los sectores recorridos al recuperar cuentan para el
+  // siguiente superbloque, o el segundo arranque no llegaría a la cabeza
+  {
+    MemCard card(16 + 1 + 64);
+    RawRing<MemCard> ring(card, 16, 4);
+    ring.format();
+    for (uint32_t i = 0; i < 48; i++) ring.append(rawEncode(rawSample(i)));
+    RawRing<MemCard> second(card, 16, 4);
+    CHECK(second.mount() == RAW_MONTADO && second.nextSeq() == 49);
+    for (uint32_t i = 48; i < 101; i++) second.append(rawEncode(rawSample(i)));
+    RawRing<MemCard> third(card, 16, 4);
+    CHECK(third.mount() == RAW_MONTADO && third.nextSeq() == 102);
+  }
+
+  // Vuelta completa: se conservan los sectores más recientes, en orden
+  {
+    MemCard card(8 + 1 + 10);
+    RawRing<MemCard> ring(card, 8, 4);
+    ring.format();
+    for (uint32_t i = 0; i < 500; i++) ring.append(rawEncode(rawSample(i)));
+    std::vector<RawRecord> recs;
+    CHECK(ringRecords(ring, recs) && recs.size() == 9 * 16 + 500 % 16);
+    bool contiguous = recs.back().seq == 500;
+    for (size_t i = 1; i < recs.size(); i++) contiguous = contiguous && recs[i].seq == recs[i - 1].seq + 1;
+    CHECK(contiguous);
+    RawRing<MemCard> again(card, 8, 4);
+    CHECK(again.mount() == RAW_MONTADO && again.nextSeq() == 501 && again.size() == ring.size());
+  }
+
+  // Respaldo en flash de registros crudos migrado al anillo con la tarjeta
+  // extraída a mitad: tras volver a montar, todos los registros en orden y como
+  // mucho un lote repetido
+  {
+    FlashEmulator flash;
+    FallbackLog<FlashEmulator> log(flash, kFbActive, kFbOld, kFbPos, sizeof(RawRecord),
+                                   FALLBACK_BATCH_BYTES);
+    const uint32_t kRecords = 3000;
+    for (uint32_t i = 0; i < kRecords; i++) {
+      RawRecord r = rawEncode(rawSample(i));
+      log.append(&r, sizeof(r));
+    }
+    MemCard card(16 + 1 + 512);
+    RawRing<MemCard> ring(card, 16, 4);
+    ring.format();
+    card.failAfter = card.writes + 1234;
+    TestRingSink sink = {&ring};
+    CHECK(!log.migrate(sink));
+    card.failAfter = ~0ull;
+    RawRing<MemCard> remounted(card, 16, 4);
+    CHECK(remounted.mount() == RAW_MONTADO);
+    TestRingSink retry = {&remounted};
+    CHECK(log.migrate(retry));
+    std::vector<RawRecord> recs;
+    CHECK(ringRecords(remounted, recs));
+    uint32_t expect = 0;
+    uint32_t repeated = 0;
+    for (const RawRecord& r : recs) {
+      if (r.timeS / 5 < expect) {
+        repeated++;
+      } else if (r.timeS / 5 == expect) {
+        expect++;
+      }
+    }
+    CHECK(expect == kRecords);
+    CHECK(repeated < RAW_RECORDS_PER_SECTOR);
+    printf("crudo, migracion cortada: %u registros, %u repetidos\n", (unsigned)expect,
+           (unsigned)repeated);
+  }
+
+  // Un día a 5 s por muestra: anillo crudo frente al camino FAT con
+  // sincronización cada 10 s y líneas de 58 bytes
+  {
+    const uint32_t kDay = 17280;
+    MemCard rawCard(kRawFirstSector + 1 + 2048);
+    RawRing<MemCard> ring(rawCard, kRawFirstSector, kRawSuperblockEvery);
+    ring.format();
+    MemCard fatCard(1);
+    FatPathModel fat = {fatCard, 0, false, false, 0};
+    int64_t rawMax = 0;
+    int64_t fatMax = 0;
+    uint64_t superblocks = 0;
+    for (uint32_t i = 0; i < kDay; i++) {
+      int64_t before = rawCard.busyUs;
+      uint32_t sectorBefore = ring.superblock().head;
+      ring.append(rawEncode(rawSample(i)));
+      if (ring.superblock().head != sectorBefore && ring.superblock().head % kRawSuperblockEvery == 0) {
+        superblocks++;
+      }
+      int64_t cost = rawCard.busyUs - before;
+      rawMax = cost > rawMax ? cost : rawMax;
+
+      before = fatCard.busyUs;
+      fat.append(58);
+      if (i % 2 == 1) fat.sync();
+      cost = fatCard.busyUs - before;
+      fatMax = cost > fatMax ? cost : fatMax;
+    }
+    printf("SD cruda: %.2f escrituras/muestra, %llu de metadatos/dia, media %.2f ms, max %.2f ms\n",
+           rawCard.writes / (double)kDay, (unsigned long long)superblocks,
+           rawCard.busyUs / 1000.0 / kDay, rawMax / 1000.0);
+    printf("SD FAT:   %.2f escrituras/muestra, %llu de metadatos/dia, media %.2f ms, max %.2f ms\n",
+           fatCard.writes / (double)kDay, (unsigned long long)fat.metadataWrites,
+           fatCard.busyUs / 1000.0 / kDay, fatMax / 1000.0);
+    CHECK(superblocks * 100 < fat.metadataWrites);
+    CHECK(rawCard.busyUs < fatCard.busyUs);
+    CHECK(rawMax < fatMax);
+  }
+}
+
+int main() {
+  testUlpWatch();
+  testFormat();
+  testPmsParser();
+  testMqHeater();
+  testWind();
+  testFwi();
+  testQuantile();
+  testAdaptive();
+  testPowerFail();
+  testEnergy();
+  testSolarYear();
+  testTrend();
+  testLz();
+  testFec();
+  testDaily();
+  testFallback();
+  testRawRing();
+  printf("%d comprobaciones, %d fallos\n", checks, failures);
+  return failures ? 1 : 0;
+}
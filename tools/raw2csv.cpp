@@ -0,0 +1,99 @@
+// Registro crudo a CSV en el host. Acepta una imagen de la tarjeta (dd de la
+// SD entera: el anillo se recupera igual que al arrancar el nodo) o los
+// registros tal cual, como los entrega la exportación en modo crudo.
+//
+//   make -C tools
+//   sudo dd if=/dev/sdX of=tarjeta.img bs=1M
+//   tools/raw2csv tarjeta.img > log.csv
+//   tools/raw2csv anillo_crudo.bin > log.csv
+//
+// Los registros con CRC erróneo o con seq ya vista (exportaciones reanudadas
+// o solapadas) se omiten.
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "../nucleo.h"
+
+// Los valores de RAW_FIRST_SECTOR y RAW_SUPERBLOCK_EVERY del firmware
+static const uint32_t kFirstSector = 2048;
+static const uint32_t kSuperblockEvery = 64;
+
+// Imagen de la tarjeta, solo lectura
+struct ImageFile {
+  FILE* file;
+  uint32_t count;
+
+  uint32_t sectors() { return count; }
+  bool readSector(uint32_t lba, uint8_t* buf) {
+    return fseeko(file, (off_t)lba * RAW_SECTOR_SIZE, SEEK_SET) == 0 &&
+           fread(buf, RAW_SECTOR_SIZE, 1, file) == 1;
+  }
+  bool writeSector(uint32_t, const uint8_t*) { return false; }
+};
+
+struct CsvWriter {
+  uint32_t lastSeq;
+  uint32_t written;
+  uint32_t corrupt;
+  uint32_t repeated;
+
+  void put(const RawRecord& rec) {
+    if (!rawRecordValid(rec)) {
+      corrupt++;
+      return;
+    }
+    if (written > 0 && rec.seq <= lastSeq) {
+      repeated++;
+      return;
+    }
+    char line[160];
+    char* end = line + sizeof(line);
+    char* p = appendRawCsv(line, end, rec);
+    if (p == end) return;
+    fwrite(line, 1, p - line, stdout);
+    lastSeq = rec.seq;
+    written++;
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "uso: %s tarjeta.img | anillo_crudo.bin\n", argv[0]);
+    return 2;
+  }
+  FILE* file = fopen(argv[1], "rb");
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+  fseeko(file, 0, SEEK_END);
+  off_t bytes = ftello(file);
+
+  puts(RAW_CSV_HEADER);
+  CsvWriter csv = {0, 0, 0, 0};
+  ImageFile image = {file, (uint32_t)(bytes / RAW_SECTOR_SIZE)};
+  RawRing<ImageFile> ring(image, kFirstSector, kSuperblockEvery);
+  RawRecord rec;
+  if (ring.mount() == RAW_MONTADO) {
+    uint32_t size = ring.size();
+    fprintf(stderr, "Imagen: anillo de %u sectores, %u registros\n",
+            (unsigned)ring.superblock().sectorCount, (unsigned)(size / sizeof(RawRecord)));
+    for (uint32_t offset = 0; offset < size; offset += sizeof(rec)) {
+      if (ring.read(offset, (uint8_t*)&rec, sizeof(rec)) != sizeof(rec)) {
+        fprintf(stderr, "Error de lectura en el registro %u\n", (unsigned)(offset / sizeof(rec)));
+        break;
+      }
+      csv.put(rec);
+    }
+  } else {
+    fseeko(file, 0, SEEK_SET);
+    while (fread(&rec, sizeof(rec), 1, file) == 1) csv.put(rec);
+  }
+  fclose(file);
+  fprintf(stderr, "%u registros", (unsigned)csv.written);
+  if (csv.corrupt) fprintf(stderr, ", %u corruptos omitidos", (unsigned)csv.corrupt);
+  if (csv.repeated) fprintf(stderr, ", %u repetidos omitidos", (unsigned)csv.repeated);
+  fputc('\n', stderr);
+  return 0;
+}
@@ -0,0 +1,420 @@
+// Receptor de la orden "exportar" en el host. Guarda los bytes del log del nodo
+// en una copia espejo (mismo offset que en la SD) y la reescribe en columnas:
+// un fichero por campo, un valor por línea. Si la transferencia se corta, la
+// siguiente ejecución pide la exportación desde donde se quedó la copia.
+//
+//   make -C tools
+//   tools/recibir_log /dev/ttyUSB0 salida/
+//   tools/recibir_log captura.bin salida/    (tramas guardadas de antes)
+//
+// La copia se llama como el fichero del nodo (salida/log_incendios.txt o
+// salida/anillo_crudo.bin) y las columnas salida/<campo>.col. Ctrl-C aborta la
+// exportación en el nodo y deja la copia lista para reanudar.
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../nucleo.h"
+
+// Los valores de SERIAL_BAUD, EXPORT_CHUNK, EXPORT_FRAME_OVERHEAD, EXPORT_ABORT
+// y RAW_EXPORT_NAME del firmware
+static const uint32_t kSerialBaud = 115200;
+static const size_t kExportChunk = 1024;
+static const size_t kFrameOverhead = 13;
+static const uint8_t kExportAbort = 0x18;
+static const char kRawExportName[] = "/anillo_crudo.bin";
+static const int kSilenceMs = 3000;  // sin bytes tanto tiempo: enlace perdido
+
+enum ExportFrameType : uint8_t {
+  EXP_CABECERA = 'H',
+  EXP_DATOS = 'D',
+  EXP_LZ = 'Z',
+  EXP_FIN = 'E'
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int) { interrupted = 1; }
+
+static int64_t nowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static bool baudConstant(uint32_t baud, speed_t& speed) {
+  switch (baud) {
+    case 115200: speed = B115200; return true;
+    case 230400: speed = B230400; return true;
+    case 460800: speed = B460800; return true;
+    case 921600: speed = B921600; return true;
+    default: return false;
+  }
+}
+
+static bool setBaud(int fd, uint32_t baud) {
+  speed_t speed;
+  struct termios tio;
+  if (!baudConstant(baud, speed) || tcgetattr(fd, &tio) != 0) return false;
+  cfmakeraw(&tio);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 1;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  return tcsetattr(fd, TCSADRAIN, &tio) == 0;
+}
+
+// Copia espejo del log: cada trama se escribe en su offset, así reanudar es
+// pedir el tamaño de la copia
+struct Mirror {
+  std::string dir;
+  std::string path;
+  FILE* file;
+  bool raw;
+
+  bool open(const char* name) {
+    const char* base = strrchr(name, '/');
+    path = dir + "/" + (base ? base + 1 : name);
+    raw = strcmp(name, kRawExportName) == 0;
+    file = fopen(path.c_str(), "r+b");
+    if (!file) file = fopen(path.c_str(), "w+b");
+    return file != NULL;
+  }
+
+  uint32_t size() {
+    fseek(file, 0, SEEK_END);
+    return (uint32_t)ftell(file);
+  }
+
+  bool write(uint32_t offset, const uint8_t* data, size_t len) {
+    return fseek(file, offset, SEEK_SET) == 0 && fwrite(data, 1, len, file) == len;
+  }
+};
+
+// Tamaño de la copia que dejó la ejecución anterior; se busca por las dos
+// rutas porque aún no se sabe qué modo tiene el nodo
+static uint32_t resumeOffset(const std::string& dir) {
+  static const char* names[] = {"log_incendios.txt", "anillo_crudo.bin"};
+  uint32_t offset = 0;
+  for (const char* name : names) {
+    struct stat st;
+    if (stat((dir + "/" + name).c_str(), &st) == 0 && (uint32_t)st.st_size > offset) {
+      offset = st.st_size;
+    }
+  }
+  return offset;
+}
+
+struct Transfer {
+  Mirror mirror;
+  uint32_t fileSize;
+  uint32_t end;
+  uint32_t baud;
+  uint32_t expected;  // offset de la siguiente trama de datos
+  uint32_t logBytes;  // bytes del log recibidos en esta ejecución
+  uint32_t lineBytes; // bytes por la línea, tramas incluidas
+  uint32_t badFrames;
+  int64_t startMs;
+  bool started;
+  bool gap;           // falta una trama: se aborta y se reanuda desde expected
+  bool finished;
+  bool complete;
+  uint32_t nodeRead, nodeSent, nodeMs;
+};
+
+// Devuelve false si la trama no es del formato (y hay que resincronizar)
+static bool handleFrame(Transfer& t, uint8_t type, uint32_t offset, const uint8_t* payload,
+                        size_t len) {
+  static uint8_t unpacked[kExportChunk];
+  switch (type) {
+    case EXP_CABECERA: {
+      if (len < 15) return false;
+      memcpy(&t.fileSize, payload, 4);
+      memcpy(&t.end, payload + 4, 4);
+      memcpy(&t.baud, payload + 8, 4);
+      std::string name((const char*)payload + 14, len - 14);
+      if (!t.mirror.open(name.c_str())) {
+        perror(t.mirror.path.c_str());
+        exit(1);
+      }
+      t.expected = offset;
+      t.started = true;
+      t.startMs = nowMs();
+      fprintf(stderr, "Cabecera: %s, %u B en el nodo, de %u a %u, %u baudios\n", name.c_str(),
+              (unsigned)t.fileSize, (unsigned)offset, (unsigned)t.end, (unsigned)t.baud);
+      return true;
+    }
+    case EXP_DATOS:
+    case EXP_LZ: {
+      // Restos de una exportación anterior, o lo que llega tras un hueco
+      // mientras el nodo atiende el aborto
+      if (!t.started || t.gap) return true;
+      if (type == EXP_LZ) {
+        len = lzDecompress(payload, len, unpacked, sizeof(unpacked));
+        if (len == 0) return false;
+        payload = unpacked;
+      }
+      if (offset < t.expected) return true;  // repetida
+      if (offset > t.expected) {
+        fprintf(stderr, "Trama en %u, se esperaba %u: falta una trama\n", (unsigned)offset,
+                (unsigned)t.expected);
+        t.gap = true;
+        return true;
+      }
+      if (!t.mirror.write(offset, payload, len)) {
+        perror(t.mirror.path.c_str());
+        exit(1);
+      }
+      t.expected += len;
+      t.logBytes += len;
+      return true;
+    }
+    case EXP_FIN:
+      if (len < 13) return false;
+      memcpy(&t.nodeRead, payload, 4);
+      memcpy(&t.nodeSent, payload + 4, 4);
+      memcpy(&t.nodeMs, payload + 8, 4);
+      t.complete = payload[12] == 1 && t.started && t.expected == t.end;
+      t.finished = true;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Busca tramas en buf y consume lo que ya no puede formar parte de una. Lo que
+// no es trama (eco de la consola, texto de otras tareas) se salta.
+static size_t parseFrames(Transfer& t, const uint8_t* buf, size_t len, bool& headerSeen) {
+  size_t i = 0;
+  while (i + kFrameOverhead <= len && !t.finished) {
+    if (buf[i] != 0xA5 || buf[i + 1] != 0x5A) {
+      i++;
+      continue;
+    }
+    size_t payloadLen = buf[i + 3] | (buf[i + 4] << 8);
+    if (payloadLen > kExportChunk) {
+      i++;
+      continue;
+    }
+    if (i + kFrameOverhead + payloadLen > len) break;  // falta el resto
+    uint32_t crc;
+    memcpy(&crc, buf + i + 9 + payloadLen, 4);
+    uint32_t offset;
+    memcpy(&offset, buf + i + 5, 4);
+    uint8_t type = buf[i + 2];
+    if (crc != crc32Le(0, buf + i + 2, 7 + payloadLen) ||
+        !handleFrame(t, type, offset, buf + i + 9, payloadLen)) {
+      t.badFrames++;
+      i++;
+      continue;
+    }
+    if (type == EXP_CABECERA) {
+      headerSeen = true;
+      return i + kFrameOverhead + payloadLen;  // el resto llega ya a otra velocidad
+    }
+    if (t.started) t.lineBytes += kFrameOverhead + payloadLen;
+    i += kFrameOverhead + payloadLen;
+  }
+  return i;
+}
+
+static bool writeColumns(const std::string& dir, const std::vector<std::string>& names,
+                         std::vector<FILE*>& columns) {
+  for (const std::string& name : names) {
+    std::string path = dir + "/" + name + ".col";
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+      perror(path.c_str());
+      return false;
+    }
+    columns.push_back(f);
+  }
+  return true;
+}
+
+// Una línea CSV repartida entre las columnas; las que no tienen todos los
+// campos (la primera tras un hueco, la última a medias) se descartan
+static bool putCsvLine(const char* line, size_t len, std::vector<FILE*>& columns) {
+  size_t fields = 1;
+  for (size_t i = 0; i < len; i++) fields += line[i] == ',';
+  if (fields != columns.size()) return false;
+  size_t col = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i == len || line[i] == ',') {
+      fwrite(line + start, 1, i - start, columns[col]);
+      fputc('\n', columns[col]);
+      col++;
+      start = i + 1;
+    }
+  }
+  return true;
+}
+
+static std::vector<std::string> splitHeader(const char* header, size_t len) {
+  std::vector<std::string> names;
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i == len || header[i] == ',') {
+      names.push_back(std::string(header + start, i - start));
+      start = i + 1;
+    }
+  }
+  return names;
+}
+
+// Rehace las columnas desde la copia entera: después de reanudar no queda
+// ninguna línea partida entre dos ejecuciones
+static uint32_t rebuildColumns(Mirror& mirror) {
+  uint32_t size = mirror.size();
+  std::vector<char> data(size);
+  fseek(mirror.file, 0, SEEK_SET);
+  if (size == 0 || fread(data.data(), 1, size, mirror.file) != size) return 0;
+
+  std::vector<FILE*> columns;
+  uint32_t rows = 0;
+  if (mirror.raw) {
+    std::vector<std::string> names = splitHeader(RAW_CSV_HEADER, strlen(RAW_CSV_HEADER));
+    if (!writeColumns(mirror.dir, names, columns)) return 0;
+    uint32_t lastSeq = 0;
+    for (uint32_t offset = 0; offset + sizeof(RawRecord) <= size; offset += sizeof(RawRecord)) {
+      RawRecord rec;
+      memcpy(&rec, data.data() + offset, sizeof(rec));
+      if (!rawRecordValid(rec) || (rows > 0 && rec.seq <= lastSeq)) continue;
+      char line[160];
+      char* end = line + sizeof(line);
+      char* p = appendRawCsv(line, end, rec);
+      if (p == end) continue;
+      rows += putCsvLine(line, p - line - 1, columns);
+      lastSeq = rec.seq;
+    }
+  } else {
+    const char* p = data.data();
+    const char* end = p + size;
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    if (nl == NULL || strncmp(p, "tiempo,", 7) != 0) {
+      fprintf(stderr, "La copia no empieza por la cabecera del log: sin columnas\n");
+      return 0;
+    }
+    if (!writeColumns(mirror.dir, splitHeader(p, nl - p), columns)) return 0;
+    for (p = nl + 1; p < end; p = nl + 1) {
+      nl = (const char*)memchr(p, '\n', end - p);
+      if (nl == NULL) break;
+      rows += putCsvLine(p, nl - p, columns);
+    }
+  }
+  for (FILE* f : columns) fclose(f);
+  return rows;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "uso: %s /dev/ttyUSB0 | captura.bin  directorio\n", argv[0]);
+    return 2;
+  }
+  Transfer t = Transfer();
+  t.mirror.dir = argv[2];
+  mkdir(argv[2], 0755);
+
+  int fd = open(argv[1], O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  bool tty = isatty(fd);
+  uint32_t resume = resumeOffset(t.mirror.dir);
+  if (tty) {
+    if (!setBaud(fd, kSerialBaud)) {
+      perror(argv[1]);
+      return 1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    char command[32];
+    int n = snprintf(command, sizeof(command), "exportar %u\n", (unsigned)resume);
+    if (write(fd, command, n) != n) {
+      perror(argv[1]);
+      return 1;
+    }
+    fprintf(stderr, "Pedido: %s", command);
+    signal(SIGINT, onInterrupt);
+  }
+
+  std::vector<uint8_t> buf;
+  uint8_t in[4096];
+  int64_t lastByteMs = nowMs();
+  bool aborted = false;
+  while (!t.finished) {
+    if ((interrupted || t.gap) && !aborted) {
+      if (!tty) break;
+      uint8_t abort = kExportAbort;
+      if (write(fd, &abort, 1) == 1) aborted = true;
+    }
+    ssize_t n = read(fd, in, sizeof(in));
+    if (n < 0 && errno != EINTR && errno != EAGAIN) {
+      perror(argv[1]);
+      break;
+    }
+    if (n <= 0) {
+      if (!tty || nowMs() - lastByteMs > kSilenceMs) break;
+      continue;
+    }
+    lastByteMs = nowMs();
+    buf.insert(buf.end(), in, in + n);
+    for (;;) {
+      bool headerSeen = false;
+      size_t used = parseFrames(t, buf.data(), buf.size(), headerSeen);
+      buf.erase(buf.begin(), buf.begin() + used);
+      if (!headerSeen) break;
+      if (tty) {
+        // El nodo cambia de velocidad tras la cabecera; lo que quede en buf ya
+        // llegó a la velocidad antigua y no vale
+        buf.clear();
+        if (!setBaud(fd, t.baud)) {
+          fprintf(stderr, "Velocidad %u no soportada\n", (unsigned)t.baud);
+          return 1;
+        }
+      }
+    }
+  }
+  if (tty) setBaud(fd, kSerialBaud);
+  close(fd);
+
+  if (!t.started) {
+    fprintf(stderr, "Sin cabecera de exportacion (offset %u fuera del log del nodo?)\n",
+            (unsigned)resume);
+    return 1;
+  }
+  fflush(t.mirror.file);
+  int64_t elapsed = nowMs() - t.startMs;
+  uint32_t rows = rebuildColumns(t.mirror);
+  fclose(t.mirror.file);
+
+  fprintf(stderr, "%s: %u B de log en %u B de tramas, %u filas en columnas",
+          t.complete ? "Completa" : "Incompleta", (unsigned)t.logBytes, (unsigned)t.lineBytes,
+          (unsigned)rows);
+  if (t.badFrames) fprintf(stderr, ", %u tramas descartadas", (unsigned)t.badFrames);
+  fputc('\n', stderr);
+  // Rendimiento útil frente a la velocidad bruta de la línea (10 bits por
+  // byte). Desde una captura el tiempo es el que midió el nodo.
+  if (!tty) elapsed = t.nodeMs;
+  if (elapsed > 0) {
+    float useful = t.logBytes / (float)elapsed;
+    float line = t.baud / 10000.0f;
+    fprintf(stderr, "%.1f kB/s de log, linea %.1f kB/s (%.0f%%), compresion %.2f\n", useful,
+            line, 100.0f * useful / line, t.lineBytes ? t.logBytes / (float)t.lineBytes : 0);
+  }
+  if (!t.complete) {
+    fprintf(stderr, "Para reanudar, repetir la orden: continua en el offset %u\n",
+            (unsigned)t.expected);
+    return 1;
+  }
+  return 0;
+}
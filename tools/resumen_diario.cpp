@@ -0,0 +1,43 @@
+// Vista de temporada en el host: lee resumen_diario.bin copiado de la SD (y,
+// si se quiere, el de la flash interna después) y escribe el mismo CSV que la
+// orden "resumen" de la consola.
+//
+//   make -C tools
+//   tools/resumen_diario /media/sd/resumen_diario.bin > temporada.csv
+#include <stdio.h>
+#include <stdlib.h>
+#include "../nucleo.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "uso: %s resumen_diario.bin [mas ficheros en orden]\n", argv[0]);
+    return 2;
+  }
+  setenv("TZ", ZONA_HORARIA, 1);
+  tzset();
+
+  uint32_t shown = 0;
+  uint32_t corrupt = 0;
+  for (int i = 1; i < argc; i++) {
+    FILE* file = fopen(argv[i], "rb");
+    if (!file) {
+      perror(argv[i]);
+      return 1;
+    }
+    DailySummary summary;
+    while (fread(&summary, sizeof(summary), 1, file) == 1) {
+      if (!dailySummaryValid(summary)) {
+        corrupt++;
+        continue;
+      }
+      if (shown++ == 0) puts(DAILY_CSV_HEADER);
+      char row[96];
+      dailySummaryRow(summary, row, sizeof(row));
+      puts(row);
+    }
+    fclose(file);
+  }
+  if (shown == 0) fprintf(stderr, "Sin resumenes diarios.\n");
+  if (corrupt) fprintf(stderr, "%u registros corruptos omitidos\n", (unsigned)corrupt);
+  return 0;
+}